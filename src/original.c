@@ -15,6 +15,27 @@
 #include <asm/uaccess.h>
 #include <linux/usb.h>
 #include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/uio.h>
+#include <linux/kthread.h>
+#include <linux/sched/mm.h>
+#include <linux/scatterlist.h>
+#include <linux/mm.h>
+#include <linux/llist.h>
+#include <linux/hrtimer.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+#include <linux/jump_label.h>
+#include <linux/kfifo.h>
+#include <linux/vmalloc.h>
+
+#include "osrfx2.h"
+
+#define CREATE_TRACE_POINTS
+#include "osrfx2_trace.h"
 
 #define VENDOR_ID     0x0547       
 #define PRODUCT_ID    0x1002
@@ -29,23 +50,209 @@
 #define READ_SWITCHES 0xD6
 #define IS_HIGH_SPEED 0xD9
 
+/*********************Bulk-in read-ahead limits**********************/
+#define READ_AHEAD_MAX_URBS  64
+#define READ_AHEAD_MAX_SIZE  (1024 * 1024)
+#define READ_NONBLOCK_MS     10      /*ms an O_NONBLOCK read without read-ahead waits*/
+
+/*********************Bulk-in transfer length***********************/
+#define BULK_IN_XFER_MIN     (16 * 1024)
+#define BULK_IN_XFER_MAX     (1024 * 1024)
+
+/*********************Bulk-out write window**************************/
+#define WRITE_MAX_URBS       1024
+#define WRITE_BATCH_MAX      32      /*URBs sharing one completion interrupt*/
+#define WRITE_COALESCE_MAX_US 1000000 /*Longest flush deadline of staged writes*/
+#define WRITE_DRAIN_TIMEOUT  10000   /*ms flush/fsync wait for the pipeline*/
+
+/*nowait argument of the read and write paths, 0 lets them block*/
+#define IO_NONBLOCK          1       /*O_NONBLOCK, a read may still wait READ_NONBLOCK_MS*/
+#define IO_NOWAIT            2       /*IOCB_NOWAIT, nothing may sleep*/
+
+/*********************Device statistics******************************/
+/*Endpoints with their own transfer counters*/
+enum {
+    OSRFX2_EP_BULK_IN,
+    OSRFX2_EP_BULK_OUT,
+    OSRFX2_EP_INT_IN,
+    OSRFX2_EP_CONTROL,
+    OSRFX2_EP_COUNT,
+};
+
+/*Transfer counters kept for each endpoint*/
+enum {
+    OSRFX2_XFER_URBS_SUBMITTED,
+    OSRFX2_XFER_BYTES_SUBMITTED,
+    OSRFX2_XFER_URBS_COMPLETED,
+    OSRFX2_XFER_BYTES_COMPLETED,
+    OSRFX2_XFER_COUNT,
+};
+
+/*Classes of URB status counted as errors*/
+enum {
+    OSRFX2_ERR_STALL,       /*-EPIPE*/
+    OSRFX2_ERR_PROTOCOL,    /*-EPROTO*/
+    OSRFX2_ERR_CRC,         /*-EILSEQ*/
+    OSRFX2_ERR_TIMEOUT,     /*-ETIME, -ETIMEDOUT*/
+    OSRFX2_ERR_OVERFLOW,    /*-EOVERFLOW*/
+    OSRFX2_ERR_UNLINKED,    /*-ENOENT, -ECONNRESET*/
+    OSRFX2_ERR_SHUTDOWN,    /*-ESHUTDOWN, -ENODEV*/
+    OSRFX2_ERR_OTHER,
+    OSRFX2_ERR_COUNT,
+};
+
+/*Operations with a latency histogram in debugfs*/
+enum {
+    OSRFX2_HIST_BULK_OUT,           /*Bulk-out urb, submit to completion*/
+    OSRFX2_HIST_BULK_IN,            /*Bulk-in transfer, submit to completion*/
+    OSRFX2_HIST_INT_IN,             /*Time between two switch reports*/
+    OSRFX2_HIST_READ_7SEG,          /*Vendor requests, submit to completion*/
+    OSRFX2_HIST_SET_7SEG,
+    OSRFX2_HIST_READ_LEDS,
+    OSRFX2_HIST_SET_LEDS,
+    OSRFX2_HIST_READ_SWITCHES,
+    OSRFX2_HIST_IS_HIGH_SPEED,
+    OSRFX2_HIST_COUNT,
+};
+
+#define OSRFX2_HIST_BUCKETS  40      /*Bucket n counts latencies of 2^n to 2^(n+1)-1 ns*/
+
 /**********************Function prototypes***************************/
+struct osrfx2;
+struct osrfx2_wbuf;
+struct osrfx2_ctrl;
+struct osrfx2_aio;
+struct osrfx2_zc;
+struct osrfx2_profile;
+struct osrfx2_file;
+struct osrfx2_stats;
+struct osrfx2_rurb;
+
 static int osrfx2_open(struct inode * inode, struct file * file);
+static int osrfx2_open_file(struct inode * inode, struct file * file);
 static int osrfx2_release(struct inode * inode, struct file * file);
 static ssize_t osrfx2_read(struct file * file, char * buffer, size_t count, loff_t * ppos);
 static ssize_t osrfx2_write(struct file * file, const char * user_buffer, size_t count, loff_t * ppos);
+static ssize_t osrfx2_read_iter(struct kiocb * iocb, struct iov_iter * to);
+static ssize_t osrfx2_write_iter(struct kiocb * iocb, struct iov_iter * from);
+static ssize_t osrfx2_do_read(struct file * file, struct iov_iter * to, struct kiocb * iocb, int nowait);
+static int osrfx2_iocb_nowait(struct kiocb * iocb);
+static int osrfx2_lock_io(struct mutex * lock, int nowait);
+static ssize_t osrfx2_do_write(struct file * file, struct iov_iter * from, struct kiocb * iocb, int nowait);
+static int osrfx2_flush(struct file * file, fl_owner_t id);
+static int osrfx2_fsync(struct file * file, loff_t start, loff_t end, int datasync);
+static __poll_t osrfx2_poll(struct file * file, poll_table * wait);
 static int osrfx2_probe(struct usb_interface * interface, const struct usb_device_id * id);
+static int osrfx2_probe_device(struct usb_interface * interface, const struct usb_device_id * id);
 static void osrfx2_disconnect(struct usb_interface * interface);
 static int osrfx2_suspend(struct usb_interface * intf, pm_message_t message);
 static int osrfx2_resume(struct usb_interface * intf);
 static void osrfx2_delete(struct kref * kref);
 static void write_bulk_callback(struct urb *urb);
+static void read_bulk_callback(struct urb *urb);
+static struct osrfx2_wbuf * osrfx2_wbuf_alloc(struct osrfx2 * fx2dev, size_t size, int pooled);
+static void osrfx2_wbuf_free(struct osrfx2_wbuf * wbuf);
+static struct osrfx2_wbuf * osrfx2_wbuf_get(struct osrfx2 * fx2dev, size_t count);
+static void osrfx2_wbuf_put(struct osrfx2_wbuf * wbuf);
+static ssize_t osrfx2_read_zerocopy(struct osrfx2 * fx2dev, struct iov_iter * to, struct kiocb * iocb);
+static void read_zerocopy_callback(struct urb * urb);
+static ssize_t osrfx2_write_zerocopy(struct osrfx2 * fx2dev, struct iov_iter * from, size_t count, struct kiocb * iocb);
+static void write_zerocopy_callback(struct urb * urb);
+static int osrfx2_zc_wanted(struct osrfx2 * fx2dev, struct iov_iter * iter, size_t count);
+static struct osrfx2_zc * osrfx2_zc_map(struct osrfx2 * fx2dev, struct iov_iter * iter, size_t size, size_t maxp);
+static void osrfx2_zc_free(struct osrfx2_zc * zc);
+static void osrfx2_zc_complete_work(struct work_struct * work);
+static ssize_t osrfx2_write_urbs(struct osrfx2 * fx2dev, struct iov_iter * from, struct kiocb * iocb, int nowait);
+static ssize_t osrfx2_write_coalesce(struct osrfx2 * fx2dev, struct iov_iter * from, struct kiocb * iocb, int nowait);
+static void osrfx2_coalesce_submit(struct osrfx2 * fx2dev, struct osrfx2_wbuf * wbuf, size_t len, gfp_t gfp);
+static void osrfx2_coalesce_flush(struct osrfx2 * fx2dev);
+static int osrfx2_coalesce_pending(struct osrfx2 * fx2dev);
+static void osrfx2_coalesce_drop(struct osrfx2 * fx2dev);
+static enum hrtimer_restart osrfx2_coalesce_timer(struct hrtimer * timer);
+static ssize_t osrfx2_write_batched(struct osrfx2 * fx2dev, struct iov_iter * from, struct kiocb * iocb, int nowait);
+static void osrfx2_write_reap(struct osrfx2 * fx2dev);
+static int osrfx2_write_wait_room(struct osrfx2 * fx2dev, int nowait, unsigned int urbs, size_t count);
+static int osrfx2_write_reserve(struct osrfx2 * fx2dev, unsigned int urbs, size_t count);
+static void osrfx2_write_release(struct osrfx2 * fx2dev, unsigned int urbs, size_t count);
+static int osrfx2_write_drain(struct osrfx2 * fx2dev);
+static int osrfx2_write_room(struct osrfx2 * fx2dev);
+static int osrfx2_read_ahead_start(struct osrfx2 * fx2dev);
+static void osrfx2_read_ahead_stop(struct osrfx2 * fx2dev);
+static void osrfx2_read_ahead_fill(struct osrfx2 * fx2dev);
+static ssize_t osrfx2_read_sync(struct osrfx2 * fx2dev, struct osrfx2_file * fp, struct iov_iter * to, int nowait);
+static ssize_t osrfx2_read_stream(struct osrfx2 * fx2dev, struct osrfx2_file * fp, struct iov_iter * to, int nowait);
+static ssize_t osrfx2_read_messages(struct osrfx2 * fx2dev, struct osrfx2_file * fp, struct iov_iter * to, int nowait);
+static ssize_t osrfx2_read_message_sync(struct osrfx2 * fx2dev, struct osrfx2_file * fp, struct iov_iter * to, int nowait);
+static int osrfx2_ring_peek(struct osrfx2 * fx2dev, struct osrfx2_msg_header * hdr);
+static size_t osrfx2_ring_stream(struct osrfx2 * fx2dev, struct iov_iter * to);
+static void osrfx2_ring_drop_empty(struct osrfx2 * fx2dev);
+static size_t osrfx2_ring_to_iter(struct osrfx2 * fx2dev, struct iov_iter * to, size_t skip, size_t len);
+static void osrfx2_ring_consume(struct osrfx2 * fx2dev, size_t len);
+static ssize_t osrfx2_read_async(struct osrfx2 * fx2dev, struct kiocb * iocb, struct iov_iter * to);
+static void read_async_callback(struct urb * urb);
+static void osrfx2_aio_read_work(struct work_struct * work);
+static void osrfx2_aio_free(struct osrfx2_aio * aio);
 static void interrupt_handler(struct urb * urb);
+static void osrfx2_notify_switches(struct work_struct * work);
 static ssize_t get_switches(struct device *dev, struct device_attribute *attr, char *buf);
 static ssize_t get_bargraph(struct device *dev, struct device_attribute *attr, char *buf);
 static ssize_t set_bargraph(struct device * dev, struct device_attribute *attr, const char *buf,size_t count);
 static ssize_t get_7segment(struct device *dev, struct device_attribute *attr, char *buf);
 static ssize_t set_7segment(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+static ssize_t set_refresh(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+static int osrfx2_vendor_read(struct osrfx2 * fx2dev, __u8 request, unsigned char * value);
+static int osrfx2_vendor_write(struct osrfx2 * fx2dev, __u8 request, unsigned char value);
+static int osrfx2_refresh_shadows(struct osrfx2 * fx2dev);
+static int osrfx2_vendor_is_in(__u8 request);
+static void osrfx2_ctrl_done(struct osrfx2_ctrl * ctrl);
+static struct osrfx2_ctrl * osrfx2_ctrl_alloc(struct osrfx2 * fx2dev);
+static void osrfx2_ctrl_free(struct osrfx2_ctrl * ctrl);
+static int osrfx2_ctrl_submit(struct osrfx2_ctrl * ctrl, __u8 request, unsigned char value);
+static int osrfx2_ctrl_wait(struct osrfx2_ctrl * ctrl);
+static void ctrl_callback(struct urb * urb);
+static int osrfx2_vendor_request(struct osrfx2 * fx2dev, __u8 request, unsigned char * value);
+static int osrfx2_vendor_batch(struct osrfx2 * fx2dev, struct osrfx2_vendor_batch __user * ubatch);
+static long osrfx2_ioctl(struct file * file, unsigned int cmd, unsigned long arg);
+static ssize_t get_read_ahead_urbs(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t set_read_ahead_urbs(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+static ssize_t get_read_ahead_size(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t set_read_ahead_size(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+static const struct osrfx2_profile * osrfx2_select_profile(struct osrfx2 * fx2dev);
+static int osrfx2_int_interval(struct osrfx2 * fx2dev);
+static ssize_t get_speed_profile(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t get_bulk_in_xfer_size(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t set_bulk_in_xfer_size(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+static ssize_t get_write_pool_hits(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t get_write_pool_misses(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t get_write_max_urbs(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t set_write_max_urbs(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+static ssize_t get_write_max_bytes(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t set_write_max_bytes(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+static ssize_t get_write_batch_max(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t set_write_batch_max(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+static ssize_t get_write_urbs_no_interrupt(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t get_write_coalesce_us(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t set_write_coalesce_us(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+static ssize_t get_write_coalesced(struct device *dev, struct device_attribute *attr, char *buf);
+static int osrfx2_submit_urb(struct osrfx2 * fx2dev, struct urb * urb, gfp_t gfp, u64 stamp);
+static void osrfx2_urb_done(struct osrfx2 * fx2dev, struct urb * urb, int hist, u64 start_ns);
+static void osrfx2_stat_submit(struct osrfx2 * fx2dev, int ep, size_t bytes);
+static void osrfx2_stat_done(struct osrfx2 * fx2dev, int ep, int status, size_t bytes);
+static int osrfx2_stat_urb_ep(struct urb * urb);
+static int osrfx2_stat_error(int status);
+static ssize_t get_stat(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t get_stat_inflight(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t get_stat_inflight_peak(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t get_pending_data(struct device *dev, struct device_attribute *attr, char *buf);
+static void osrfx2_hist_record(struct osrfx2 * fx2dev, int hist, u64 ns);
+static void osrfx2_hist_since(struct osrfx2 * fx2dev, int hist, u64 start_ns);
+static int osrfx2_hist_vendor(__u8 request);
+static void osrfx2_debugfs_init(struct osrfx2 * fx2dev);
+static int osrfx2_hist_open(struct inode * inode, struct file * file);
+static int osrfx2_hist_show(struct seq_file * m, void * v);
+static ssize_t osrfx2_hist_write(struct file * file, const char __user * buf, size_t count, loff_t * ppos);
+static ssize_t osrfx2_instrument_read(struct file * file, char __user * buf, size_t count, loff_t * ppos);
+static ssize_t osrfx2_instrument_write(struct file * file, const char __user * buf, size_t count, loff_t * ppos);
 
 /***********************Module structures****************************/
 /*Table of devices that work with this driver*/
@@ -56,6 +263,54 @@ static const struct usb_device_id osrfx2_id_table [] = {
 
 MODULE_DEVICE_TABLE(usb, osrfx2_id_table);
 
+/*Transfer sizing and queue depths chosen at probe from the negotiated speed.
+  Module parameters left at 0 take their value from here, read_ahead_urbs
+  at -1 since 0 turns read-ahead off.*/
+struct osrfx2_profile {
+    const char   * name;            /*Shown in the speed_profile attribute*/
+    size_t         bulk_in_xfer_size;
+    unsigned int   read_ahead_urbs;
+    size_t         read_ahead_size;
+    unsigned int   write_max_urbs;
+    size_t         write_max_bytes;
+    unsigned int   int_in_interval_ms;  /*Switch poll period, 0 = the endpoint's bInterval*/
+};
+
+static const struct osrfx2_profile osrfx2_profile_full = {
+    .name               = "full-speed",
+    .bulk_in_xfer_size  = 16 * 1024,
+    .read_ahead_urbs    = 4,
+    .read_ahead_size    = 4 * 1024,
+    .write_max_urbs     = 8,
+    .write_max_bytes    = 32 * 1024,
+    .int_in_interval_ms = 8,        /*Leave frames to the other devices behind the TT*/
+};
+
+static const struct osrfx2_profile osrfx2_profile_high = {
+    .name               = "high-speed",
+    .bulk_in_xfer_size  = 256 * 1024,
+    .read_ahead_urbs    = 8,
+    .read_ahead_size    = 64 * 1024,
+    .write_max_urbs     = 32,
+    .write_max_bytes    = 1024 * 1024,
+    .int_in_interval_ms = 0,
+};
+
+/*Device statistics, one copy per CPU summed when read through sysfs*/
+struct osrfx2_stats {
+    u64 xfer[OSRFX2_EP_COUNT][OSRFX2_XFER_COUNT];
+    u64 errors[OSRFX2_ERR_COUNT];   /*Failed submissions and completions*/
+    u64 int_events;                 /*Switch reports received*/
+    u64 switch_changes;             /*Reports that changed the switch state*/
+    u64 latency[OSRFX2_HIST_COUNT][OSRFX2_HIST_BUCKETS];   /*log2 histograms in debugfs*/
+};
+
+/*Latency histogram file in debugfs*/
+struct osrfx2_hist_file {
+    struct osrfx2    * fx2dev;
+    int                hist;        /*OSRFX2_HIST_ index*/
+};
+
 /*OSR FX2 private device context structure*/
 struct osrfx2 {    
     struct usb_device    * udev;        /* the usb device for this device */
@@ -85,14 +340,86 @@ struct osrfx2 {
     
     struct kref kref;               /*Reference counter*/
 
+    const struct osrfx2_profile * profile;  /*Speed dependent defaults*/
+
+    struct usb_anchor aio_anchor;   /*Bulk-in URBs of asynchronous and zero-copy reads*/
+
     unsigned char switches;         /*Switch status*/
-    unsigned char segments;         /*7 segment status*/
-    unsigned char leds;             /*LEDs status*/
+    unsigned int switch_seq;        /*Switch reports received, see osrfx2_poll()*/
+    struct delayed_work switches_notify_work;   /*sysfs_notify() of the switches attribute*/
+    unsigned long switches_notified;    /*jiffies of the last notification*/
+    unsigned char segments;         /*7 segment status, shadow of the device*/
+    unsigned char leds;             /*LEDs status, shadow of the device*/
+    int segments_valid;             /*boolean, segments matches the device*/
+    int leds_valid;                 /*boolean, leds matches the device*/
+    struct mutex ctrl_mutex;        /*Serializes users of the shadows*/
+    struct semaphore ctrl_slots;    /*Free entries of the vendor request queue*/
+    struct usb_anchor ctrl_anchor;  /*Vendor requests on the bus*/
 
     atomic_t bulk_write_available;      /*Track usage of the bulk pipes*/
     atomic_t bulk_read_available;
 
-    size_t pending_data;            /*Data tracking for read write*/
+    atomic_long_t pending_data;     /*Data tracking for read write*/
+
+    unsigned int read_ahead_urbs;   /*Bulk-in URBs kept queued, 0 = synchronous reads*/
+    size_t read_ahead_size;         /*Transfer size of each read-ahead URB*/
+    size_t bulk_in_xfer_size;       /*Length of each synchronous or asynchronous read URB,
+                                      also the size of bulk_in_buffer*/
+    int read_ahead_running;         /*boolean, read-ahead URBs may be (re)submitted*/
+
+    unsigned char * bulk_in_ring;   /*Backing store of bulk_in_fifo while streaming*/
+    struct kfifo bulk_in_fifo;      /*Received transfers not yet read by userspace, each
+                                      a struct osrfx2_msg_header and its payload*/
+    atomic_long_t bulk_in_bytes;    /*Payload bytes in the ring not yet read*/
+    size_t bulk_in_partial;         /*Payload bytes of the oldest record already read*/
+    unsigned int bulk_in_seq;       /*Bulk-in transfers completed*/
+    size_t bulk_in_reserved;        /*Ring space promised to in-flight URBs*/
+    int bulk_in_error;              /*Pending read-ahead error for the reader*/
+    spinlock_t bulk_in_lock;        /*Protects the read-ahead state above*/
+    struct usb_anchor bulk_in_anchor;   /*Read-ahead URBs queued on the bus*/
+    struct usb_anchor bulk_in_idle;     /*Read-ahead URBs waiting for ring space*/
+    wait_queue_head_t bulk_in_wait; /*Readers waiting for ring data*/
+    struct mutex read_mutex;        /*Serializes readers draining the ring*/
+
+    struct list_head write_pool;    /*Idle preallocated write buffers*/
+    spinlock_t write_pool_lock;     /*Protects write_pool*/
+    size_t write_pool_bufsize;      /*Size of each pooled buffer*/
+    atomic_long_t write_pool_hits;  /*Writes served from the pool*/
+    atomic_long_t write_pool_misses;    /*Writes that had to allocate*/
+
+    unsigned int write_max_urbs;    /*In-flight write budget in URBs*/
+    size_t write_max_bytes;         /*In-flight write budget in bytes*/
+    unsigned int write_inflight_urbs;   /*Bulk-out URBs submitted and not completed*/
+    size_t write_inflight_bytes;    /*Bytes of those URBs*/
+    spinlock_t write_lock;          /*Protects the in-flight accounting*/
+    wait_queue_head_t write_wait;   /*Writers waiting for room in the window*/
+    struct usb_anchor write_anchor; /*Bulk-out URBs on the bus, drained by flush/fsync*/
+    int write_error;                /*Asynchronous write error for the next write/flush*/
+
+    unsigned int write_batch_max;   /*writev() segments per interrupt, 0 = one urb per call*/
+    struct llist_head write_done;   /*Completed write URBs not yet recycled*/
+    atomic_long_t write_urbs_no_interrupt; /*URBs submitted with URB_NO_INTERRUPT, the HCD may ignore it*/
+    atomic64_t write_batches;       /*Batches submitted, numbering each one*/
+    u64 write_batch_cut;            /*Newest batch cut short by a failed submission, under write_lock*/
+
+    unsigned int write_coalesce_us; /*Flush deadline of staged small writes, 0 = no staging*/
+    struct mutex write_mutex;       /*Keeps writers in order while staging*/
+    spinlock_t coalesce_lock;       /*Protects the staging state below*/
+    struct osrfx2_wbuf * coalesce_wbuf; /*Staging buffer, NULL if empty or claimed by a writer*/
+    size_t coalesce_len;            /*Bytes staged in coalesce_wbuf*/
+    ktime_t coalesce_deadline;      /*When the staged bytes must be on their way*/
+    struct hrtimer coalesce_timer;  /*Sends the staging buffer at the deadline*/
+    atomic_long_t write_coalesced;  /*Writes appended to a staging buffer*/
+
+    int minor;                      /*Minor of the character device, -1 until registered*/
+
+    struct osrfx2_stats __percpu * stats;   /*Counters shown in the stats group*/
+    atomic_t inflight[OSRFX2_EP_COUNT];     /*URBs submitted and not completed*/
+    atomic_t inflight_peak[OSRFX2_EP_COUNT];    /*Highest inflight seen*/
+    u64 int_last_ns;                /*Arrival of the previous switch report, 0 = none*/
+    u64 int_in_submitted_ns;        /*osrfx2_timestamp() of int_in_urb's submission*/
+    struct dentry * debugfs_dir;    /*Per device directory of the latency histograms*/
+    struct osrfx2_hist_file hist_files[OSRFX2_HIST_COUNT];
 
     int suspended;                  /*boolean*/
 
@@ -100,12 +427,94 @@ struct osrfx2 {
     struct mutex io_mutex;          /*used during cleanup after disconnect*/
 };
 
+/*Per open file state*/
+struct osrfx2_file {
+    struct osrfx2    * fx2dev;      /*Device this file was opened on*/
+    unsigned int       switch_seq;  /*Last switch report acknowledged through this file*/
+    unsigned int       read_min;    /*Bytes a read() waits for, 0 = one transfer*/
+    unsigned int       read_inter_ms;   /*Gap after which a started read() returns early*/
+    unsigned int       read_total_ms;   /*Deadline of a whole read(), 0 = default*/
+    int                read_mode;   /*OSRFX2_READ_STREAM or OSRFX2_READ_MESSAGES*/
+};
+
+/*Vendor control request in flight on ep0*/
+struct osrfx2_ctrl {
+    struct osrfx2    * fx2dev;      /*Owning device*/
+    struct urb       * urb;
+    struct osrfx2_ctrl_dma {        /*Separate allocation, only touched by the HC while queued*/
+        struct usb_ctrlrequest setup;
+        unsigned char data;
+    } * dma;
+    void (*complete)(struct osrfx2_ctrl * ctrl);   /*Called from the urb completion*/
+    struct completion  done;        /*Signalled by the default completion*/
+    u64                submitted_ns;    /*ktime_get_ns() at submission*/
+    __u8               request;
+    unsigned char      value;       /*Byte sent or received*/
+    int                status;      /*0 or negative errno once completed*/
+};
+
+/*Bulk-out urb with its DMA buffer, recycled through the write pool*/
+struct osrfx2_wbuf {
+    struct list_head   node;        /*Entry in the write pool while idle*/
+    struct osrfx2    * fx2dev;      /*Owning device*/
+    struct urb       * urb;
+    unsigned char    * buf;         /*Coherent buffer, dma address in urb->transfer_dma*/
+    size_t             size;        /*Allocated size of buf*/
+    int                pooled;      /*boolean, return to the pool instead of freeing*/
+    struct kiocb     * iocb;        /*Asynchronous write to complete, or NULL*/
+    size_t             iocb_bytes;  /*Result for iocb, the whole write*/
+    struct llist_node  done_node;   /*Entry in write_done once completed*/
+    u64                submitted_ns;    /*ktime_get_ns() at submission*/
+    u64                batch;       /*Number of the batch leaving its reap to the tail, or 0*/
+};
+
+/*Context of a read-ahead urb*/
+struct osrfx2_rurb {
+    struct osrfx2    * fx2dev;      /*Owning device*/
+    u64                submitted_ns;    /*ktime_get_ns() at submission*/
+};
+
+/*Bulk transfer straight to or from pinned user pages*/
+struct osrfx2_zc {
+    struct osrfx2    * fx2dev;      /*Owning device*/
+    struct kiocb     * iocb;        /*Asynchronous request to complete, or NULL*/
+    struct urb       * urb;
+    struct page     ** pages;       /*User pages behind the transfer*/
+    unsigned int       npages;
+    int                pinned;      /*boolean, pages must be unpinned when done*/
+    int                dirty;       /*boolean, the device wrote into the pages*/
+    struct scatterlist * sg;        /*One entry per page, handed to the urb*/
+    struct completion  done;        /*Synchronous callers wait here*/
+    struct work_struct work;        /*Unpins and completes iocb in process context*/
+    u64                submitted_ns;    /*ktime_get_ns() at submission*/
+};
+
+/*Asynchronous read in flight*/
+struct osrfx2_aio {
+    struct osrfx2    * fx2dev;      /*Owning device*/
+    struct kiocb     * iocb;        /*Request to complete*/
+    struct urb       * urb;
+    unsigned char    * buf;         /*Transfer buffer*/
+    struct iov_iter    to;          /*Private copy of the caller's iterator*/
+    const void       * to_free;     /*Allocation behind to, from dup_iter()*/
+    struct mm_struct * mm;          /*Address space to copy into*/
+    struct work_struct work;        /*Copies out and completes in process context*/
+    u64                submitted_ns;    /*ktime_get_ns() at submission*/
+};
+
 static const struct file_operations osrfx2_fops = {
     .owner   = THIS_MODULE,
     .open    = osrfx2_open,
     .release = osrfx2_release,
     .read    = osrfx2_read,
     .write   = osrfx2_write,
+    .read_iter  = osrfx2_read_iter,
+    .write_iter = osrfx2_write_iter,
+    .flush   = osrfx2_flush,
+    .fsync   = osrfx2_fsync,
+    .poll    = osrfx2_poll,
+    .unlocked_ioctl = osrfx2_ioctl,
+    .compat_ioctl   = compat_ptr_ioctl,
 };
 
 static struct usb_driver osrfx2_driver = {
@@ -125,6 +534,116 @@ static struct usb_class_driver osrfx2_class = {
     .minor_base = MINOR_BASE,
 };
 
+/*Read-ahead defaults for newly probed devices, tunable per device in sysfs*/
+static int default_read_ahead_urbs = -1;
+module_param_named(read_ahead_urbs, default_read_ahead_urbs, int, 0444);
+MODULE_PARM_DESC(read_ahead_urbs, "Bulk-in URBs kept queued while the device is open for reading (0 = synchronous reads, -1 = speed profile)");
+
+static unsigned int default_read_ahead_size = 0;
+module_param_named(read_ahead_size, default_read_ahead_size, uint, 0444);
+MODULE_PARM_DESC(read_ahead_size, "Transfer size in bytes of each bulk-in read-ahead URB (0 = speed profile)");
+
+/*Bulk-in transfer length for reads without read-ahead, tunable per device in sysfs*/
+static unsigned int default_bulk_in_xfer_size = 0;
+module_param_named(bulk_in_xfer_size, default_bulk_in_xfer_size, uint, 0444);
+MODULE_PARM_DESC(bulk_in_xfer_size, "Length in bytes of each bulk-in read URB, 16 KiB to 1 MiB (0 = speed profile)");
+
+/*Write pool dimensions, allocated once per device at probe time*/
+static unsigned int write_pool_size = 32;
+module_param(write_pool_size, uint, 0444);
+MODULE_PARM_DESC(write_pool_size, "Number of preallocated bulk-out URBs and buffers per device");
+
+static unsigned int write_pool_bufsize = 4096;
+module_param(write_pool_bufsize, uint, 0444);
+MODULE_PARM_DESC(write_pool_bufsize, "Size in bytes of each preallocated bulk-out buffer");
+
+/*In-flight write budget defaults, tunable per device in sysfs*/
+static unsigned int default_write_max_urbs = 0;
+module_param_named(write_max_urbs, default_write_max_urbs, uint, 0444);
+MODULE_PARM_DESC(write_max_urbs, "Bulk-out URBs allowed in flight before write() blocks (0 = speed profile)");
+
+static unsigned int default_write_max_bytes = 0;
+module_param_named(write_max_bytes, default_write_max_bytes, uint, 0444);
+MODULE_PARM_DESC(write_max_bytes, "Bulk-out bytes allowed in flight before write() blocks (0 = speed profile)");
+
+/*Interrupt moderation of writev() batches, tunable per device in sysfs*/
+static unsigned int default_write_batch_max = 0;
+module_param_named(write_batch_max, default_write_batch_max, uint, 0444);
+MODULE_PARM_DESC(write_batch_max, "writev() segments sent as separate URBs sharing one completion interrupt (0 = one URB per call)");
+
+/*Small-write staging deadline, tunable per device in sysfs*/
+static unsigned int default_write_coalesce_us = 0;
+module_param_named(write_coalesce_us, default_write_coalesce_us, uint, 0444);
+MODULE_PARM_DESC(write_coalesce_us, "Stage writes smaller than a pool buffer for up to this many microseconds (0 = send each write at once)");
+
+/*Vendor requests that may be queued on ep0 at the same time*/
+static unsigned int ctrl_queue_depth = 16;
+module_param(ctrl_queue_depth, uint, 0444);
+MODULE_PARM_DESC(ctrl_queue_depth, "Vendor control requests kept in flight per device");
+
+/*Transfers at least this large skip the bounce buffers*/
+static unsigned int zerocopy_min = 64 * 1024;
+module_param(zerocopy_min, uint, 0644);
+MODULE_PARM_DESC(zerocopy_min, "Reads and writes of at least this many bytes use the pinned user pages (0 = always copy)");
+
+/*Statistics and latency histograms, the hot paths skip them with a patched
+  out branch while off. Tracepoints have their own switches in tracefs*/
+static DEFINE_STATIC_KEY_FALSE(osrfx2_instrument);
+
+static int osrfx2_instrument_set(const char * val, const struct kernel_param * kp) {
+    bool on;
+    int retval;
+
+    retval = kstrtobool(val, &on);
+    if (retval)
+        return retval;
+
+    if (on)
+        static_branch_enable(&osrfx2_instrument);
+    else
+        static_branch_disable(&osrfx2_instrument);
+
+    return 0;
+}
+
+static int osrfx2_instrument_get(char * buffer, const struct kernel_param * kp) {
+    return sprintf(buffer, "%c\n", static_key_enabled(&osrfx2_instrument) ? 'Y' : 'N');
+}
+
+static const struct kernel_param_ops osrfx2_instrument_ops = {
+    .set = osrfx2_instrument_set,
+    .get = osrfx2_instrument_get,
+};
+
+module_param_cb(instrument, &osrfx2_instrument_ops, NULL, 0644);
+MODULE_PARM_DESC(instrument, "Keep the sysfs statistics and debugfs latency histograms (default N), also in <debugfs>/" KBUILD_MODNAME "/instrument");
+
+/*boolean, statistics and histograms are being kept*/
+static inline bool osrfx2_instrumented(void) {
+    return static_branch_unlikely(&osrfx2_instrument);
+}
+
+/*Bit 0 of a submission stamp, the urb was counted in the statistics*/
+#define OSRFX2_STAMP_COUNTED 1ULL
+
+/*Submission stamp of an urb, its time or 0 while neither the histograms nor
+  a trace event use it. The completion is counted only if the submission was,
+  so the inflight gauges stay balanced when the key flips meanwhile*/
+static inline u64 osrfx2_timestamp(void) {
+    if (osrfx2_instrumented())
+        return ktime_get_ns() | OSRFX2_STAMP_COUNTED;
+
+    if (trace_osrfx2_urb_complete_enabled() || trace_osrfx2_vendor_request_enabled())
+        return ktime_get_ns() & ~OSRFX2_STAMP_COUNTED;
+
+    return 0;
+}
+
+/*Rate limit of poll() wakeups on the switches attribute*/
+static unsigned int switches_notify_ms = 20;
+module_param(switches_notify_ms, uint, 0644);
+MODULE_PARM_DESC(switches_notify_ms, "Minimum interval in ms between sysfs notifications of the switches attribute");
+
 /***********************Module functions*****************************/
 /*Create device attribute switches*/
 static DEVICE_ATTR(switches, S_IRUGO, get_switches, NULL);
@@ -132,15 +651,175 @@ static DEVICE_ATTR(switches, S_IRUGO, get_switches, NULL);
 static DEVICE_ATTR(bargraph, 0660, get_bargraph, set_bargraph);
 /*Create device attribute 7segment*/
 static DEVICE_ATTR(7segment, 0660, get_7segment, set_7segment);
+/*Create device attribute refresh, re-reads the LED shadows from the device*/
+static DEVICE_ATTR(refresh, 0220, NULL, set_refresh);
+/*Create device attributes for the bulk-in read-ahead*/
+static DEVICE_ATTR(read_ahead_urbs, 0660, get_read_ahead_urbs, set_read_ahead_urbs);
+static DEVICE_ATTR(read_ahead_size, 0660, get_read_ahead_size, set_read_ahead_size);
+/*Create device attribute for the bulk-in read transfer length*/
+static DEVICE_ATTR(bulk_in_xfer_size, 0660, get_bulk_in_xfer_size, set_bulk_in_xfer_size);
+/*Create device attribute naming the speed profile picked at probe*/
+static DEVICE_ATTR(speed_profile, S_IRUGO, get_speed_profile, NULL);
+/*Create device attributes for the write pool counters*/
+static DEVICE_ATTR(write_pool_hits, S_IRUGO, get_write_pool_hits, NULL);
+static DEVICE_ATTR(write_pool_misses, S_IRUGO, get_write_pool_misses, NULL);
+/*Create device attributes for the in-flight write budget*/
+static DEVICE_ATTR(write_max_urbs, 0660, get_write_max_urbs, set_write_max_urbs);
+static DEVICE_ATTR(write_max_bytes, 0660, get_write_max_bytes, set_write_max_bytes);
+/*Create device attributes for the write interrupt moderation*/
+static DEVICE_ATTR(write_batch_max, 0660, get_write_batch_max, set_write_batch_max);
+static DEVICE_ATTR(write_urbs_no_interrupt, S_IRUGO, get_write_urbs_no_interrupt, NULL);
+/*Create device attributes for small-write coalescing*/
+static DEVICE_ATTR(write_coalesce_us, 0660, get_write_coalesce_us, set_write_coalesce_us);
+static DEVICE_ATTR(write_coalesced, S_IRUGO, get_write_coalesced, NULL);
+
+/*Attribute files created for every device*/
+static struct device_attribute * osrfx2_dev_attrs[] = {
+    &dev_attr_switches,
+    &dev_attr_bargraph,
+    &dev_attr_7segment,
+    &dev_attr_refresh,
+    &dev_attr_read_ahead_urbs,
+    &dev_attr_read_ahead_size,
+    &dev_attr_bulk_in_xfer_size,
+    &dev_attr_speed_profile,
+    &dev_attr_write_pool_hits,
+    &dev_attr_write_pool_misses,
+    &dev_attr_write_max_urbs,
+    &dev_attr_write_max_bytes,
+    &dev_attr_write_batch_max,
+    &dev_attr_write_urbs_no_interrupt,
+    &dev_attr_write_coalesce_us,
+    &dev_attr_write_coalesced,
+    NULL,
+};
+
+/*Statistics file showing one u64 counter of struct osrfx2_stats, or the
+  in-flight depth of an endpoint*/
+struct osrfx2_stat_attr {
+    struct device_attribute attr;
+    size_t offset;                  /*Counter in struct osrfx2_stats*/
+    int ep;                         /*Endpoint of the in-flight attributes*/
+};
+
+#define OSRFX2_STAT_ATTR(_name, _member)                                    \
+    static struct osrfx2_stat_attr stat_attr_##_name = {                   \
+        .attr   = __ATTR(_name, S_IRUGO, get_stat, NULL),                   \
+        .offset = offsetof(struct osrfx2_stats, _member),                  \
+    }
+
+#define OSRFX2_XFER_ATTRS(_prefix, _ep)                                     \
+    OSRFX2_STAT_ATTR(_prefix##_urbs_submitted, xfer[_ep][OSRFX2_XFER_URBS_SUBMITTED]);   \
+    OSRFX2_STAT_ATTR(_prefix##_bytes_submitted, xfer[_ep][OSRFX2_XFER_BYTES_SUBMITTED]); \
+    OSRFX2_STAT_ATTR(_prefix##_urbs_completed, xfer[_ep][OSRFX2_XFER_URBS_COMPLETED]);   \
+    OSRFX2_STAT_ATTR(_prefix##_bytes_completed, xfer[_ep][OSRFX2_XFER_BYTES_COMPLETED]); \
+    static struct osrfx2_stat_attr stat_attr_##_prefix##_inflight = {      \
+        .attr = __ATTR(_prefix##_inflight, S_IRUGO, get_stat_inflight, NULL), \
+        .ep   = _ep,                                                        \
+    };                                                                      \
+    static struct osrfx2_stat_attr stat_attr_##_prefix##_inflight_peak = { \
+        .attr = __ATTR(_prefix##_inflight_peak, S_IRUGO, get_stat_inflight_peak, NULL), \
+        .ep   = _ep,                                                        \
+    }
+
+#define OSRFX2_XFER_ATTR_LIST(_prefix)                                      \
+    &stat_attr_##_prefix##_urbs_submitted.attr.attr,                        \
+    &stat_attr_##_prefix##_bytes_submitted.attr.attr,                       \
+    &stat_attr_##_prefix##_urbs_completed.attr.attr,                        \
+    &stat_attr_##_prefix##_bytes_completed.attr.attr,                       \
+    &stat_attr_##_prefix##_inflight.attr.attr,                              \
+    &stat_attr_##_prefix##_inflight_peak.attr.attr
+
+/*Create the statistics attributes, stats/<endpoint>_<counter> and stats/errors_<class>*/
+OSRFX2_XFER_ATTRS(bulk_in, OSRFX2_EP_BULK_IN);
+OSRFX2_XFER_ATTRS(bulk_out, OSRFX2_EP_BULK_OUT);
+OSRFX2_XFER_ATTRS(int_in, OSRFX2_EP_INT_IN);
+OSRFX2_XFER_ATTRS(control, OSRFX2_EP_CONTROL);
+OSRFX2_STAT_ATTR(errors_stall, errors[OSRFX2_ERR_STALL]);
+OSRFX2_STAT_ATTR(errors_protocol, errors[OSRFX2_ERR_PROTOCOL]);
+OSRFX2_STAT_ATTR(errors_crc, errors[OSRFX2_ERR_CRC]);
+OSRFX2_STAT_ATTR(errors_timeout, errors[OSRFX2_ERR_TIMEOUT]);
+OSRFX2_STAT_ATTR(errors_overflow, errors[OSRFX2_ERR_OVERFLOW]);
+OSRFX2_STAT_ATTR(errors_unlinked, errors[OSRFX2_ERR_UNLINKED]);
+OSRFX2_STAT_ATTR(errors_shutdown, errors[OSRFX2_ERR_SHUTDOWN]);
+OSRFX2_STAT_ATTR(errors_other, errors[OSRFX2_ERR_OTHER]);
+OSRFX2_STAT_ATTR(int_events, int_events);
+OSRFX2_STAT_ATTR(switch_changes, switch_changes);
+static DEVICE_ATTR(pending_data, S_IRUGO, get_pending_data, NULL);
+
+static struct attribute * osrfx2_stats_attrs[] = {
+    OSRFX2_XFER_ATTR_LIST(bulk_in),
+    OSRFX2_XFER_ATTR_LIST(bulk_out),
+    OSRFX2_XFER_ATTR_LIST(int_in),
+    OSRFX2_XFER_ATTR_LIST(control),
+    &stat_attr_errors_stall.attr.attr,
+    &stat_attr_errors_protocol.attr.attr,
+    &stat_attr_errors_crc.attr.attr,
+    &stat_attr_errors_timeout.attr.attr,
+    &stat_attr_errors_overflow.attr.attr,
+    &stat_attr_errors_unlinked.attr.attr,
+    &stat_attr_errors_shutdown.attr.attr,
+    &stat_attr_errors_other.attr.attr,
+    &stat_attr_int_events.attr.attr,
+    &stat_attr_switch_changes.attr.attr,
+    &dev_attr_pending_data.attr,
+    NULL,
+};
+
+/*Statistics directory created for every device*/
+static const struct attribute_group osrfx2_stats_group = {
+    .name  = "stats",
+    .attrs = osrfx2_stats_attrs,
+};
+
+/*Names of the latency histogram files*/
+static const char * const osrfx2_hist_names[OSRFX2_HIST_COUNT] = {
+    [OSRFX2_HIST_BULK_OUT]      = "bulk_out",
+    [OSRFX2_HIST_BULK_IN]       = "bulk_in",
+    [OSRFX2_HIST_INT_IN]        = "int_in_interval",
+    [OSRFX2_HIST_READ_7SEG]     = "read_7seg",
+    [OSRFX2_HIST_SET_7SEG]      = "set_7seg",
+    [OSRFX2_HIST_READ_LEDS]     = "read_leds",
+    [OSRFX2_HIST_SET_LEDS]      = "set_leds",
+    [OSRFX2_HIST_READ_SWITCHES] = "read_switches",
+    [OSRFX2_HIST_IS_HIGH_SPEED] = "is_high_speed",
+};
+
+/*Latency histogram files, reading shows the histogram, writing resets it*/
+static const struct file_operations osrfx2_hist_fops = {
+    .owner   = THIS_MODULE,
+    .open    = osrfx2_hist_open,
+    .read    = seq_read,
+    .write   = osrfx2_hist_write,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+/*Same switch as the instrument parameter*/
+static const struct file_operations osrfx2_instrument_fops = {
+    .owner   = THIS_MODULE,
+    .open    = simple_open,
+    .read    = osrfx2_instrument_read,
+    .write   = osrfx2_instrument_write,
+    .llseek  = default_llseek,
+};
+
+/*debugfs directory of the module, one subdirectory per device*/
+static struct dentry * osrfx2_debugfs_root;
 
 /*insmod*/
 int init_module(void) {
     int retval;
 
+    osrfx2_debugfs_root = debugfs_create_dir(KBUILD_MODNAME, NULL);
+    debugfs_create_file("instrument", 0600, osrfx2_debugfs_root, NULL, &osrfx2_instrument_fops);
+
     retval = usb_register(&osrfx2_driver);
 
-    if(retval)
+    if(retval) {
         pr_err("usb_register failed. Error number %d", retval);
+        debugfs_remove_recursive(osrfx2_debugfs_root);
+    }
 
     return retval;
 }
@@ -148,9 +827,21 @@ int init_module(void) {
 /*rmmod*/
 void cleanup_module(void) {
     usb_deregister(&osrfx2_driver);
+    debugfs_remove_recursive(osrfx2_debugfs_root);
 }
 
+/*Bind to a device, traced with the time probing took*/
 static int osrfx2_probe(struct usb_interface * intf, const struct usb_device_id * id) {
+    u64 start_ns = ktime_get_ns();
+    int retval;
+
+    retval = osrfx2_probe_device(intf, id);
+    trace_osrfx2_probe_done(intf->minor, retval, ktime_get_ns() - start_ns);
+
+    return retval;
+}
+
+static int osrfx2_probe_device(struct usb_interface * intf, const struct usb_device_id * id) {
     struct usb_device *udev = interface_to_usbdev(intf);
     struct osrfx2 *fx2dev = NULL;
     struct usb_endpoint_descriptor *endpoint;
@@ -171,34 +862,69 @@ static int osrfx2_probe(struct usb_interface * intf, const struct usb_device_id
     /*Set initial fx2dev struct members*/
     kref_init( &fx2dev->kref );
     mutex_init(&fx2dev->io_mutex);
+    mutex_init(&fx2dev->read_mutex);
+    mutex_init(&fx2dev->ctrl_mutex);
+    sema_init(&fx2dev->ctrl_slots, max_t(unsigned int, ctrl_queue_depth, 1));
+    init_usb_anchor(&fx2dev->ctrl_anchor);
     sema_init(&fx2dev->sem, 1);
     init_waitqueue_head(&fx2dev->FieldEventQueue);
+    INIT_DELAYED_WORK(&fx2dev->switches_notify_work, osrfx2_notify_switches);
+    fx2dev->switches_notified = jiffies - msecs_to_jiffies(switches_notify_ms);
+    init_waitqueue_head(&fx2dev->bulk_in_wait);
+    spin_lock_init(&fx2dev->bulk_in_lock);
+    init_usb_anchor(&fx2dev->bulk_in_anchor);
+    init_usb_anchor(&fx2dev->bulk_in_idle);
+    init_usb_anchor(&fx2dev->aio_anchor);
+    INIT_LIST_HEAD(&fx2dev->write_pool);
+    spin_lock_init(&fx2dev->write_pool_lock);
+    spin_lock_init(&fx2dev->write_lock);
+    init_waitqueue_head(&fx2dev->write_wait);
+    init_usb_anchor(&fx2dev->write_anchor);
+    init_llist_head(&fx2dev->write_done);
+    mutex_init(&fx2dev->write_mutex);
+    spin_lock_init(&fx2dev->coalesce_lock);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+    hrtimer_setup(&fx2dev->coalesce_timer, osrfx2_coalesce_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+#else
+    hrtimer_init(&fx2dev->coalesce_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+    fx2dev->coalesce_timer.function = osrfx2_coalesce_timer;
+#endif
     fx2dev->udev = usb_get_dev(udev);
     fx2dev->interface = intf;
+    fx2dev->minor = -1;
     fx2dev->bulk_write_available = (atomic_t) ATOMIC_INIT(1);
     fx2dev->bulk_read_available  = (atomic_t) ATOMIC_INIT(1);
     usb_set_intfdata(intf, fx2dev);
 
-    /*create sysfs attribute files for device components.*/
-    retval = device_create_file(&intf->dev, &dev_attr_switches);
-    if (retval != 0) {
+    /*Statistics are updated from every submission and completion*/
+    fx2dev->stats = alloc_percpu(struct osrfx2_stats);
+    if (!fx2dev->stats) {
+        retval = -ENOMEM;
         dev_err(&intf->dev, "OSR FX2 device probe failed: %d.\n", retval);
         if (fx2dev) kref_put( &fx2dev->kref, osrfx2_delete );
         return retval;
     }
-    retval = device_create_file(&intf->dev, &dev_attr_bargraph);
-    if (retval != 0) {
-        dev_err(&intf->dev, "OSR FX2 device probe failed: %d.\n", retval);
-        if (fx2dev) kref_put( &fx2dev->kref, osrfx2_delete );
-        return retval;
+
+    /*create sysfs attribute files for device components.*/
+    for (i = 0; osrfx2_dev_attrs[i]; i++) {
+        retval = device_create_file(&intf->dev, osrfx2_dev_attrs[i]);
+        if (retval != 0) {
+            dev_err(&intf->dev, "OSR FX2 device probe failed: %d.\n", retval);
+            if (fx2dev) kref_put( &fx2dev->kref, osrfx2_delete );
+            return retval;
+        }
     }
-    retval = device_create_file(&intf->dev, &dev_attr_7segment);
+
+    retval = sysfs_create_group(&intf->dev.kobj, &osrfx2_stats_group);
     if (retval != 0) {
         dev_err(&intf->dev, "OSR FX2 device probe failed: %d.\n", retval);
         if (fx2dev) kref_put( &fx2dev->kref, osrfx2_delete );
         return retval;
     }
 
+    /*Latency histograms, debugfs failures are not fatal*/
+    osrfx2_debugfs_init(fx2dev);
+
     /*Set up the endpoint information*/
     for (i = 0; i < intf->cur_altsetting->desc.bNumEndpoints; i++) {
         endpoint = &intf->cur_altsetting->endpoint[i].desc;
@@ -229,6 +955,32 @@ static int osrfx2_probe(struct usb_interface * intf, const struct usb_device_id
         return retval;
     }
 
+    /*Pick transfer sizes and queue depths for the speed the device came up at*/
+    fx2dev->profile = osrfx2_select_profile(fx2dev);
+
+    fx2dev->write_max_urbs  = clamp_t(unsigned int,
+                                      default_write_max_urbs ? : fx2dev->profile->write_max_urbs,
+                                      1, WRITE_MAX_URBS);
+    fx2dev->write_max_bytes = default_write_max_bytes ? : fx2dev->profile->write_max_bytes;
+    fx2dev->write_batch_max = min_t(unsigned int, default_write_batch_max, WRITE_BATCH_MAX);
+    fx2dev->write_coalesce_us = min_t(unsigned int, default_write_coalesce_us, WRITE_COALESCE_MAX_US);
+
+    /*Read-ahead transfers are whole multiples of the bulk-in packet size*/
+    fx2dev->read_ahead_urbs = min_t(unsigned int,
+                                    default_read_ahead_urbs < 0 ? fx2dev->profile->read_ahead_urbs
+                                                                : default_read_ahead_urbs,
+                                    READ_AHEAD_MAX_URBS);
+    fx2dev->read_ahead_size = clamp_t(size_t,
+                                      default_read_ahead_size ? : fx2dev->profile->read_ahead_size,
+                                      fx2dev->bulk_in_size, READ_AHEAD_MAX_SIZE);
+    fx2dev->read_ahead_size = rounddown(fx2dev->read_ahead_size, fx2dev->bulk_in_size);
+
+    /*So are read transfers, which are no longer limited to a single packet*/
+    fx2dev->bulk_in_xfer_size = clamp_t(size_t,
+                                        default_bulk_in_xfer_size ? : fx2dev->profile->bulk_in_xfer_size,
+                                        BULK_IN_XFER_MIN, BULK_IN_XFER_MAX);
+    fx2dev->bulk_in_xfer_size = rounddown(fx2dev->bulk_in_xfer_size, fx2dev->bulk_in_size);
+
     /*Initialize interrupts*/
     pipe = usb_rcvintpipe(fx2dev->udev, fx2dev->int_in_endpointAddr);
     
@@ -255,10 +1007,11 @@ static int osrfx2_probe(struct usb_interface * intf, const struct usb_device_id
     /*Fill interrupt endpoint urb*/
     usb_fill_int_urb(fx2dev->int_in_urb, fx2dev->udev, pipe, fx2dev->int_in_buffer,
                      fx2dev->int_in_size, interrupt_handler, fx2dev,
-                     fx2dev->int_in_endpointInterval);
+                     osrfx2_int_interval(fx2dev));
 
     /*Submit urb to USB core*/
-    retval = usb_submit_urb( fx2dev->int_in_urb, GFP_KERNEL );
+    fx2dev->int_in_submitted_ns = osrfx2_timestamp();
+    retval = osrfx2_submit_urb(fx2dev, fx2dev->int_in_urb, GFP_KERNEL, fx2dev->int_in_submitted_ns);
     if (retval != 0) {
         dev_err(&fx2dev->udev->dev, "usb_submit_urb error: %d \n", retval);
         if (fx2dev) kref_put(&fx2dev->kref, osrfx2_delete);
@@ -266,7 +1019,7 @@ static int osrfx2_probe(struct usb_interface * intf, const struct usb_device_id
     }
 
     /*Initialize bulk endpoint buffers*/
-    fx2dev->bulk_in_buffer = kmalloc(fx2dev->bulk_in_size, GFP_KERNEL);
+    fx2dev->bulk_in_buffer = kmalloc(fx2dev->bulk_in_xfer_size, GFP_KERNEL);
     if (!fx2dev->bulk_in_buffer) {
         retval = -ENOMEM;
         dev_err(&intf->dev, "OSR FX2 device probe failed: %d.\n", retval);
@@ -281,11 +1034,33 @@ static int osrfx2_probe(struct usb_interface * intf, const struct usb_device_id
         return retval;
     }
 
+    /*Preallocate the bulk-out write pool*/
+    fx2dev->write_pool_bufsize = write_pool_bufsize;
+    for (i = 0; i < write_pool_size; i++) {
+        struct osrfx2_wbuf *wbuf;
+
+        wbuf = osrfx2_wbuf_alloc(fx2dev, fx2dev->write_pool_bufsize, 1);
+        if (!wbuf) {
+            retval = -ENOMEM;
+            dev_err(&intf->dev, "OSR FX2 device probe failed: %d.\n", retval);
+            if (fx2dev) kref_put(&fx2dev->kref, osrfx2_delete);
+            return retval;
+        }
+        list_add(&wbuf->node, &fx2dev->write_pool);
+    }
+
+    /*Load the LED shadows, not fatal as they are then loaded on first use*/
+    retval = osrfx2_refresh_shadows(fx2dev);
+    if (retval < 0)
+        dev_err(&intf->dev, "%s - reading LED state failed: %d\n", __FUNCTION__, retval);
+
     /*Register device*/
     retval = usb_register_dev(intf, &osrfx2_class);
     if (retval != 0) {
         usb_set_intfdata(intf, NULL);
     }
+    else
+        fx2dev->minor = intf->minor;
 
     dev_info(&intf->dev, "OSR FX2 device now attached\n");
 
@@ -294,8 +1069,12 @@ static int osrfx2_probe(struct usb_interface * intf, const struct usb_device_id
 
 static void osrfx2_disconnect(struct usb_interface * intf) {
     struct osrfx2 * fx2dev;
+    u64 start_ns = ktime_get_ns();
+    int minor;
+    int i;
 
     fx2dev = usb_get_intfdata(intf);
+    minor = fx2dev->minor;
     usb_set_intfdata(intf, NULL);
 
     /*Give back minor*/
@@ -304,25 +1083,61 @@ static void osrfx2_disconnect(struct usb_interface * intf) {
     /*Prevent more I/O from starting*/
     mutex_lock(&fx2dev->io_mutex);
     fx2dev->interface = NULL;
+
+    /*Stop streaming and wake a reader blocked on the ring*/
+    osrfx2_read_ahead_stop(fx2dev);
+    wake_up_interruptible(&fx2dev->bulk_in_wait);
     mutex_unlock(&fx2dev->io_mutex);
 
+    /*Fail asynchronous and zero-copy reads still waiting for data*/
+    usb_kill_anchored_urbs(&fx2dev->aio_anchor);
+
+    /*Cancel vendor requests still queued on ep0*/
+    usb_kill_anchored_urbs(&fx2dev->ctrl_anchor);
+
+    /*Staged writes have nowhere to go*/
+    mutex_lock(&fx2dev->write_mutex);
+    osrfx2_coalesce_drop(fx2dev);
+    mutex_unlock(&fx2dev->write_mutex);
+
+    /*Cancel queued writes and wake writers waiting for the window*/
+    usb_kill_anchored_urbs(&fx2dev->write_anchor);
+    wake_up_interruptible(&fx2dev->write_wait);
+
+    /*Let pollers see the hangup*/
+    wake_up(&fx2dev->FieldEventQueue);
+
     /*Release interrupt urb resources*/
     usb_kill_urb(fx2dev->int_in_urb);
+    cancel_delayed_work_sync(&fx2dev->switches_notify_work);
 
     /*Remove sysfs files*/
-    device_remove_file(&intf->dev, &dev_attr_switches);
-    device_remove_file(&intf->dev, &dev_attr_bargraph);
-    device_remove_file(&intf->dev, &dev_attr_7segment);
+    for (i = 0; osrfx2_dev_attrs[i]; i++)
+        device_remove_file(&intf->dev, osrfx2_dev_attrs[i]);
+    sysfs_remove_group(&intf->dev.kobj, &osrfx2_stats_group);
+    debugfs_remove_recursive(fx2dev->debugfs_dir);
+    fx2dev->debugfs_dir = NULL;
 
     /*Decrement usage count*/
     kref_put( &fx2dev->kref, osrfx2_delete );
 
+    trace_osrfx2_disconnect_done(minor, 0, ktime_get_ns() - start_ns);
     dev_info(&intf->dev, "OSR FX2 disconnected.\n");
 }
 
 /*Delete resources used by this device*/
 static void osrfx2_delete(struct kref * kref) {
     struct osrfx2 *fx2dev = container_of(kref, struct osrfx2, kref);
+    struct osrfx2_wbuf *wbuf, *next;
+
+    /*A writer may have staged data after disconnect*/
+    osrfx2_coalesce_drop(fx2dev);
+
+    /*Free the write pool while the usb device is still referenced*/
+    list_for_each_entry_safe(wbuf, next, &fx2dev->write_pool, node) {
+        list_del(&wbuf->node);
+        osrfx2_wbuf_free(wbuf);
+    }
 
     usb_put_dev(fx2dev->udev);
     
@@ -335,23 +1150,31 @@ static void osrfx2_delete(struct kref * kref) {
     if (fx2dev->bulk_out_buffer)
         kfree(fx2dev->bulk_out_buffer);
 
+    /*Probe may have failed after creating the histograms*/
+    debugfs_remove_recursive(fx2dev->debugfs_dir);
+
+    free_percpu(fx2dev->stats);
     kfree(fx2dev);
 }
 
 /*Suspend device*/
 static int osrfx2_suspend(struct usb_interface * intf, pm_message_t message) {
     struct osrfx2 * fx2dev = usb_get_intfdata(intf);
+    u64 start_ns = ktime_get_ns();
 
     if (down_interruptible(&fx2dev->sem))
         return -ERESTARTSYS;
 
     fx2dev->suspended = 1;
+    fx2dev->int_last_ns = 0;    /*The gap until resume is not a report interval*/
      
     /*Stop the interrupt pipe read urb*/
     usb_kill_urb(fx2dev->int_in_urb);
 
     up(&fx2dev->sem);
 
+    trace_osrfx2_suspend_done(fx2dev->minor, 0, ktime_get_ns() - start_ns);
+
     return 0;
 }
 
@@ -360,6 +1183,7 @@ static int osrfx2_resume(struct usb_interface * intf) {
 
     int retval;
     struct osrfx2 * fx2dev = usb_get_intfdata(intf);
+    u64 start_ns = ktime_get_ns();
 
     if (down_interruptible(&fx2dev->sem))
         return -ERESTARTSYS;
@@ -367,7 +1191,8 @@ static int osrfx2_resume(struct usb_interface * intf) {
     fx2dev->suspended = 0;
      
      /*Re-start the interrupt pipe read urb*/
-    retval = usb_submit_urb( fx2dev->int_in_urb, GFP_KERNEL );
+    fx2dev->int_in_submitted_ns = osrfx2_timestamp();
+    retval = osrfx2_submit_urb(fx2dev, fx2dev->int_in_urb, GFP_KERNEL, fx2dev->int_in_submitted_ns);
     
     if (retval) {
         dev_err(&intf->dev, "%s - usb_submit_urb failed %d\n", __FUNCTION__, retval);
@@ -381,16 +1206,34 @@ static int osrfx2_resume(struct usb_interface * intf) {
 
         }
     }
+
+    /*The device may have lost its LED state while suspended*/
+    if (osrfx2_refresh_shadows(fx2dev) < 0)
+        dev_err(&intf->dev, "%s - reading LED state failed\n", __FUNCTION__);
     
     up(&fx2dev->sem);
 
+    /*status is that of restarting the interrupt urb, resume itself never fails*/
+    trace_osrfx2_resume_done(fx2dev->minor, retval, ktime_get_ns() - start_ns);
+
     return 0;
 }
 
-/*Open device for reading and writing*/
+/*Open device for reading and writing, traced with the time opening took*/
 static int osrfx2_open(struct inode * inode, struct file * file) {
+    u64 start_ns = ktime_get_ns();
+    int retval;
+
+    retval = osrfx2_open_file(inode, file);
+    trace_osrfx2_open_done(iminor(inode), retval, ktime_get_ns() - start_ns);
+
+    return retval;
+}
+
+static int osrfx2_open_file(struct inode * inode, struct file * file) {
     struct usb_interface *interface;
     struct osrfx2        *fx2dev;
+    struct osrfx2_file   *fp;
     int retval;
     int flags;
     
@@ -400,12 +1243,20 @@ static int osrfx2_open(struct inode * inode, struct file * file) {
     fx2dev = usb_get_intfdata(interface);
     if (!fx2dev) return -ENODEV;
 
+    /*Per-file state*/
+    fp = kzalloc(sizeof(*fp), GFP_KERNEL);
+    if (!fp) return -ENOMEM;
+
+    fp->fx2dev = fx2dev;
+    fp->switch_seq = smp_load_acquire(&fx2dev->switch_seq);
+
     /*Serialize access to each of the bulk pipes*/
     flags = (file->f_flags & O_ACCMODE);
 
     if ((flags == O_WRONLY) || (flags == O_RDWR)) {
         if (!atomic_dec_and_test( &fx2dev->bulk_write_available )) {
             atomic_inc( &fx2dev->bulk_write_available );
+            kfree(fp);
             return -EBUSY;
         }
 
@@ -422,6 +1273,7 @@ static int osrfx2_open(struct inode * inode, struct file * file) {
             atomic_inc( &fx2dev->bulk_read_available );
             if (flags == O_RDWR)
                 atomic_inc( &fx2dev->bulk_write_available );
+            kfree(fp);
             return -EBUSY;
         }
 
@@ -431,258 +1283,2470 @@ static int osrfx2_open(struct inode * inode, struct file * file) {
             dev_err(&interface->dev, "%s - error(%d) usb_clear_halt(%02X)\n",
                     __FUNCTION__, retval, fx2dev->bulk_in_endpointAddr);
         }
+
+        /*Keep bulk-in URBs queued for this reader if read-ahead is enabled*/
+        if (fx2dev->read_ahead_urbs) {
+            mutex_lock(&fx2dev->io_mutex);
+            retval = osrfx2_read_ahead_start(fx2dev);
+            mutex_unlock(&fx2dev->io_mutex);
+
+            if (retval) {
+                atomic_inc( &fx2dev->bulk_read_available );
+                if (flags == O_RDWR)
+                    atomic_inc( &fx2dev->bulk_write_available );
+                kfree(fp);
+                return retval;
+            }
+        }
     }
 
     /*Set this device as non-seekable*/
     retval = nonseekable_open(inode, file);
-    if (retval) return retval;
+    if (retval) {
+        kfree(fp);
+        return retval;
+    }
 
     /*Increment our usage count for the device*/
     kref_get(&fx2dev->kref);
 
-    /*Save pointer to device instance in the file's private structure*/
-    file->private_data = fx2dev;
+    /*Save pointer to the per-file state in the file's private structure*/
+    file->private_data = fp;
+
+    /*With IOCB_NOWAIT the driver only tries its mutexes and never waits for
+      the device or window space, so io_uring may issue kiocbs inline*/
+    file->f_mode |= FMODE_NOWAIT;
 
     return 0;
 }
 
 /*Release device*/
 static int osrfx2_release(struct inode * inode, struct file * file) {
+    struct osrfx2_file * fp;
     struct osrfx2 * fx2dev;
+    u64 start_ns = ktime_get_ns();
     int flags;
 
-    fx2dev = (struct osrfx2 *)file->private_data;
-    if (!fx2dev)
+    fp = (struct osrfx2_file *)file->private_data;
+    if (!fp)
         return -ENODEV;
 
+    fx2dev = fp->fx2dev;
+
     /*Release any bulk_[write|read]_available serialization*/
     flags = (file->f_flags & O_ACCMODE);
 
     if ((flags == O_WRONLY) || (flags == O_RDWR))
         atomic_inc( &fx2dev->bulk_write_available );
 
-    if ((flags == O_RDONLY) || (flags == O_RDWR))
+    if ((flags == O_RDONLY) || (flags == O_RDWR)) {
+        /*Tear down the read-ahead ring of this reader*/
+        mutex_lock(&fx2dev->io_mutex);
+        osrfx2_read_ahead_stop(fx2dev);
+        vfree(fx2dev->bulk_in_ring);
+        fx2dev->bulk_in_ring = NULL;
+        mutex_unlock(&fx2dev->io_mutex);
+
         atomic_inc( &fx2dev->bulk_read_available );
+    }
  
+    kfree(fp);
+
     /*Decrement the ref-count on the device instance*/
     kref_put(&fx2dev->kref, osrfx2_delete);
 
+    trace_osrfx2_release_done(iminor(inode), 0, ktime_get_ns() - start_ns);
+
     return 0;
 }
 
+/*Device specific ioctls*/
+static long osrfx2_ioctl(struct file * file, unsigned int cmd, unsigned long arg) {
+    struct osrfx2_file *fp = (struct osrfx2_file *)file->private_data;
+    struct osrfx2 *fx2dev = fp->fx2dev;
+    unsigned int seq;
+    int switches;
+    struct osrfx2_read_timing timing;
+    int mode;
+
+    switch (cmd) {
+    case OSRFX2_IOC_SET_READ_MODE:
+        if (get_user(mode, (int __user *)arg))
+            return -EFAULT;
+
+        if (mode != OSRFX2_READ_STREAM && mode != OSRFX2_READ_MESSAGES)
+            return -EINVAL;
+
+        WRITE_ONCE(fp->read_mode, mode);
+        return 0;
+
+    case OSRFX2_IOC_GET_SWITCHES:
+        /*The state is stored before the sequence number is released*/
+        seq = smp_load_acquire(&fx2dev->switch_seq);
+        switches = READ_ONCE(fx2dev->switches);
+        WRITE_ONCE(fp->switch_seq, seq);
+        return put_user(switches, (int __user *)arg);
+
+    case OSRFX2_IOC_VENDOR_BATCH:
+        if (fx2dev->suspended)
+            return -EBUSY;
+        return osrfx2_vendor_batch(fx2dev, (struct osrfx2_vendor_batch __user *)arg);
+
+    case OSRFX2_IOC_SET_READ_TIMING:
+        if (copy_from_user(&timing, (void __user *)arg, sizeof(timing)))
+            return -EFAULT;
+        if (timing.flags)
+            return -EINVAL;
+
+        WRITE_ONCE(fp->read_min, timing.min_bytes);
+        WRITE_ONCE(fp->read_inter_ms, timing.inter_ms);
+        WRITE_ONCE(fp->read_total_ms, timing.total_ms);
+        return 0;
+
+    case OSRFX2_IOC_GET_READ_TIMING:
+        memset(&timing, 0, sizeof(timing));
+        timing.min_bytes = READ_ONCE(fp->read_min);
+        timing.inter_ms  = READ_ONCE(fp->read_inter_ms);
+        timing.total_ms  = READ_ONCE(fp->read_total_ms);
+
+        if (copy_to_user((void __user *)arg, &timing, sizeof(timing)))
+            return -EFAULT;
+        return 0;
+
+    default:
+        return -ENOTTY;
+    }
+}
+
+/*Poll for DIP switch changes, buffered bulk-in data and room in the write window*/
+static __poll_t osrfx2_poll(struct file * file, poll_table * wait) {
+    struct osrfx2_file *fp = (struct osrfx2_file *)file->private_data;
+    struct osrfx2 *fx2dev = fp->fx2dev;
+    struct osrfx2_msg_header hdr;
+    __poll_t mask = 0;
+
+    poll_wait(file, &fx2dev->FieldEventQueue, wait);
+    poll_wait(file, &fx2dev->bulk_in_wait, wait);
+    poll_wait(file, &fx2dev->write_wait, wait);
+
+    if (!READ_ONCE(fx2dev->interface))
+        return EPOLLERR | EPOLLHUP;
+
+    /*read() returns bulk data, so a switch change is signalled as priority
+      data until OSRFX2_IOC_GET_SWITCHES acknowledges it on this file*/
+    if (smp_load_acquire(&fx2dev->switch_seq) != READ_ONCE(fp->switch_seq))
+        mask |= EPOLLPRI;
+
+    /*Without read-ahead a read goes straight to the device, and a
+      non-blocking one waits at most READ_NONBLOCK_MS, so it is always ready*/
+    if (file->f_mode & FMODE_READ) {
+        if (!fx2dev->bulk_in_ring ||
+            (READ_ONCE(fp->read_mode) == OSRFX2_READ_MESSAGES ?
+             osrfx2_ring_peek(fx2dev, &hdr) : atomic_long_read(&fx2dev->bulk_in_bytes) != 0) ||
+            READ_ONCE(fx2dev->bulk_in_error))
+            mask |= EPOLLIN | EPOLLRDNORM;
+    }
+
+    if ((file->f_mode & FMODE_WRITE) && osrfx2_write_room(fx2dev))
+        mask |= EPOLLOUT | EPOLLWRNORM;
+
+    return mask;
+}
+
 /*Read from /dev/osrfx2_0*/
 static ssize_t osrfx2_read(struct file * file, char * buffer, size_t count, loff_t * ppos) {
-    struct osrfx2 *fx2dev;
-    int retval = 0;
-    int bytes_read;
-    int pipe;
+    struct osrfx2_file *fp = (struct osrfx2_file *)file->private_data;
+    u64 start_ns = trace_osrfx2_read_enabled() ? ktime_get_ns() : 0;
+    struct iov_iter to;
+    ssize_t result;
+    int retval;
 
-    fx2dev = (struct osrfx2 *)file->private_data;
+    retval = import_ubuf(ITER_DEST, (void __user *)buffer, count, &to);
+    if (retval)
+        return retval;
 
-    /*Initialize pipe*/
-    pipe = usb_rcvbulkpipe(fx2dev->udev, fx2dev->bulk_in_endpointAddr),
+    result = osrfx2_do_read(file, &to, NULL, (file->f_flags & O_NONBLOCK) ? IO_NONBLOCK : 0);
+    if (start_ns)
+        trace_osrfx2_read(fp->fx2dev->minor, count, result, ktime_get_ns() - start_ns);
 
-    /*Do a blocking bulk read to get data from the device*/
-    retval = usb_bulk_msg(fx2dev->udev, pipe, fx2dev->bulk_in_buffer, min(fx2dev->bulk_in_size, count),
-                          &bytes_read, 10000);
+    return result;
+}
 
-    /*If the read was successful, copy the data to userspace */
-    if (!retval) {
-        if (copy_to_user(buffer, fx2dev->bulk_in_buffer, bytes_read))
-            retval = -EFAULT;
-        else
-            retval = bytes_read;        
-        
-        /*Increment the pending_data counter by the byte count received*/
-        fx2dev->pending_data -= retval;
-    }
+/*readv(), AIO and io_uring reads, asynchronous kiocbs complete from the urb*/
+static ssize_t osrfx2_read_iter(struct kiocb * iocb, struct iov_iter * to) {
+    struct osrfx2_file *fp = (struct osrfx2_file *)iocb->ki_filp->private_data;
+    size_t count = iov_iter_count(to);
+    u64 start_ns = trace_osrfx2_read_enabled() ? ktime_get_ns() : 0;
+    ssize_t result;
 
-    return retval;
+    /*Queued kiocbs report -EIOCBQUEUED here, their urbs are traced on completion.
+      RWF_NOWAIT comes with synchronous kiocbs too, so it is passed on apart*/
+    result = osrfx2_do_read(iocb->ki_filp, to, is_sync_kiocb(iocb) ? NULL : iocb, osrfx2_iocb_nowait(iocb));
+    if (start_ns)
+        trace_osrfx2_read(fp->fx2dev->minor, count, result, ktime_get_ns() - start_ns);
+
+    return result;
 }
 
-/*Write to bulk endpoint*/
-static ssize_t osrfx2_write(struct file * file, const char * user_buffer, size_t count, loff_t * ppos) {
-    struct osrfx2 *fx2dev;
-    struct urb *urb = NULL;
-    char *buf = NULL;
-    int pipe;
-    int retval = 0;
+/*nowait of a kiocb, IOCB_NOWAIT is the stricter of the two*/
+static int osrfx2_iocb_nowait(struct kiocb * iocb) {
+    if (iocb->ki_flags & IOCB_NOWAIT)
+        return IO_NOWAIT;
 
-    fx2dev = (struct osrfx2 *)file->private_data;
+    return (iocb->ki_filp->f_flags & O_NONBLOCK) ? IO_NONBLOCK : 0;
+}
 
-    if (!count) return count;
- 
-    /*Create a urb*/
-    urb = usb_alloc_urb(0, GFP_KERNEL);
+/*Take an I/O mutex, only trying it when the caller must not block*/
+static int osrfx2_lock_io(struct mutex * lock, int nowait) {
+    if (nowait)
+        return mutex_trylock(lock) ? 0 : -EAGAIN;
 
-    if(!urb) {
-        retval = -ENOMEM;
-        usb_free_coherent(fx2dev->udev, count, buf, urb->transfer_dma);
-        usb_free_urb(urb);
-        return retval;
-    }
+    return mutex_lock_interruptible(lock) ? -ERESTARTSYS : 0;
+}
 
-    /*Create urb buffer*/
-    buf = usb_alloc_coherent(fx2dev->udev, count, GFP_KERNEL, &urb->transfer_dma);
+/*Common read path, iocb is NULL for synchronous callers and nowait is
+  IO_NONBLOCK or IO_NOWAIT for O_NONBLOCK and IOCB_NOWAIT*/
+static ssize_t osrfx2_do_read(struct file * file, struct iov_iter * to, struct kiocb * iocb, int nowait) {
+    struct osrfx2_file *fp = (struct osrfx2_file *)file->private_data;
+    struct osrfx2 *fx2dev = fp->fx2dev;
+    size_t count = iov_iter_count(to);
+    int retval = 0;
 
-    if(!buf) {
-        retval = -ENOMEM;
-        usb_free_coherent(fx2dev->udev, count, buf, urb->transfer_dma);
-        usb_free_urb(urb);
-        return retval;
-    }
+    if (!count) return 0;
 
-    /*Copy the data to the buffer*/
-    if(copy_from_user(buf, user_buffer, count)) {
-        retval = -EFAULT;
-        usb_free_coherent(fx2dev->udev, count, buf, urb->transfer_dma);
-        usb_free_urb(urb);
-        return retval;
+    /*Streaming mode, drain the read-ahead ring*/
+    if (fx2dev->bulk_in_ring) {
+        if (READ_ONCE(fp->read_mode) == OSRFX2_READ_MESSAGES)
+            return osrfx2_read_messages(fx2dev, fp, to, nowait);
+        return osrfx2_read_stream(fx2dev, fp, to, nowait);
     }
 
-    /*Initialize the urb*/
-    pipe = usb_sndbulkpipe(fx2dev->udev, fx2dev->bulk_out_endpointAddr);
-    usb_fill_bulk_urb( urb, fx2dev->udev, pipe, buf, count, write_bulk_callback, fx2dev);
-    urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
-
-    /*Send the data out the bulk port*/
-    retval = usb_submit_urb(urb, GFP_KERNEL);
+    /*Nothing is buffered. IOCB_NOWAIT callers retry from a worker,
+      asynchronous kiocbs queue their own urb below and O_NONBLOCK
+      readers wait READ_NONBLOCK_MS for one transfer*/
+    if (nowait == IO_NOWAIT && !iocb)
+        return -EAGAIN;
+
+    /*One record per synchronous transfer, there is no queued urb to complete an iocb*/
+    if (READ_ONCE(fp->read_mode) == OSRFX2_READ_MESSAGES) {
+        if (nowait == IO_NOWAIT)
+            return -EAGAIN;
+        return osrfx2_read_message_sync(fx2dev, fp, to, nowait);
+    }
 
-    if (retval) {
-        dev_err(&fx2dev->interface->dev, "%s - usb_submit_urb failed: %d\n", __FUNCTION__, retval);
-        usb_free_coherent(fx2dev->udev, count, buf, urb->transfer_dma);
-        usb_free_urb(urb);
-        return retval;
+    /*Large reads land in the user pages, falling back to a copy when they can't.
+      A single transfer can't honour read_min, so such files always copy, and
+      a synchronous one waits for the device, so non-blocking callers copy too*/
+    if ((iocb || !nowait) && !READ_ONCE(fp->read_min) && osrfx2_zc_wanted(fx2dev, to, count)) {
+        retval = osrfx2_read_zerocopy(fx2dev, to, iocb);
+        if (retval != -EOPNOTSUPP)
+            return retval;
     }
 
-    /*Increment the pending_data counter by the byte count sent*/
-    fx2dev->pending_data += count;
-     
-    /*Release the reference to this urb*/
-    usb_free_urb(urb);
+    /*Asynchronous kiocb, queue an urb that completes it later*/
+    if (iocb)
+        return osrfx2_read_async(fx2dev, iocb, to);
 
-    return count;
+    return osrfx2_read_sync(fx2dev, fp, to, nowait);
 }
 
-static void write_bulk_callback(struct urb * urb) {
-    struct osrfx2 *fx2dev = (struct osrfx2 *)urb->context;
- 
-    /*  Filter sync and async unlink events as non-errors*/
-    if(urb->status && !(urb->status == -ENOENT || urb->status == -ECONNRESET || urb->status == -ESHUTDOWN))
-        dev_err(&fx2dev->interface->dev, "%s - non-zero status received: %d\n", __FUNCTION__, urb->status);
- 
-    /*Free the spent buffer*/
-    usb_free_coherent( urb->dev, urb->transfer_buffer_length, urb->transfer_buffer, urb->transfer_dma );
-}
+/*Read with blocking bulk transfers until the file's read_min bytes have
+  arrived. Each transfer waits 10 s, or read_inter_ms once data has come in;
+  read_total_ms bounds the whole call. Data received before a timeout or
+  error is returned and the error dropped. A non-blocking read is a single
+  transfer of at most READ_NONBLOCK_MS, -EAGAIN if nothing came.*/
+static ssize_t osrfx2_read_sync(struct osrfx2 * fx2dev, struct osrfx2_file * fp, struct iov_iter * to, int nowait) {
+    unsigned int min_bytes = nowait ? 0 : READ_ONCE(fp->read_min);
+    unsigned int inter_ms  = READ_ONCE(fp->read_inter_ms);
+    unsigned int total_ms  = READ_ONCE(fp->read_total_ms);
+    unsigned long total_end = jiffies + msecs_to_jiffies(total_ms);
+    size_t want, len, copied = 0;
+    unsigned int timeout;
+    int bytes_read = 0;
+    u64 start_ns;
+    int retval = 0;
+    int pipe;
 
-/*DIP switch interrupt handler*/
-static void interrupt_handler(struct urb * urb) {
-    struct osrfx2 *fx2dev = urb->context;
-    unsigned char *buf = urb->transfer_buffer;
-    int retval;
+    want = min_t(size_t, max(min_bytes, 1U), iov_iter_count(to));
 
-    if (urb->status == 0) {
-        fx2dev->switches = *buf; /*Get new switch state*/
+    /*Initialize pipe*/
+    pipe = usb_rcvbulkpipe(fx2dev->udev, fx2dev->bulk_in_endpointAddr);
 
-        wake_up(&(fx2dev->FieldEventQueue)); /*Wake-up any requests enqueued*/
+    /*bulk_in_buffer is shared by all readers and resized through sysfs*/
+    retval = osrfx2_lock_io(&fx2dev->read_mutex, nowait);
+    if (retval)
+        return retval;
 
-        retval = usb_submit_urb(urb, GFP_ATOMIC); /*Restart interrupt urb*/
-        if (retval != 0)
-            dev_err(&urb->dev->dev, "%s - error %d submitting interrupt urb\n", __FUNCTION__, retval);
+    while (copied < want) {
+        timeout = (copied && inter_ms) ? inter_ms : 10000;
+        if (total_ms) {
+            if (time_after_eq(jiffies, total_end)) {
+                retval = -ETIMEDOUT;
+                break;
+            }
+            timeout = max(jiffies_to_msecs(total_end - jiffies), 1U);
+            if (copied && inter_ms)
+                timeout = min(timeout, inter_ms);
+        }
+        if (nowait)
+            timeout = min_t(unsigned int, timeout, READ_NONBLOCK_MS);
+
+        /*Ask for as many whole packets as fit, a short packet completes the transfer early*/
+        len = min(fx2dev->bulk_in_xfer_size, iov_iter_count(to));
+        if (len >= fx2dev->bulk_in_size)
+            len = rounddown(len, fx2dev->bulk_in_size);
+
+        /*Do a blocking bulk read to get data from the device*/
+        start_ns = osrfx2_instrumented() ? ktime_get_ns() : 0;
+        if (start_ns)
+            osrfx2_stat_submit(fx2dev, OSRFX2_EP_BULK_IN, len);
+        retval = usb_bulk_msg(fx2dev->udev, pipe, fx2dev->bulk_in_buffer, len, &bytes_read, timeout);
+        if (start_ns) {
+            osrfx2_stat_done(fx2dev, OSRFX2_EP_BULK_IN, retval, bytes_read);
+            if (retval != -ETIMEDOUT)
+                osrfx2_hist_since(fx2dev, OSRFX2_HIST_BULK_IN, start_ns);
+        }
 
-        return; /*Success*/   
-    }
+        /*A timeout is how inter_ms and total_ms end a read, what had
+          arrived by then is still returned*/
+        if (retval && retval != -ETIMEDOUT)
+            break;
 
-    /*Error*/
-    dev_err(&urb->dev->dev, "%s - non-zero urb status received: %d\n", __FUNCTION__, urb->status);
-}
+        /*Copy the data to userspace*/
+        len = copy_to_iter(fx2dev->bulk_in_buffer, bytes_read, to);
 
-/*Retreive the values of the switches*/
-static ssize_t get_switches(struct device *dev, struct device_attribute *attr, char *buf) {
-    struct usb_interface   *intf   = to_usb_interface(dev);
-    struct osrfx2          *fx2dev = usb_get_intfdata(intf);    
-    int retval;
+        /*Decrement the pending_data counter by the byte count received*/
+        atomic_long_sub(len, &fx2dev->pending_data);
+        copied += len;
 
-    retval = sprintf(buf, "%s%s%s%s%s%s%s%s", /*left sw --> right sw*/
-                    (fx2dev->switches & 0x80) ? "1" : "0",
-                    (fx2dev->switches & 0x40) ? "1" : "0",
-                    (fx2dev->switches & 0x20) ? "1" : "0",
-                    (fx2dev->switches & 0x10) ? "1" : "0",
-                    (fx2dev->switches & 0x08) ? "1" : "0",
-                    (fx2dev->switches & 0x04) ? "1" : "0",
-                    (fx2dev->switches & 0x02) ? "1" : "0",
-                    (fx2dev->switches & 0x01) ? "1" : "0");
+        if (len < bytes_read) {
+            retval = -EFAULT;
+            break;
+        }
 
-    return retval;
-}
+        if (retval)
+            break;
 
-/*Gets the LED bargraph status on the device*/
-static ssize_t get_bargraph(struct device *dev, struct device_attribute *attr, char *buf) {
-    struct usb_interface  *intf   = to_usb_interface(dev);
-    struct osrfx2         *fx2dev = usb_get_intfdata(intf);
-    int retval;
-   
-    if (fx2dev->suspended) {
-        return sprintf(buf, "S ");   /*Device is suspended*/
+        /*Without a threshold one transfer completes the read, as it always has*/
+        if (!min_bytes)
+            break;
     }
 
-    fx2dev->leds = 0;
+    mutex_unlock(&fx2dev->read_mutex);
 
-    /*Get LED values*/
-    retval = usb_control_msg(fx2dev->udev, usb_rcvctrlpipe(fx2dev->udev, 0),
-                             READ_LEDS, USB_DIR_IN | USB_TYPE_VENDOR, 0, 0,
-                             &fx2dev->leds, sizeof(fx2dev->leds),
-                             USB_CTRL_GET_TIMEOUT);
+    if (!copied && nowait && retval == -ETIMEDOUT)
+        return -EAGAIN;
 
-    /*Fill buffer with LED status*/
-    retval = sprintf(buf, "%s%s%s%s%s%s%s%s",
-                     (fx2dev->leds & 0x10) ? "1" : "0",
-                     (fx2dev->leds & 0x08) ? "1" : "0",
-                     (fx2dev->leds & 0x04) ? "1" : "0",
-                     (fx2dev->leds & 0x02) ? "1" : "0",
-                     (fx2dev->leds & 0x01) ? "1" : "0",
-                     (fx2dev->leds & 0x80) ? "1" : "0",
-                     (fx2dev->leds & 0x40) ? "1" : "0",
-                     (fx2dev->leds & 0x20) ? "1" : "0");
-
-    return retval;
+    return copied ? copied : retval;
 }
 
-/*Sets the LED bargraph on the device*/
-static ssize_t set_bargraph(struct device * dev, struct device_attribute *attr, const char *buf,size_t count) {
-    struct usb_interface  *intf   = to_usb_interface(dev);
-    struct osrfx2         *fx2dev = usb_get_intfdata(intf);
-
-    unsigned int value;
+/*Read from the read-ahead ring. Blocks until the file's read_min bytes are
+  buffered (at least one), unless nowait. Once data is buffered, read_inter_ms
+  without a new transfer returns it early; read_total_ms bounds the wait.*/
+static ssize_t osrfx2_read_stream(struct osrfx2 * fx2dev, struct osrfx2_file * fp, struct iov_iter * to, int nowait) {
+    unsigned int inter_ms = READ_ONCE(fp->read_inter_ms);
+    unsigned int total_ms = READ_ONCE(fp->read_total_ms);
+    unsigned long total_end = jiffies + msecs_to_jiffies(total_ms);
+    unsigned long timeout;
+    size_t want, avail;
+    unsigned int ring_len;
+    size_t copied;
+    long left;
     int retval;
-    char *end;
 
-    fx2dev->leds = 0;
+    /*Half the ring at most, beyond that parked URBs could never fill it*/
+    want = min3((size_t)max(READ_ONCE(fp->read_min), 1U), iov_iter_count(to),
+                (size_t)kfifo_size(&fx2dev->bulk_in_fifo) / 2);
 
-    /*convert buffer to unsigned long*/
+    retval = osrfx2_lock_io(&fx2dev->read_mutex, nowait);
+    if (retval)
+        return retval;
+
+    while ((avail = atomic_long_read(&fx2dev->bulk_in_bytes)) < want) {
+        /*Records without payload only take up room here, let URBs have it back*/
+        if (!avail) {
+            osrfx2_ring_drop_empty(fx2dev);
+            osrfx2_read_ahead_fill(fx2dev);
+        }
+        ring_len = kfifo_len(&fx2dev->bulk_in_fifo);
+
+        if (!avail) {
+            /*Report a failed transfer once, then restart the stream*/
+            retval = xchg(&fx2dev->bulk_in_error, 0);
+            if (retval) {
+                if (retval == -EPIPE)
+                    usb_clear_halt(fx2dev->udev, usb_rcvbulkpipe(fx2dev->udev, fx2dev->bulk_in_endpointAddr));
+                osrfx2_read_ahead_fill(fx2dev);
+                goto out;
+            }
+
+            if (!fx2dev->read_ahead_running) {
+                retval = -ENODEV;   /*Device was disconnected*/
+                goto out;
+            }
+        }
+        /*Hand out what is buffered, the error is reported by the next read*/
+        else if (READ_ONCE(fx2dev->bulk_in_error) || !READ_ONCE(fx2dev->read_ahead_running))
+            break;
+
+        if (nowait) {
+            if (avail)
+                break;
+            retval = -EAGAIN;
+            goto out;
+        }
+
+        timeout = (avail && inter_ms) ? msecs_to_jiffies(inter_ms) : MAX_SCHEDULE_TIMEOUT;
+        if (total_ms)
+            timeout = time_after_eq(jiffies, total_end) ? 0 : min(timeout, total_end - jiffies);
+
+        left = 0;
+        if (timeout)
+            left = wait_event_interruptible_timeout(fx2dev->bulk_in_wait,
+                                                    kfifo_len(&fx2dev->bulk_in_fifo) != ring_len ||
+                                                    READ_ONCE(fx2dev->bulk_in_error) ||
+                                                    !READ_ONCE(fx2dev->read_ahead_running),
+                                                    timeout);
+        if (left < 0) {
+            retval = left;
+            goto out;
+        }
+
+        /*Timed out without a new transfer*/
+        if (left == 0 && kfifo_len(&fx2dev->bulk_in_fifo) == ring_len) {
+            if (avail)
+                break;
+            retval = -ETIMEDOUT;
+            goto out;
+        }
+    }
+
+    copied = osrfx2_ring_stream(fx2dev, to);
+    if (copied) {
+        retval = copied;
+
+        /*Decrement the pending_data counter by the byte count received*/
+        atomic_long_sub(copied, &fx2dev->pending_data);
+    }
+    else
+        retval = -EFAULT;
+
+    /*Ring space was freed, requeue parked URBs*/
+    osrfx2_read_ahead_fill(fx2dev);
+
+out:
+    mutex_unlock(&fx2dev->read_mutex);
+    return retval;
+}
+
+/*Read whole records from the read-ahead ring, as many as fit in the read.
+  Blocks for the first record unless nowait; read_total_ms bounds the wait.*/
+static ssize_t osrfx2_read_messages(struct osrfx2 * fx2dev, struct osrfx2_file * fp, struct iov_iter * to, int nowait) {
+    unsigned int total_ms = READ_ONCE(fp->read_total_ms);
+    unsigned long total_end = jiffies + msecs_to_jiffies(total_ms);
+    struct osrfx2_msg_header hdr;
+    unsigned long timeout;
+    size_t copied = 0;
+    size_t skip;
+    long left;
+    int retval = 0;
+
+    retval = osrfx2_lock_io(&fx2dev->read_mutex, nowait);
+    if (retval)
+        return retval;
+
+    while (!osrfx2_ring_peek(fx2dev, &hdr)) {
+        /*The failed transfer is reported in its own record, just restart the stream*/
+        retval = xchg(&fx2dev->bulk_in_error, 0);
+        if (retval) {
+            if (retval == -EPIPE)
+                usb_clear_halt(fx2dev->udev, usb_rcvbulkpipe(fx2dev->udev, fx2dev->bulk_in_endpointAddr));
+            osrfx2_read_ahead_fill(fx2dev);
+            retval = 0;
+            continue;
+        }
+
+        if (!fx2dev->read_ahead_running) {
+            retval = -ENODEV;   /*Device was disconnected*/
+            goto out;
+        }
+
+        if (nowait) {
+            retval = -EAGAIN;
+            goto out;
+        }
+
+        timeout = MAX_SCHEDULE_TIMEOUT;
+        if (total_ms)
+            timeout = time_after_eq(jiffies, total_end) ? 0 : total_end - jiffies;
+
+        left = 0;
+        if (timeout)
+            left = wait_event_interruptible_timeout(fx2dev->bulk_in_wait,
+                                                    osrfx2_ring_peek(fx2dev, &hdr) ||
+                                                    READ_ONCE(fx2dev->bulk_in_error) ||
+                                                    !READ_ONCE(fx2dev->read_ahead_running),
+                                                    timeout);
+        if (left < 0) {
+            retval = left;
+            goto out;
+        }
+
+        if (left == 0 && !osrfx2_ring_peek(fx2dev, &hdr)) {
+            retval = -ETIMEDOUT;
+            goto out;
+        }
+    }
+
+    do {
+        /*A record a stream reader took part of is handed out with the rest*/
+        skip = sizeof(hdr) + fx2dev->bulk_in_partial;
+        hdr.length -= fx2dev->bulk_in_partial;
+
+        if (sizeof(hdr) + hdr.length > iov_iter_count(to))
+            break;
+
+        if (copy_to_iter(&hdr, sizeof(hdr), to) != sizeof(hdr) ||
+            osrfx2_ring_to_iter(fx2dev, to, skip, hdr.length) != hdr.length) {
+            retval = -EFAULT;
+            break;
+        }
+
+        osrfx2_ring_consume(fx2dev, skip + hdr.length);
+        fx2dev->bulk_in_partial = 0;
+        atomic_long_sub(hdr.length, &fx2dev->bulk_in_bytes);
+
+        /*Decrement the pending_data counter by the byte count received*/
+        atomic_long_sub(hdr.length, &fx2dev->pending_data);
+
+        copied += sizeof(hdr) + hdr.length;
+    } while (osrfx2_ring_peek(fx2dev, &hdr));
+
+    /*The first record does not fit in the caller's buffer*/
+    if (!copied && !retval)
+        retval = -EMSGSIZE;
+
+    /*Ring space was freed, requeue parked URBs*/
+    osrfx2_read_ahead_fill(fx2dev);
+
+out:
+    mutex_unlock(&fx2dev->read_mutex);
+    return copied ? copied : retval;
+}
+
+/*Read one record straight from the device without read-ahead. A failed
+  transfer is reported in the record, as is a timeout that cut a transfer
+  short; a timeout before any data arrived returns -ETIMEDOUT, or -EAGAIN
+  for a non-blocking read, which waits at most READ_NONBLOCK_MS.*/
+static ssize_t osrfx2_read_message_sync(struct osrfx2 * fx2dev, struct osrfx2_file * fp, struct iov_iter * to, int nowait) {
+    unsigned int total_ms = READ_ONCE(fp->read_total_ms);
+    unsigned int timeout = total_ms ? total_ms : 10000;
+    struct osrfx2_msg_header hdr;
+    size_t len;
+    int bytes_read = 0;
+    u64 start_ns;
+    int retval;
+    int pipe;
+
+    if (iov_iter_count(to) <= sizeof(hdr))
+        return -EMSGSIZE;
+
+    pipe = usb_rcvbulkpipe(fx2dev->udev, fx2dev->bulk_in_endpointAddr);
+
+    if (nowait)
+        timeout = min_t(unsigned int, timeout, READ_NONBLOCK_MS);
+
+    /*bulk_in_buffer is shared by all readers and resized through sysfs*/
+    retval = osrfx2_lock_io(&fx2dev->read_mutex, nowait);
+    if (retval)
+        return retval;
+
+    /*Ask for as many whole packets as fit behind the header*/
+    len = min(fx2dev->bulk_in_xfer_size, iov_iter_count(to) - sizeof(hdr));
+    if (len >= fx2dev->bulk_in_size)
+        len = rounddown(len, fx2dev->bulk_in_size);
+
+    start_ns = osrfx2_instrumented() ? ktime_get_ns() : 0;
+    if (start_ns)
+        osrfx2_stat_submit(fx2dev, OSRFX2_EP_BULK_IN, len);
+    retval = usb_bulk_msg(fx2dev->udev, pipe, fx2dev->bulk_in_buffer, len, &bytes_read, timeout);
+    if (start_ns) {
+        osrfx2_stat_done(fx2dev, OSRFX2_EP_BULK_IN, retval, bytes_read);
+        if (retval != -ETIMEDOUT)
+            osrfx2_hist_since(fx2dev, OSRFX2_HIST_BULK_IN, start_ns);
+    }
+    if (retval == -ETIMEDOUT && !bytes_read) {
+        if (nowait)
+            retval = -EAGAIN;
+        goto out;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.length       = (retval && retval != -ETIMEDOUT) ? 0 : bytes_read;
+    hdr.status       = retval;
+    hdr.timestamp_ns = ktime_get_ns();
+    hdr.seq          = ++fx2dev->bulk_in_seq;
+
+    retval = -EFAULT;
+    if (copy_to_iter(&hdr, sizeof(hdr), to) != sizeof(hdr) ||
+        copy_to_iter(fx2dev->bulk_in_buffer, hdr.length, to) != hdr.length)
+        goto out;
+
+    /*Decrement the pending_data counter by the byte count received*/
+    atomic_long_sub(hdr.length, &fx2dev->pending_data);
+    retval = sizeof(hdr) + hdr.length;
+
+out:
+    mutex_unlock(&fx2dev->read_mutex);
+    return retval;
+}
+
+/*Peek at the header of the oldest record, returns 0 unless the whole record
+  is in the ring. The producer publishes header and payload separately.*/
+static int osrfx2_ring_peek(struct osrfx2 * fx2dev, struct osrfx2_msg_header * hdr) {
+    unsigned int len = kfifo_len(&fx2dev->bulk_in_fifo);
+
+    if (len < sizeof(*hdr))
+        return 0;
+
+    if (kfifo_out_peek(&fx2dev->bulk_in_fifo, (unsigned char *)hdr, sizeof(*hdr)) != sizeof(*hdr))
+        return 0;
+
+    return len >= sizeof(*hdr) + hdr->length;
+}
+
+/*Copy payload to the iterator, stepping over record headers. A record read
+  in part stays in the ring with bulk_in_partial bytes of it consumed.*/
+static size_t osrfx2_ring_stream(struct osrfx2 * fx2dev, struct iov_iter * to) {
+    struct osrfx2_msg_header hdr;
+    size_t copied = 0;
+    size_t rem, want, n;
+
+    while (iov_iter_count(to) && osrfx2_ring_peek(fx2dev, &hdr)) {
+        rem  = hdr.length - fx2dev->bulk_in_partial;
+        want = min(rem, iov_iter_count(to));
+
+        n = osrfx2_ring_to_iter(fx2dev, to, sizeof(hdr) + fx2dev->bulk_in_partial, want);
+        copied += n;
+
+        if (n == rem) {
+            osrfx2_ring_consume(fx2dev, sizeof(hdr) + hdr.length);
+            fx2dev->bulk_in_partial = 0;
+            continue;
+        }
+
+        fx2dev->bulk_in_partial += n;
+        break;
+    }
+
+    atomic_long_sub(copied, &fx2dev->bulk_in_bytes);
+
+    return copied;
+}
+
+/*Discard records with no payload left for a stream reader*/
+static void osrfx2_ring_drop_empty(struct osrfx2 * fx2dev) {
+    struct osrfx2_msg_header hdr;
+
+    while (osrfx2_ring_peek(fx2dev, &hdr) && hdr.length == fx2dev->bulk_in_partial) {
+        osrfx2_ring_consume(fx2dev, sizeof(hdr) + hdr.length);
+        fx2dev->bulk_in_partial = 0;
+    }
+}
+
+/*Copy len ring bytes starting skip bytes into the ring to an iov_iter, without
+  consuming them. There is no kfifo helper for iterators, so the linear part
+  from kfifo_out_linear_ptr() is copied and then the rest from the start of
+  the buffer; read_mutex makes this the only consumer.*/
+static size_t osrfx2_ring_to_iter(struct osrfx2 * fx2dev, struct iov_iter * to, size_t skip, size_t len) {
+    unsigned char *head;
+    unsigned int linear;
+    size_t first, copied;
+
+    /*Bytes from the head up to the end of the buffer, at most skip + len*/
+    linear = kfifo_out_linear_ptr(&fx2dev->bulk_in_fifo, &head, skip + len);
+
+    /*Pairs with the producer publishing in after its copy*/
+    smp_rmb();
+
+    if (skip >= linear)
+        return copy_to_iter(fx2dev->bulk_in_ring + (skip - linear), len, to);
+
+    first = min_t(size_t, len, linear - skip);
+    copied = copy_to_iter(head + skip, first, to);
+    if (copied == first && len > first)
+        copied += copy_to_iter(fx2dev->bulk_in_ring, len - first, to);
+
+    return copied;
+}
+
+/*Hand len bytes at the head of the ring back to the producer*/
+static void osrfx2_ring_consume(struct osrfx2 * fx2dev, size_t len) {
+    /*Finish reading before the space can be reused*/
+    smp_mb();
+    kfifo_skip_count(&fx2dev->bulk_in_fifo, len);
+}
+
+/*Queue a bulk-in urb for an asynchronous kiocb*/
+static ssize_t osrfx2_read_async(struct osrfx2 * fx2dev, struct kiocb * iocb, struct iov_iter * to) {
+    struct osrfx2_aio *aio;
+    size_t len;
+    int pipe, retval;
+
+    /*Whole packets unless the caller asked for less than one*/
+    len = min_t(size_t, iov_iter_count(to), READ_ONCE(fx2dev->bulk_in_xfer_size));
+    if (len >= fx2dev->bulk_in_size)
+        len = rounddown(len, fx2dev->bulk_in_size);
+
+    aio = kzalloc(sizeof(*aio), GFP_KERNEL);
+    if (!aio)
+        return -ENOMEM;
+
+    aio->fx2dev = fx2dev;
+    aio->iocb   = iocb;
+    aio->buf    = kmalloc(len, GFP_KERNEL);
+    aio->urb    = usb_alloc_urb(0, GFP_KERNEL);
+    if (!aio->buf || !aio->urb) {
+        osrfx2_aio_free(aio);
+        return -ENOMEM;
+    }
+
+    /*The caller's iterator does not outlive this call, keep a copy*/
+    aio->to_free = dup_iter(&aio->to, to, GFP_KERNEL);
+    if (!iter_is_ubuf(&aio->to) && !aio->to_free) {
+        osrfx2_aio_free(aio);
+        return -ENOMEM;
+    }
+
+    /*User memory is copied to from a worker, which borrows this mm*/
+    aio->mm = current->mm;
+    mmgrab(aio->mm);
+    INIT_WORK(&aio->work, osrfx2_aio_read_work);
+
+    pipe = usb_rcvbulkpipe(fx2dev->udev, fx2dev->bulk_in_endpointAddr);
+    usb_fill_bulk_urb(aio->urb, fx2dev->udev, pipe, aio->buf, len, read_async_callback, aio);
+
+    usb_anchor_urb(aio->urb, &fx2dev->aio_anchor);
+    aio->submitted_ns = osrfx2_timestamp();
+    retval = osrfx2_submit_urb(fx2dev, aio->urb, GFP_KERNEL, aio->submitted_ns);
+    if (retval) {
+        usb_unanchor_urb(aio->urb);
+        osrfx2_aio_free(aio);
+        return retval;
+    }
+
+    return -EIOCBQUEUED;
+}
+
+/*Asynchronous bulk-in completion, the copy to user memory needs process context*/
+static void read_async_callback(struct urb * urb) {
+    struct osrfx2_aio *aio = urb->context;
+
+    osrfx2_urb_done(aio->fx2dev, urb, OSRFX2_HIST_BULK_IN, aio->submitted_ns);
+
+    schedule_work(&aio->work);
+}
+
+/*Copy an asynchronous read out and complete its kiocb*/
+static void osrfx2_aio_read_work(struct work_struct * work) {
+    struct osrfx2_aio *aio = container_of(work, struct osrfx2_aio, work);
+    struct kiocb *iocb = aio->iocb;
+    struct urb *urb = aio->urb;
+    ssize_t retval = urb->status;
+
+    if (retval == 0) {
+        retval = -EFAULT;
+
+        if (mmget_not_zero(aio->mm)) {
+            kthread_use_mm(aio->mm);
+            retval = copy_to_iter(aio->buf, urb->actual_length, &aio->to);
+            kthread_unuse_mm(aio->mm);
+            mmput(aio->mm);
+
+            if (retval == 0 && urb->actual_length)
+                retval = -EFAULT;
+            else
+                atomic_long_sub(retval, &aio->fx2dev->pending_data);
+        }
+    }
+
+    osrfx2_aio_free(aio);
+
+    /*Last, this may drop the final reference to the file*/
+    iocb->ki_complete(iocb, retval);
+}
+
+static void osrfx2_aio_free(struct osrfx2_aio * aio) {
+    if (aio->mm)
+        mmdrop(aio->mm);
+    kfree(aio->to_free);
+    usb_free_urb(aio->urb);
+    kfree(aio->buf);
+    kfree(aio);
+}
+
+/*Allocate the read-ahead ring and URBs, then queue them on the bulk-in pipe*/
+static int osrfx2_read_ahead_start(struct osrfx2 * fx2dev) {
+    struct osrfx2_rurb *rurb;
+    struct urb *urb;
+    unsigned char *buf;
+    unsigned int i;
+    size_t ring_size;
+    int pipe, retval;
+
+    /*Leave room for a full set of URBs on top of what the reader has not consumed yet*/
+    ring_size = roundup_pow_of_two(2 * fx2dev->read_ahead_urbs *
+                                   (sizeof(struct osrfx2_msg_header) + fx2dev->read_ahead_size));
+
+    fx2dev->bulk_in_ring = vmalloc(ring_size);
+    if (!fx2dev->bulk_in_ring)
+        return -ENOMEM;
+
+    retval = kfifo_init(&fx2dev->bulk_in_fifo, fx2dev->bulk_in_ring, ring_size);
+    if (retval) {
+        vfree(fx2dev->bulk_in_ring);
+        fx2dev->bulk_in_ring = NULL;
+        return retval;
+    }
+
+    fx2dev->bulk_in_reserved = 0;
+    fx2dev->bulk_in_error = 0;
+    fx2dev->bulk_in_partial = 0;
+    atomic_long_set(&fx2dev->bulk_in_bytes, 0);
+
+    pipe = usb_rcvbulkpipe(fx2dev->udev, fx2dev->bulk_in_endpointAddr);
+
+    for (i = 0; i < fx2dev->read_ahead_urbs; i++) {
+        urb = usb_alloc_urb(0, GFP_KERNEL);
+        if (!urb) {
+            retval = -ENOMEM;
+            break;
+        }
+
+        rurb = kzalloc(sizeof(*rurb), GFP_KERNEL);
+        if (!rurb) {
+            usb_free_urb(urb);
+            retval = -ENOMEM;
+            break;
+        }
+        rurb->fx2dev = fx2dev;
+
+        buf = usb_alloc_coherent(fx2dev->udev, fx2dev->read_ahead_size, GFP_KERNEL, &urb->transfer_dma);
+        if (!buf) {
+            kfree(rurb);
+            usb_free_urb(urb);
+            retval = -ENOMEM;
+            break;
+        }
+
+        usb_fill_bulk_urb(urb, fx2dev->udev, pipe, buf, fx2dev->read_ahead_size,
+                          read_bulk_callback, rurb);
+        urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+
+        /*The idle anchor holds the only reference until the urb is queued*/
+        usb_anchor_urb(urb, &fx2dev->bulk_in_idle);
+        usb_free_urb(urb);
+    }
+
+    if (retval) {
+        dev_err(&fx2dev->interface->dev, "%s - read-ahead setup failed: %d\n", __FUNCTION__, retval);
+        osrfx2_read_ahead_stop(fx2dev);
+        vfree(fx2dev->bulk_in_ring);
+        fx2dev->bulk_in_ring = NULL;
+        return retval;
+    }
+
+    fx2dev->read_ahead_running = 1;
+    osrfx2_read_ahead_fill(fx2dev);
+
+    return 0;
+}
+
+/*Cancel the read-ahead URBs and free them, the ring itself is kept for the reader*/
+static void osrfx2_read_ahead_stop(struct osrfx2 * fx2dev) {
+    struct urb *urb;
+    unsigned long flags;
+
+    spin_lock_irqsave(&fx2dev->bulk_in_lock, flags);
+    fx2dev->read_ahead_running = 0;
+    spin_unlock_irqrestore(&fx2dev->bulk_in_lock, flags);
+
+    /*Killed URBs see read_ahead_running == 0 and park on the idle anchor*/
+    usb_kill_anchored_urbs(&fx2dev->bulk_in_anchor);
+
+    while ((urb = usb_get_from_anchor(&fx2dev->bulk_in_idle)) != NULL) {
+        usb_free_coherent(urb->dev, urb->transfer_buffer_length,
+                          urb->transfer_buffer, urb->transfer_dma);
+        kfree(urb->context);
+        usb_free_urb(urb);
+    }
+}
+
+/*Queue parked read-ahead URBs for as long as the ring can take their data*/
+static void osrfx2_read_ahead_fill(struct osrfx2 * fx2dev) {
+    struct urb *urb;
+    unsigned long flags;
+    int retval;
+
+    spin_lock_irqsave(&fx2dev->bulk_in_lock, flags);
+
+    while (fx2dev->read_ahead_running &&
+           kfifo_avail(&fx2dev->bulk_in_fifo) >= fx2dev->bulk_in_reserved +
+                                                 sizeof(struct osrfx2_msg_header) + fx2dev->read_ahead_size) {
+        urb = usb_get_from_anchor(&fx2dev->bulk_in_idle);
+        if (!urb)
+            break;
+
+        usb_anchor_urb(urb, &fx2dev->bulk_in_anchor);
+        ((struct osrfx2_rurb *)urb->context)->submitted_ns = osrfx2_timestamp();
+        retval = osrfx2_submit_urb(fx2dev, urb, GFP_ATOMIC, ((struct osrfx2_rurb *)urb->context)->submitted_ns);
+        if (retval) {
+            usb_unanchor_urb(urb);
+            usb_anchor_urb(urb, &fx2dev->bulk_in_idle);
+            usb_free_urb(urb);
+            fx2dev->bulk_in_error = retval;
+            break;
+        }
+
+        fx2dev->bulk_in_reserved += sizeof(struct osrfx2_msg_header) + urb->transfer_buffer_length;
+        usb_free_urb(urb);
+    }
+
+    spin_unlock_irqrestore(&fx2dev->bulk_in_lock, flags);
+}
+
+/*Write to bulk endpoint*/
+static ssize_t osrfx2_write(struct file * file, const char * user_buffer, size_t count, loff_t * ppos) {
+    struct iov_iter from;
+    int retval;
+
+    retval = import_ubuf(ITER_SOURCE, (void __user *)user_buffer, count, &from);
+    if (retval)
+        return retval;
+
+    return osrfx2_do_write(file, &from, NULL, (file->f_flags & O_NONBLOCK) ? IO_NONBLOCK : 0);
+}
+
+/*writev(), AIO and io_uring writes, asynchronous kiocbs complete from the urb*/
+static ssize_t osrfx2_write_iter(struct kiocb * iocb, struct iov_iter * from) {
+    /*RWF_NOWAIT comes with synchronous kiocbs too, so it is passed on apart*/
+    return osrfx2_do_write(iocb->ki_filp, from, is_sync_kiocb(iocb) ? NULL : iocb, osrfx2_iocb_nowait(iocb));
+}
+
+/*Common write path. Synchronous callers return once the urb is queued,
+  an asynchronous iocb is completed by write_bulk_callback(). Nothing
+  blocks when nowait is set for O_NONBLOCK and IOCB_NOWAIT*/
+static ssize_t osrfx2_do_write(struct file * file, struct iov_iter * from, struct kiocb * iocb, int nowait) {
+    struct osrfx2 *fx2dev;
+    size_t count = iov_iter_count(from);
+    ssize_t retval = 0;
+
+    fx2dev = ((struct osrfx2_file *)file->private_data)->fx2dev;
+
+    if (!count) return count;
+
+    /*Report an error from an earlier asynchronous write*/
+    retval = xchg(&fx2dev->write_error, 0);
+    if (retval)
+        return retval;
+
+    /*Small writes are staged and sent together while coalescing is on,
+      and whatever is still staged goes out ahead of any other write*/
+    if (smp_load_acquire(&fx2dev->write_coalesce_us) || osrfx2_coalesce_pending(fx2dev)) {
+        retval = osrfx2_lock_io(&fx2dev->write_mutex, nowait);
+        if (retval)
+            return retval;
+
+        if (READ_ONCE(fx2dev->write_coalesce_us) && count < fx2dev->write_pool_bufsize)
+            retval = osrfx2_write_coalesce(fx2dev, from, iocb, nowait);
+        else {
+            /*Staged bytes go out ahead of this write*/
+            osrfx2_coalesce_flush(fx2dev);
+            retval = osrfx2_write_urbs(fx2dev, from, iocb, nowait);
+        }
+
+        mutex_unlock(&fx2dev->write_mutex);
+        return retval;
+    }
+
+    return osrfx2_write_urbs(fx2dev, from, iocb, nowait);
+}
+
+/*Queue the write as bulk-out URBs, from the user pages or copied*/
+static ssize_t osrfx2_write_urbs(struct osrfx2 * fx2dev, struct iov_iter * from, struct kiocb * iocb, int nowait) {
+    struct osrfx2_wbuf *wbuf;
+    size_t count = iov_iter_count(from);
+    size_t max_bytes;
+    int zerocopy;
+    int pipe;
+    int retval;
+
+    /*Multi-segment writev() goes out one urb per segment when batching is on*/
+    if (READ_ONCE(fx2dev->write_batch_max) && iter_is_iovec(from) && from->nr_segs > 1)
+        return osrfx2_write_batched(fx2dev, from, iocb, nowait);
+
+    /*Large writes are sent from the user pages, falling back to a copy when they can't be.
+      A synchronous one waits for the device, so non-blocking callers always copy*/
+    zerocopy = (iocb || !nowait) && osrfx2_zc_wanted(fx2dev, from, count);
+
+    /*One pinned urb is at most the write window, the caller gets a short count*/
+    max_bytes = READ_ONCE(fx2dev->write_max_bytes);
+    if (zerocopy && count > max_bytes)
+        count = rounddown(max_bytes, fx2dev->bulk_out_size) ? : max_bytes;
+
+    /*Claim room in the in-flight window, blocking unless O_NONBLOCK/IOCB_NOWAIT*/
+    retval = osrfx2_write_wait_room(fx2dev, nowait, 1, count);
+    if (retval)
+        return retval;
+
+    if (zerocopy) {
+        retval = osrfx2_write_zerocopy(fx2dev, from, count, iocb);
+        if (retval != -EOPNOTSUPP)
+            return retval;
+    }
+
+    /*Take a recycled urb and buffer, the allocator is only hit on a pool miss*/
+    wbuf = osrfx2_wbuf_get(fx2dev, count);
+    if (!wbuf) {
+        osrfx2_write_release(fx2dev, 1, count);
+        return -ENOMEM;
+    }
+
+    /*Copy the data to the buffer*/
+    if (!copy_from_iter_full(wbuf->buf, count, from)) {
+        osrfx2_wbuf_put(wbuf);
+        osrfx2_write_release(fx2dev, 1, count);
+        return -EFAULT;
+    }
+
+    /*Initialize the urb*/
+    pipe = usb_sndbulkpipe(fx2dev->udev, fx2dev->bulk_out_endpointAddr);
+    usb_fill_bulk_urb(wbuf->urb, fx2dev->udev, pipe, wbuf->buf, count, write_bulk_callback, wbuf);
+    wbuf->urb->transfer_flags &= ~URB_NO_INTERRUPT;
+    wbuf->batch = 0;
+    wbuf->iocb = iocb;
+    wbuf->iocb_bytes = count;
+
+    /*Send the data out the bulk port, tracked until completion by the anchor*/
+    usb_anchor_urb(wbuf->urb, &fx2dev->write_anchor);
+    wbuf->submitted_ns = osrfx2_timestamp();
+    retval = osrfx2_submit_urb(fx2dev, wbuf->urb, GFP_KERNEL, wbuf->submitted_ns);
+
+    if (retval) {
+        dev_err(&fx2dev->udev->dev, "%s - usb_submit_urb failed: %d\n", __FUNCTION__, retval);
+        usb_unanchor_urb(wbuf->urb);
+        osrfx2_wbuf_put(wbuf);
+        osrfx2_write_release(fx2dev, 1, count);
+        return retval;
+    }
+
+    /*Increment the pending_data counter by the byte count sent*/
+    atomic_long_add(count, &fx2dev->pending_data);
+
+    return iocb ? -EIOCBQUEUED : count;
+}
+
+/*Append a small write to the staging buffer, starting a new one when needed.
+  The staged bytes go out when the buffer fills, at the write_coalesce_us
+  deadline of its first write, or on fsync()/close(). Called with write_mutex
+  held, so the only other user of the buffer is the timer.*/
+static ssize_t osrfx2_write_coalesce(struct osrfx2 * fx2dev, struct iov_iter * from, struct kiocb * iocb, int nowait) {
+    struct osrfx2_wbuf *wbuf;
+    size_t count = iov_iter_count(from);
+    ktime_t deadline = 0;
+    size_t len;
+    int retval = 0;
+
+    /*Claim the staging buffer, the timer finds nothing to send meanwhile*/
+    spin_lock_bh(&fx2dev->coalesce_lock);
+    wbuf = fx2dev->coalesce_wbuf;
+    len = fx2dev->coalesce_len;
+    fx2dev->coalesce_wbuf = NULL;
+    spin_unlock_bh(&fx2dev->coalesce_lock);
+
+    /*A firing timer may hold the previous buffer, let it be anchored ahead of this one*/
+    if (!wbuf)
+        hrtimer_cancel(&fx2dev->coalesce_timer);
+
+    /*No room for this write, send what is staged*/
+    if (wbuf && len + count > wbuf->size) {
+        osrfx2_coalesce_submit(fx2dev, wbuf, len, GFP_KERNEL);
+        wbuf = NULL;
+    }
+
+    if (!wbuf) {
+        /*A staging buffer holds window space for its full size until sent*/
+        retval = osrfx2_write_wait_room(fx2dev, nowait, 1, fx2dev->write_pool_bufsize);
+        if (retval)
+            return retval;
+
+        wbuf = osrfx2_wbuf_get(fx2dev, fx2dev->write_pool_bufsize);
+        if (!wbuf) {
+            osrfx2_write_release(fx2dev, 1, fx2dev->write_pool_bufsize);
+            return -ENOMEM;
+        }
+
+        len = 0;
+        deadline = ktime_add_us(ktime_get(), READ_ONCE(fx2dev->write_coalesce_us));
+    }
+
+    /*Copy the data behind what is already staged*/
+    if (copy_from_iter_full(wbuf->buf + len, count, from)) {
+        len += count;
+        atomic_long_add(count, &fx2dev->pending_data);
+        atomic_long_inc(&fx2dev->write_coalesced);
+    }
+    else
+        retval = -EFAULT;
+
+    if (!len) {
+        osrfx2_write_release(fx2dev, 1, wbuf->size);
+        osrfx2_wbuf_put(wbuf);
+        return retval;
+    }
+
+    /*Send a full buffer, or one whose deadline passed while it was claimed*/
+    if (len == wbuf->size ||
+        (!deadline && !ktime_before(ktime_get(), fx2dev->coalesce_deadline))) {
+        osrfx2_coalesce_submit(fx2dev, wbuf, len, GFP_KERNEL);
+        return retval ? retval : count;
+    }
+
+    spin_lock_bh(&fx2dev->coalesce_lock);
+    fx2dev->coalesce_wbuf = wbuf;
+    fx2dev->coalesce_len  = len;
+    if (deadline)
+        fx2dev->coalesce_deadline = deadline;
+    spin_unlock_bh(&fx2dev->coalesce_lock);
+
+    /*Only a new buffer arms the timer, later writes don't push the deadline out*/
+    if (deadline)
+        hrtimer_start(&fx2dev->coalesce_timer, deadline, HRTIMER_MODE_ABS_SOFT);
+
+    return retval ? retval : count;
+}
+
+/*Send len staged bytes of wbuf. Window space is held for the full buffer
+  and the unused part is given back here.*/
+static void osrfx2_coalesce_submit(struct osrfx2 * fx2dev, struct osrfx2_wbuf * wbuf, size_t len, gfp_t gfp) {
+    int pipe;
+    int retval;
+
+    pipe = usb_sndbulkpipe(fx2dev->udev, fx2dev->bulk_out_endpointAddr);
+    usb_fill_bulk_urb(wbuf->urb, fx2dev->udev, pipe, wbuf->buf, len, write_bulk_callback, wbuf);
+    wbuf->urb->transfer_flags &= ~URB_NO_INTERRUPT;
+    wbuf->batch = 0;
+    wbuf->iocb = NULL;
+
+    if (len < wbuf->size)
+        osrfx2_write_release(fx2dev, 0, wbuf->size - len);
+
+    usb_anchor_urb(wbuf->urb, &fx2dev->write_anchor);
+    wbuf->submitted_ns = osrfx2_timestamp();
+    retval = osrfx2_submit_urb(fx2dev, wbuf->urb, gfp, wbuf->submitted_ns);
+
+    /*The writers already returned, report the loss on the next write/flush*/
+    if (retval) {
+        dev_err(&fx2dev->udev->dev, "%s - usb_submit_urb failed: %d\n", __FUNCTION__, retval);
+        usb_unanchor_urb(wbuf->urb);
+        osrfx2_wbuf_put(wbuf);
+        osrfx2_write_release(fx2dev, 1, len);
+        fx2dev->write_error = retval;
+    }
+}
+
+/*Whether staged bytes wait for the staging buffer's deadline or the timer
+  is sending them*/
+static int osrfx2_coalesce_pending(struct osrfx2 * fx2dev) {
+    return READ_ONCE(fx2dev->coalesce_wbuf) || hrtimer_active(&fx2dev->coalesce_timer);
+}
+
+/*Send the staging buffer now, called with write_mutex held so no writer
+  holds the buffer. On return the staged bytes are anchored, also when
+  the timer was sending them.*/
+static void osrfx2_coalesce_flush(struct osrfx2 * fx2dev) {
+    struct osrfx2_wbuf *wbuf;
+    size_t len;
+
+    hrtimer_cancel(&fx2dev->coalesce_timer);
+
+    spin_lock_bh(&fx2dev->coalesce_lock);
+    wbuf = fx2dev->coalesce_wbuf;
+    len = fx2dev->coalesce_len;
+    fx2dev->coalesce_wbuf = NULL;
+    spin_unlock_bh(&fx2dev->coalesce_lock);
+
+    if (wbuf)
+        osrfx2_coalesce_submit(fx2dev, wbuf, len, GFP_KERNEL);
+}
+
+/*Stop the timer and discard the staging buffer*/
+static void osrfx2_coalesce_drop(struct osrfx2 * fx2dev) {
+    struct osrfx2_wbuf *wbuf;
+
+    hrtimer_cancel(&fx2dev->coalesce_timer);
+
+    wbuf = fx2dev->coalesce_wbuf;
+    fx2dev->coalesce_wbuf = NULL;
+
+    if (wbuf) {
+        osrfx2_write_release(fx2dev, 1, wbuf->size);
+        osrfx2_wbuf_put(wbuf);
+    }
+}
+
+/*Flush deadline of the staging buffer, runs in softirq context*/
+static enum hrtimer_restart osrfx2_coalesce_timer(struct hrtimer * timer) {
+    struct osrfx2 *fx2dev = container_of(timer, struct osrfx2, coalesce_timer);
+    struct osrfx2_wbuf *wbuf;
+    size_t len;
+
+    spin_lock(&fx2dev->coalesce_lock);
+    wbuf = fx2dev->coalesce_wbuf;
+    len = fx2dev->coalesce_len;
+    fx2dev->coalesce_wbuf = NULL;
+    spin_unlock(&fx2dev->coalesce_lock);
+
+    /*A writer holding the buffer sends it itself once it sees the deadline passed*/
+    if (wbuf)
+        osrfx2_coalesce_submit(fx2dev, wbuf, len, GFP_ATOMIC);
+
+    return HRTIMER_NORESTART;
+}
+
+/*Send every segment of a writev() as its own urb, up to write_batch_max per
+  batch. Only the last urb of a batch asks for a completion interrupt, the
+  earlier ones are given back in the same HCD pass and recycled together by
+  the last one's callback. Returns the bytes queued, short if a later batch
+  could not be queued.*/
+static ssize_t osrfx2_write_batched(struct osrfx2 * fx2dev, struct iov_iter * from, struct kiocb * iocb, int nowait) {
+    struct osrfx2_wbuf *wbufs[WRITE_BATCH_MAX];
+    struct iov_iter probe;
+    size_t sent = 0;
+    unsigned int limit, n, i;
+    size_t bytes, len;
+    unsigned long flags;
+    u64 batch;
+    int pipe;
+    int retval = 0;
+
+    pipe = usb_sndbulkpipe(fx2dev->udev, fx2dev->bulk_out_endpointAddr);
+
+    while (iov_iter_count(from)) {
+        limit = min3(READ_ONCE(fx2dev->write_batch_max), READ_ONCE(fx2dev->write_max_urbs),
+                     (unsigned int)WRITE_BATCH_MAX);
+        limit = max(limit, 1U);
+
+        /*Size the batch without consuming the iterator*/
+        probe = *from;
+        for (n = 0, bytes = 0; n < limit && iov_iter_count(&probe); ) {
+            len = iov_iter_single_seg_count(&probe);
+            iov_iter_advance(&probe, len);
+            if (len) {
+                n++;
+                bytes += len;
+            }
+        }
+
+        /*The whole batch enters the window at once, so no urb waits on its tail*/
+        retval = osrfx2_write_wait_room(fx2dev, nowait, n, bytes);
+        if (retval)
+            break;
+
+        /*Copy each segment into its own buffer, empty segments are skipped*/
+        batch = atomic64_inc_return(&fx2dev->write_batches);
+        for (i = 0; i < n; i++) {
+            while (!(len = iov_iter_single_seg_count(from)))
+                iov_iter_advance(from, 0);
+
+            wbufs[i] = osrfx2_wbuf_get(fx2dev, len);
+            if (!wbufs[i]) {
+                retval = -ENOMEM;
+                break;
+            }
+
+            if (!copy_from_iter_full(wbufs[i]->buf, len, from)) {
+                osrfx2_wbuf_put(wbufs[i]);
+                retval = -EFAULT;
+                break;
+            }
+
+            usb_fill_bulk_urb(wbufs[i]->urb, fx2dev->udev, pipe, wbufs[i]->buf, len,
+                              write_bulk_callback, wbufs[i]);
+            wbufs[i]->iocb = NULL;
+
+            if (i + 1 < n) {
+                wbufs[i]->urb->transfer_flags |= URB_NO_INTERRUPT;
+                wbufs[i]->batch = batch;
+            } else {
+                wbufs[i]->urb->transfer_flags &= ~URB_NO_INTERRUPT;
+                wbufs[i]->batch = 0;
+            }
+        }
+
+        if (retval) {
+            while (i--) {
+                iov_iter_revert(from, wbufs[i]->urb->transfer_buffer_length);
+                osrfx2_wbuf_put(wbufs[i]);
+            }
+            osrfx2_write_release(fx2dev, n, bytes);
+            break;
+        }
+
+        /*An asynchronous iocb rides on the tail of the final batch*/
+        if (iocb && !iov_iter_count(from)) {
+            wbufs[n - 1]->iocb = iocb;
+            wbufs[n - 1]->iocb_bytes = sent + bytes;
+        }
+
+        for (i = 0; i < n; i++) {
+            usb_anchor_urb(wbufs[i]->urb, &fx2dev->write_anchor);
+            wbufs[i]->submitted_ns = osrfx2_timestamp();
+            retval = osrfx2_submit_urb(fx2dev, wbufs[i]->urb, GFP_KERNEL, wbufs[i]->submitted_ns);
+            if (retval)
+                break;
+        }
+
+        if (retval) {
+            size_t unsent = 0;
+            unsigned int failed = i;
+
+            dev_err(&fx2dev->udev->dev, "%s - usb_submit_urb failed: %d\n", __FUNCTION__, retval);
+
+            for (; i < n; i++) {
+                usb_unanchor_urb(wbufs[i]->urb);
+                unsent += wbufs[i]->urb->transfer_buffer_length;
+                osrfx2_wbuf_put(wbufs[i]);
+            }
+            osrfx2_write_release(fx2dev, n - failed, unsent);
+            iov_iter_revert(from, unsent);
+
+            /*The submitted part has no tail to reap it. Members completing
+              from now on reap themselves, the ones already done are reaped
+              here; the submitted wbufs may be recycled, so only the batch
+              number is published*/
+            if (failed) {
+                spin_lock_irqsave(&fx2dev->write_lock, flags);
+                fx2dev->write_batch_cut = batch;
+                spin_unlock_irqrestore(&fx2dev->write_lock, flags);
+                osrfx2_write_reap(fx2dev);
+            }
+
+            atomic_long_add(bytes - unsent, &fx2dev->pending_data);
+            atomic_long_add(failed, &fx2dev->write_urbs_no_interrupt);
+            sent += bytes - unsent;
+            break;
+        }
+
+        /*Increment the pending_data counter by the byte count sent*/
+        atomic_long_add(bytes, &fx2dev->pending_data);
+        atomic_long_add(n - 1, &fx2dev->write_urbs_no_interrupt);
+        sent += bytes;
+
+        if (!iov_iter_count(from) && iocb)
+            return -EIOCBQUEUED;
+    }
+
+    return sent ? sent : retval;
+}
+
+/*Receive into the user pages behind to with one multi-packet urb. The length
+  is trimmed to whole packets so the device can't overrun the buffer; a short
+  packet ends the transfer early. -EOPNOTSUPP leaves the read to the copy path*/
+static ssize_t osrfx2_read_zerocopy(struct osrfx2 * fx2dev, struct iov_iter * to, struct kiocb * iocb) {
+    struct osrfx2_zc *zc;
+    size_t size;
+    ssize_t retval;
+    long left;
+    int pipe;
+
+    /*Whole packets, at most one read transfer's worth of pinned pages*/
+    size = min_t(size_t, iov_iter_count(to), READ_ONCE(fx2dev->bulk_in_xfer_size));
+    size = rounddown(size, fx2dev->bulk_in_size);
+    if (!size)
+        return -EOPNOTSUPP;
+
+    zc = osrfx2_zc_map(fx2dev, to, size, fx2dev->bulk_in_size);
+    if (!zc)
+        return -EOPNOTSUPP;
+
+    zc->iocb  = iocb;
+    zc->dirty = 1;
+
+    pipe = usb_rcvbulkpipe(fx2dev->udev, fx2dev->bulk_in_endpointAddr);
+    usb_fill_bulk_urb(zc->urb, fx2dev->udev, pipe, NULL, size, read_zerocopy_callback, zc);
+    zc->urb->sg = zc->sg;
+    zc->urb->num_sgs = zc->npages;
+
+    usb_anchor_urb(zc->urb, &fx2dev->aio_anchor);
+    zc->submitted_ns = osrfx2_timestamp();
+    retval = osrfx2_submit_urb(fx2dev, zc->urb, GFP_KERNEL, zc->submitted_ns);
+
+    if (retval) {
+        usb_unanchor_urb(zc->urb);
+        iov_iter_revert(to, size);
+        zc->dirty = 0;
+        osrfx2_zc_free(zc);
+        return retval;
+    }
+
+    if (iocb)
+        return -EIOCBQUEUED;
+
+    /*Same timeout as the copying read*/
+    left = wait_for_completion_killable_timeout(&zc->done, msecs_to_jiffies(10000));
+    if (left <= 0) {
+        usb_kill_urb(zc->urb);
+        wait_for_completion(&zc->done);
+    }
+
+    retval = zc->urb->status ? zc->urb->status : zc->urb->actual_length;
+    if (left == 0 && retval == -ENOENT)
+        retval = -ETIMEDOUT;
+    else if (retval >= 0)
+        iov_iter_revert(to, size - retval);
+
+    osrfx2_zc_free(zc);
+
+    return retval;
+}
+
+/*Zero-copy bulk-in completion*/
+static void read_zerocopy_callback(struct urb * urb) {
+    struct osrfx2_zc *zc = urb->context;
+    struct osrfx2 *fx2dev = zc->fx2dev;
+
+    osrfx2_urb_done(fx2dev, urb, OSRFX2_HIST_BULK_IN, zc->submitted_ns);
+
+    if(urb->status && !(urb->status == -ENOENT || urb->status == -ECONNRESET || urb->status == -ESHUTDOWN))
+        dev_err(&fx2dev->udev->dev, "%s - non-zero status received: %d\n", __FUNCTION__, urb->status);
+    else if (!urb->status)
+        /*Decrement the pending_data counter by the byte count received*/
+        atomic_long_sub(urb->actual_length, &fx2dev->pending_data);
+
+    /*Unpinning and completing the iocb are left to process context*/
+    if (zc->iocb)
+        schedule_work(&zc->work);
+    else
+        complete(&zc->done);
+}
+
+/*Send count bytes of from without copying them. The window space is already
+  reserved; -EOPNOTSUPP leaves it and the iterator to the copy path*/
+static ssize_t osrfx2_write_zerocopy(struct osrfx2 * fx2dev, struct iov_iter * from, size_t count, struct kiocb * iocb) {
+    struct osrfx2_zc *zc;
+    ssize_t retval;
+    int pipe;
+
+    zc = osrfx2_zc_map(fx2dev, from, count, fx2dev->bulk_out_size);
+    if (!zc)
+        return -EOPNOTSUPP;
+
+    zc->iocb = iocb;
+
+    pipe = usb_sndbulkpipe(fx2dev->udev, fx2dev->bulk_out_endpointAddr);
+    usb_fill_bulk_urb(zc->urb, fx2dev->udev, pipe, NULL, count, write_zerocopy_callback, zc);
+    zc->urb->sg = zc->sg;
+    zc->urb->num_sgs = zc->npages;
+
+    usb_anchor_urb(zc->urb, &fx2dev->write_anchor);
+    zc->submitted_ns = osrfx2_timestamp();
+    retval = osrfx2_submit_urb(fx2dev, zc->urb, GFP_KERNEL, zc->submitted_ns);
+
+    if (retval) {
+        dev_err(&fx2dev->udev->dev, "%s - usb_submit_urb failed: %zd\n", __FUNCTION__, retval);
+        usb_unanchor_urb(zc->urb);
+        osrfx2_zc_free(zc);
+        osrfx2_write_release(fx2dev, 1, count);
+        return retval;
+    }
+
+    /*Increment the pending_data counter by the byte count sent*/
+    atomic_long_add(count, &fx2dev->pending_data);
+
+    if (iocb)
+        return -EIOCBQUEUED;
+
+    /*The pages are only the caller's again once the device is done with them*/
+    if (wait_for_completion_killable(&zc->done)) {
+        usb_kill_urb(zc->urb);
+        wait_for_completion(&zc->done);
+    }
+
+    retval = zc->urb->status ? zc->urb->status : zc->urb->actual_length;
+    osrfx2_zc_free(zc);
+
+    return retval;
+}
+
+/*Zero-copy bulk-out completion. Errors go back to the writer directly,
+  so unlike write_bulk_callback() nothing is latched in write_error*/
+static void write_zerocopy_callback(struct urb * urb) {
+    struct osrfx2_zc *zc = urb->context;
+    struct osrfx2 *fx2dev = zc->fx2dev;
+
+    osrfx2_urb_done(fx2dev, urb, OSRFX2_HIST_BULK_OUT, zc->submitted_ns);
+
+    if(urb->status && !(urb->status == -ENOENT || urb->status == -ECONNRESET || urb->status == -ESHUTDOWN))
+        dev_err(&fx2dev->udev->dev, "%s - non-zero status received: %d\n", __FUNCTION__, urb->status);
+
+    osrfx2_write_release(fx2dev, 1, urb->transfer_buffer_length);
+
+    /*Unpinning and completing the iocb are left to process context*/
+    if (zc->iocb)
+        schedule_work(&zc->work);
+    else
+        complete(&zc->done);
+}
+
+/*boolean, a transfer of count bytes should bypass the copy buffers*/
+static int osrfx2_zc_wanted(struct osrfx2 * fx2dev, struct iov_iter * iter, size_t count) {
+    unsigned int min = READ_ONCE(zerocopy_min);
+
+    return min && count >= min && user_backed_iter(iter) &&
+           fx2dev->udev->bus->sg_tablesize > 0;
+}
+
+/*Pin the user pages behind the next size bytes of iter and describe them
+  with one sg entry per page. Returns NULL with the iterator untouched when
+  the host controller can't take the resulting list.*/
+static struct osrfx2_zc * osrfx2_zc_map(struct osrfx2 * fx2dev, struct iov_iter * iter, size_t size, size_t maxp) {
+    struct iov_iter span = *iter;
+    struct osrfx2_zc *zc;
+    unsigned int maxpages;
+    size_t mapped = 0;
+    unsigned int i;
+
+    /*Pages behind the first size bytes, not the whole iterator*/
+    iov_iter_truncate(&span, size);
+    maxpages = iov_iter_npages(&span, INT_MAX);
+    if (!maxpages || maxpages > fx2dev->udev->bus->sg_tablesize)
+        return NULL;
+
+    zc = kzalloc(sizeof(*zc), GFP_KERNEL);
+    if (!zc)
+        return NULL;
+
+    zc->fx2dev = fx2dev;
+    init_completion(&zc->done);
+    INIT_WORK(&zc->work, osrfx2_zc_complete_work);
+
+    zc->urb   = usb_alloc_urb(0, GFP_KERNEL);
+    zc->pages = kvmalloc_array(maxpages, sizeof(*zc->pages), GFP_KERNEL);
+    zc->sg    = kvmalloc_array(maxpages, sizeof(*zc->sg), GFP_KERNEL);
+    if (!zc->urb || !zc->pages || !zc->sg)
+        goto fail;
+
+    sg_init_table(zc->sg, maxpages);
+    zc->pinned = iov_iter_extract_will_pin(iter);
+
+    while (mapped < size) {
+        struct page **pages = zc->pages + zc->npages;
+        size_t offset;
+        ssize_t len;
+
+        len = iov_iter_extract_pages(iter, &pages, size - mapped, maxpages - zc->npages, 0, &offset);
+        if (len <= 0)
+            goto fail;
+
+        for (i = 0; len > 0; i++) {
+            size_t chunk = min_t(size_t, len, PAGE_SIZE - offset);
+
+            sg_set_page(&zc->sg[zc->npages++], pages[i], chunk, offset);
+            mapped += chunk;
+            len -= chunk;
+            offset = 0;
+        }
+    }
+
+    sg_mark_end(&zc->sg[zc->npages - 1]);
+
+    /*Unless the host controller says otherwise, only the last entry may end mid-packet*/
+    if (!fx2dev->udev->bus->no_sg_constraint) {
+        for (i = 0; i + 1 < zc->npages; i++)
+            if (zc->sg[i].length % maxp)
+                goto fail;
+    }
+
+    return zc;
+
+fail:
+    iov_iter_revert(iter, mapped);
+    osrfx2_zc_free(zc);
+    return NULL;
+}
+
+/*Unpin the pages and free a zero-copy transfer*/
+static void osrfx2_zc_free(struct osrfx2_zc * zc) {
+    if (zc->pinned) {
+        if (zc->dirty)
+            unpin_user_pages_dirty_lock(zc->pages, zc->npages, true);
+        else
+            unpin_user_pages(zc->pages, zc->npages);
+    }
+
+    usb_free_urb(zc->urb);
+    kvfree(zc->sg);
+    kvfree(zc->pages);
+    kfree(zc);
+}
+
+/*Finish an asynchronous zero-copy transfer*/
+static void osrfx2_zc_complete_work(struct work_struct * work) {
+    struct osrfx2_zc *zc = container_of(work, struct osrfx2_zc, work);
+    struct kiocb *iocb = zc->iocb;
+    ssize_t retval = zc->urb->status ? zc->urb->status : zc->urb->actual_length;
+
+    osrfx2_zc_free(zc);
+
+    /*Last, this may drop the final reference to the file*/
+    iocb->ki_complete(iocb, retval);
+}
+
+/*Claim window space, blocking unless nowait*/
+static int osrfx2_write_wait_room(struct osrfx2 * fx2dev, int nowait, unsigned int urbs, size_t count) {
+    int reserved = 0;
+    int retval;
+
+    if (osrfx2_write_reserve(fx2dev, urbs, count))
+        return 0;
+
+    if (nowait)
+        return -EAGAIN;
+
+    retval = wait_event_interruptible(fx2dev->write_wait,
+                                      (reserved = osrfx2_write_reserve(fx2dev, urbs, count)) ||
+                                      !READ_ONCE(fx2dev->interface));
+    if (retval)
+        return retval;
+
+    return reserved ? 0 : -ENODEV;
+}
+
+/*Claim window space for urbs URBs of count bytes in total, returns 0 if the budget is exhausted*/
+static int osrfx2_write_reserve(struct osrfx2 * fx2dev, unsigned int urbs, size_t count) {
+    unsigned long flags;
+    int reserved = 0;
+
+    spin_lock_irqsave(&fx2dev->write_lock, flags);
+
+    /*A single oversized write is still admitted into an empty pipeline*/
+    if (fx2dev->write_inflight_urbs == 0 ||
+        (fx2dev->write_inflight_urbs + urbs <= fx2dev->write_max_urbs &&
+         fx2dev->write_inflight_bytes + count <= fx2dev->write_max_bytes)) {
+        fx2dev->write_inflight_urbs += urbs;
+        fx2dev->write_inflight_bytes += count;
+        reserved = 1;
+    }
+
+    spin_unlock_irqrestore(&fx2dev->write_lock, flags);
+
+    return reserved;
+}
+
+/*Give back window space of completed or failed writes*/
+static void osrfx2_write_release(struct osrfx2 * fx2dev, unsigned int urbs, size_t count) {
+    unsigned long flags;
+
+    spin_lock_irqsave(&fx2dev->write_lock, flags);
+    fx2dev->write_inflight_urbs -= urbs;
+    fx2dev->write_inflight_bytes -= count;
+    spin_unlock_irqrestore(&fx2dev->write_lock, flags);
+
+    wake_up_interruptible(&fx2dev->write_wait);
+}
+
+/*Wait for every submitted write to complete*/
+static int osrfx2_write_drain(struct osrfx2 * fx2dev) {
+    if (!usb_wait_anchor_empty_timeout(&fx2dev->write_anchor, WRITE_DRAIN_TIMEOUT))
+        return -ETIMEDOUT;
+
+    /*Recycle batch members whose tail has not been seen yet*/
+    osrfx2_write_reap(fx2dev);
+
+    /*Report an error from the drained writes*/
+    return xchg(&fx2dev->write_error, 0);
+}
+
+/*Whether osrfx2_write_reserve() would admit a write of one pool buffer,
+  the same test with the same headroom so EPOLLOUT never precedes -EAGAIN*/
+static int osrfx2_write_room(struct osrfx2 * fx2dev) {
+    unsigned int urbs = READ_ONCE(fx2dev->write_inflight_urbs);
+
+    return urbs == 0 ||
+           (urbs + 1 <= READ_ONCE(fx2dev->write_max_urbs) &&
+            READ_ONCE(fx2dev->write_inflight_bytes) + fx2dev->write_pool_bufsize <=
+            READ_ONCE(fx2dev->write_max_bytes));
+}
+
+/*Called on every close of a file descriptor*/
+static int osrfx2_flush(struct file * file, fl_owner_t id) {
+    struct osrfx2 *fx2dev = ((struct osrfx2_file *)file->private_data)->fx2dev;
+
+    /*Only writers have a pipeline to drain*/
+    if (!(file->f_mode & FMODE_WRITE))
+        return 0;
+
+    mutex_lock(&fx2dev->write_mutex);
+    osrfx2_coalesce_flush(fx2dev);
+    mutex_unlock(&fx2dev->write_mutex);
+
+    return osrfx2_write_drain(fx2dev);
+}
+
+static int osrfx2_fsync(struct file * file, loff_t start, loff_t end, int datasync) {
+    struct osrfx2 *fx2dev = ((struct osrfx2_file *)file->private_data)->fx2dev;
+
+    /*Staged writes don't wait for their deadline*/
+    if (mutex_lock_interruptible(&fx2dev->write_mutex))
+        return -ERESTARTSYS;
+    osrfx2_coalesce_flush(fx2dev);
+    mutex_unlock(&fx2dev->write_mutex);
+
+    return osrfx2_write_drain(fx2dev);
+}
+
+static void write_bulk_callback(struct urb * urb) {
+    struct osrfx2_wbuf *wbuf = urb->context;
+    struct osrfx2 *fx2dev = wbuf->fx2dev;
+    u64 batch = wbuf->batch;
+    unsigned long flags;
+    int deferred;
+
+    osrfx2_urb_done(fx2dev, urb, OSRFX2_HIST_BULK_OUT, wbuf->submitted_ns);
+
+    /*  Filter sync and async unlink events as non-errors*/
+    if(urb->status && !(urb->status == -ENOENT || urb->status == -ECONNRESET || urb->status == -ESHUTDOWN)) {
+        dev_err(&fx2dev->udev->dev, "%s - non-zero status received: %d\n", __FUNCTION__, urb->status);
+        fx2dev->write_error = urb->status;
+    }
+
+    /*Batch members leave the work to the urb that carries the interrupt,
+      a failed one reaps at once as its tail may never complete normally.
+      Once on write_done the wbuf may be recycled by another reaper, and
+      under write_lock a member either is listed before its batch is cut
+      or sees the cut. A member of an older batch reaps needlessly.*/
+    if (batch && !urb->status) {
+        spin_lock_irqsave(&fx2dev->write_lock, flags);
+        llist_add(&wbuf->done_node, &fx2dev->write_done);
+        deferred = batch > fx2dev->write_batch_cut;
+        spin_unlock_irqrestore(&fx2dev->write_lock, flags);
+        if (deferred)
+            return;
+    } else {
+        llist_add(&wbuf->done_node, &fx2dev->write_done);
+    }
+
+    osrfx2_write_reap(fx2dev);
+}
+
+/*Recycle every completed write urb and open the window once for all of them*/
+static void osrfx2_write_reap(struct osrfx2 * fx2dev) {
+    struct llist_node *done = llist_del_all(&fx2dev->write_done);
+    struct osrfx2_wbuf *wbuf, *next;
+    unsigned int urbs = 0;
+    size_t bytes = 0;
+
+    if (!done)
+        return;
+
+    /*Oldest first, so iocbs complete in submission order*/
+    done = llist_reverse_order(done);
+
+    llist_for_each_entry(wbuf, done, done_node) {
+        urbs++;
+        bytes += wbuf->urb->transfer_buffer_length;
+    }
+
+    osrfx2_write_release(fx2dev, urbs, bytes);
+
+    llist_for_each_entry_safe(wbuf, next, done, done_node) {
+        struct kiocb *iocb = wbuf->iocb;
+        ssize_t result = wbuf->urb->status ? wbuf->urb->status : wbuf->iocb_bytes;
+
+        /*Recycle the spent buffer, then complete its writer*/
+        osrfx2_wbuf_put(wbuf);
+
+        /*This may drop the final reference to the file, which is deferred
+          from interrupt context and held by the caller otherwise*/
+        if (iocb)
+            iocb->ki_complete(iocb, result);
+    }
+}
+
+/*Allocate a write urb together with a DMA-capable buffer of size bytes*/
+static struct osrfx2_wbuf * osrfx2_wbuf_alloc(struct osrfx2 * fx2dev, size_t size, int pooled) {
+    struct osrfx2_wbuf *wbuf;
+
+    wbuf = kzalloc(sizeof(*wbuf), GFP_KERNEL);
+    if (!wbuf)
+        return NULL;
+
+    wbuf->urb = usb_alloc_urb(0, GFP_KERNEL);
+    if (!wbuf->urb) {
+        kfree(wbuf);
+        return NULL;
+    }
+
+    wbuf->buf = usb_alloc_coherent(fx2dev->udev, size, GFP_KERNEL, &wbuf->urb->transfer_dma);
+    if (!wbuf->buf) {
+        usb_free_urb(wbuf->urb);
+        kfree(wbuf);
+        return NULL;
+    }
+
+    wbuf->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+    wbuf->fx2dev = fx2dev;
+    wbuf->size   = size;
+    wbuf->pooled = pooled;
+    INIT_LIST_HEAD(&wbuf->node);
+
+    return wbuf;
+}
+
+/*Release a write urb and its buffer for good*/
+static void osrfx2_wbuf_free(struct osrfx2_wbuf * wbuf) {
+    usb_free_coherent(wbuf->fx2dev->udev, wbuf->size, wbuf->buf, wbuf->urb->transfer_dma);
+    usb_free_urb(wbuf->urb);
+    kfree(wbuf);
+}
+
+/*Get a write buffer of at least count bytes, from the pool when possible*/
+static struct osrfx2_wbuf * osrfx2_wbuf_get(struct osrfx2 * fx2dev, size_t count) {
+    struct osrfx2_wbuf *wbuf = NULL;
+    unsigned long flags;
+
+    if (count <= fx2dev->write_pool_bufsize) {
+        spin_lock_irqsave(&fx2dev->write_pool_lock, flags);
+        wbuf = list_first_entry_or_null(&fx2dev->write_pool, struct osrfx2_wbuf, node);
+        if (wbuf)
+            list_del_init(&wbuf->node);
+        spin_unlock_irqrestore(&fx2dev->write_pool_lock, flags);
+    }
+
+    if (wbuf) {
+        atomic_long_inc(&fx2dev->write_pool_hits);
+        return wbuf;
+    }
+
+    /*Pool exhausted or write too large for a pooled buffer*/
+    atomic_long_inc(&fx2dev->write_pool_misses);
+
+    return osrfx2_wbuf_alloc(fx2dev, count, 0);
+}
+
+/*Return a pooled write buffer to the pool, free any other*/
+static void osrfx2_wbuf_put(struct osrfx2_wbuf * wbuf) {
+    struct osrfx2 *fx2dev = wbuf->fx2dev;
+    unsigned long flags;
+
+    if (!wbuf->pooled) {
+        osrfx2_wbuf_free(wbuf);
+        return;
+    }
+
+    spin_lock_irqsave(&fx2dev->write_pool_lock, flags);
+    list_add(&wbuf->node, &fx2dev->write_pool);
+    spin_unlock_irqrestore(&fx2dev->write_pool_lock, flags);
+}
+
+/*Bulk-in read-ahead completion, moves the received data into the ring as a
+  record, header first, so message readers keep the transfer's boundaries*/
+static void read_bulk_callback(struct urb * urb) {
+    struct osrfx2_rurb *rurb = urb->context;
+    struct osrfx2 *fx2dev = rurb->fx2dev;
+    struct osrfx2_msg_header hdr;
+    size_t record = sizeof(hdr) + urb->transfer_buffer_length;
+    unsigned long flags;
+    int unlinked;
+    int retval;
+
+    unlinked = urb->status == -ENOENT || urb->status == -ECONNRESET || urb->status == -ESHUTDOWN;
+
+    osrfx2_urb_done(fx2dev, urb, OSRFX2_HIST_BULK_IN, rurb->submitted_ns);
+
+    spin_lock_irqsave(&fx2dev->bulk_in_lock, flags);
+
+    fx2dev->bulk_in_reserved -= record;
+
+    if (urb->status && !unlinked) {
+        dev_err(&urb->dev->dev, "%s - non-zero status received: %d\n", __FUNCTION__, urb->status);
+        fx2dev->bulk_in_error = urb->status;
+    }
+
+    /*Space for a full record was reserved before submitting*/
+    if (!unlinked) {
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.length       = urb->status ? 0 : urb->actual_length;
+        hdr.status       = urb->status;
+        hdr.timestamp_ns = ktime_get_ns();
+        hdr.seq          = ++fx2dev->bulk_in_seq;
+
+        kfifo_in(&fx2dev->bulk_in_fifo, (unsigned char *)&hdr, sizeof(hdr));
+        kfifo_in(&fx2dev->bulk_in_fifo, urb->transfer_buffer, hdr.length);
+        atomic_long_add(hdr.length, &fx2dev->bulk_in_bytes);
+    }
+
+    /*Requeue straight away while the ring has room, otherwise park until read() frees some*/
+    if (urb->status == 0 && fx2dev->read_ahead_running &&
+        kfifo_avail(&fx2dev->bulk_in_fifo) >= fx2dev->bulk_in_reserved + record) {
+        usb_anchor_urb(urb, &fx2dev->bulk_in_anchor);
+        rurb->submitted_ns = osrfx2_timestamp();
+        retval = osrfx2_submit_urb(fx2dev, urb, GFP_ATOMIC, rurb->submitted_ns);
+        if (retval == 0) {
+            fx2dev->bulk_in_reserved += record;
+            spin_unlock_irqrestore(&fx2dev->bulk_in_lock, flags);
+            wake_up_interruptible(&fx2dev->bulk_in_wait);
+            return;
+        }
+
+        usb_unanchor_urb(urb);
+        fx2dev->bulk_in_error = retval;
+    }
+
+    usb_anchor_urb(urb, &fx2dev->bulk_in_idle);
+
+    spin_unlock_irqrestore(&fx2dev->bulk_in_lock, flags);
+
+    wake_up_interruptible(&fx2dev->bulk_in_wait);
+}
+
+/*DIP switch interrupt handler*/
+static void interrupt_handler(struct urb * urb) {
+    struct osrfx2 *fx2dev = urb->context;
+    unsigned char *buf = urb->transfer_buffer;
+    unsigned long delay, next, now;
+    u64 now_ns, interval_ns;
+    int retval;
+
+    osrfx2_urb_done(fx2dev, urb, OSRFX2_HIST_COUNT, fx2dev->int_in_submitted_ns);
+
+    if (urb->status == 0) {
+        interval_ns = 0;
+        if (osrfx2_instrumented() || trace_osrfx2_switch_change_enabled()) {
+            now_ns = ktime_get_ns();
+            if (fx2dev->int_last_ns)
+                interval_ns = now_ns - fx2dev->int_last_ns;
+            fx2dev->int_last_ns = now_ns;
+        }
+
+        if (osrfx2_instrumented()) {
+            this_cpu_inc(fx2dev->stats->int_events);
+            if (*buf != fx2dev->switches)
+                this_cpu_inc(fx2dev->stats->switch_changes);
+            if (interval_ns)
+                osrfx2_hist_record(fx2dev, OSRFX2_HIST_INT_IN, interval_ns);
+        }
+
+        /*Notify sysfs pollers of real changes only, deferred out of atomic context*/
+        if (*buf != fx2dev->switches) {
+            trace_osrfx2_switch_change(fx2dev->minor, *buf, fx2dev->switches, interval_ns);
+
+            /*Wrap-safe, jiffies start close to wrapping on 32-bit*/
+            next = fx2dev->switches_notified + msecs_to_jiffies(switches_notify_ms);
+            now = jiffies;
+            delay = time_before(now, next) ? next - now : 0;
+            schedule_delayed_work(&fx2dev->switches_notify_work, delay);
+        }
+
+        fx2dev->switches = *buf; /*Get new switch state*/
+        smp_store_release(&fx2dev->switch_seq, fx2dev->switch_seq + 1);
+
+        wake_up(&(fx2dev->FieldEventQueue)); /*Wake-up any requests enqueued*/
+
+        fx2dev->int_in_submitted_ns = osrfx2_timestamp();
+        retval = osrfx2_submit_urb(fx2dev, urb, GFP_ATOMIC, fx2dev->int_in_submitted_ns); /*Restart interrupt urb*/
+        if (retval != 0)
+            dev_err(&urb->dev->dev, "%s - error %d submitting interrupt urb\n", __FUNCTION__, retval);
+
+        return; /*Success*/   
+    }
+
+    /*Error*/
+    dev_err(&urb->dev->dev, "%s - non-zero urb status received: %d\n", __FUNCTION__, urb->status);
+}
+
+/*Wake poll()/select() on the switches attribute, runs from the system workqueue*/
+static void osrfx2_notify_switches(struct work_struct * work) {
+    struct osrfx2 *fx2dev = container_of(to_delayed_work(work), struct osrfx2, switches_notify_work);
+
+    fx2dev->switches_notified = jiffies;
+
+    mutex_lock(&fx2dev->io_mutex);
+    if (fx2dev->interface)
+        sysfs_notify(&fx2dev->interface->dev.kobj, NULL, dev_attr_switches.attr.name);
+    mutex_unlock(&fx2dev->io_mutex);
+}
+
+/*Retreive the values of the switches*/
+static ssize_t get_switches(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct usb_interface   *intf   = to_usb_interface(dev);
+    struct osrfx2          *fx2dev = usb_get_intfdata(intf);    
+    int retval;
+
+    retval = sprintf(buf, "%s%s%s%s%s%s%s%s", /*left sw --> right sw*/
+                    (fx2dev->switches & 0x80) ? "1" : "0",
+                    (fx2dev->switches & 0x40) ? "1" : "0",
+                    (fx2dev->switches & 0x20) ? "1" : "0",
+                    (fx2dev->switches & 0x10) ? "1" : "0",
+                    (fx2dev->switches & 0x08) ? "1" : "0",
+                    (fx2dev->switches & 0x04) ? "1" : "0",
+                    (fx2dev->switches & 0x02) ? "1" : "0",
+                    (fx2dev->switches & 0x01) ? "1" : "0");
+
+    return retval;
+}
+
+/*Direction of a vendor request, all of them transfer a single byte*/
+static int osrfx2_vendor_is_in(__u8 request) {
+    switch (request) {
+    case READ_7SEG:
+    case READ_LEDS:
+    case READ_SWITCHES:
+    case IS_HIGH_SPEED:
+        return 1;
+    case SET_7SEG:
+    case SET_LEDS:
+        return 0;
+    default:
+        return -EINVAL;
+    }
+}
+
+/*Default completion, wakes osrfx2_ctrl_wait()*/
+static void osrfx2_ctrl_done(struct osrfx2_ctrl * ctrl) {
+    complete(&ctrl->done);
+}
+
+/*Allocate a vendor request with its own DMA-safe setup packet and data byte*/
+static struct osrfx2_ctrl * osrfx2_ctrl_alloc(struct osrfx2 * fx2dev) {
+    struct osrfx2_ctrl *ctrl;
+
+    ctrl = kzalloc(sizeof(*ctrl), GFP_KERNEL);
+    if (!ctrl)
+        return NULL;
+
+    ctrl->dma = kmalloc(sizeof(*ctrl->dma), GFP_KERNEL);
+    ctrl->urb = usb_alloc_urb(0, GFP_KERNEL);
+    if (!ctrl->dma || !ctrl->urb) {
+        usb_free_urb(ctrl->urb);
+        kfree(ctrl->dma);
+        kfree(ctrl);
+        return NULL;
+    }
+
+    ctrl->fx2dev   = fx2dev;
+    ctrl->complete = osrfx2_ctrl_done;
+    init_completion(&ctrl->done);
+
+    return ctrl;
+}
+
+static void osrfx2_ctrl_free(struct osrfx2_ctrl * ctrl) {
+    usb_free_urb(ctrl->urb);
+    kfree(ctrl->dma);
+    kfree(ctrl);
+}
+
+/*Queue a vendor request on ep0, sleeps while the queue is full and fails
+  with -ENODEV after disconnect. The host controller runs ep0 requests in
+  submission order.*/
+static int osrfx2_ctrl_submit(struct osrfx2_ctrl * ctrl, __u8 request, unsigned char value) {
+    struct osrfx2 *fx2dev = ctrl->fx2dev;
+    int is_in, pipe, retval;
+
+    is_in = osrfx2_vendor_is_in(request);
+    if (is_in < 0)
+        return is_in;
+
+    if (down_interruptible(&fx2dev->ctrl_slots))
+        return -ERESTARTSYS;
+
+    ctrl->request = request;
+    ctrl->value   = value;
+    ctrl->status  = -EINPROGRESS;
+    reinit_completion(&ctrl->done);
+
+    ctrl->dma->setup.bRequestType = (is_in ? USB_DIR_IN : USB_DIR_OUT) | USB_TYPE_VENDOR;
+    ctrl->dma->setup.bRequest     = request;
+    ctrl->dma->setup.wValue       = 0;
+    ctrl->dma->setup.wIndex       = 0;
+    ctrl->dma->setup.wLength      = cpu_to_le16(1);
+    ctrl->dma->data               = value;
+
+    pipe = is_in ? usb_rcvctrlpipe(fx2dev->udev, 0) : usb_sndctrlpipe(fx2dev->udev, 0);
+    usb_fill_control_urb(ctrl->urb, fx2dev->udev, pipe, (unsigned char *)&ctrl->dma->setup,
+                         &ctrl->dma->data, 1, ctrl_callback, ctrl);
+
+    /*disconnect() kills ctrl_anchor once interface is cleared, so nothing
+      may be anchored after that. The slot was taken outside io_mutex.*/
+    mutex_lock(&fx2dev->io_mutex);
+    if (fx2dev->interface) {
+        usb_anchor_urb(ctrl->urb, &fx2dev->ctrl_anchor);
+        ctrl->submitted_ns = osrfx2_timestamp();
+        retval = osrfx2_submit_urb(fx2dev, ctrl->urb, GFP_KERNEL, ctrl->submitted_ns);
+        if (retval)
+            usb_unanchor_urb(ctrl->urb);
+    } else {
+        retval = -ENODEV;
+    }
+    mutex_unlock(&fx2dev->io_mutex);
+
+    if (retval) {
+        up(&fx2dev->ctrl_slots);
+        ctrl->status = retval;
+    }
+
+    return retval;
+}
+
+/*Vendor request completion*/
+static void ctrl_callback(struct urb * urb) {
+    struct osrfx2_ctrl *ctrl = urb->context;
+
+    osrfx2_urb_done(ctrl->fx2dev, urb, osrfx2_hist_vendor(ctrl->request), ctrl->submitted_ns);
+
+    ctrl->status = urb->status;
+    if (ctrl->status == 0 && urb->actual_length != 1)
+        ctrl->status = -EIO;
+    if (ctrl->status == 0)
+        ctrl->value = ctrl->dma->data;
+
+    trace_osrfx2_vendor_request(ctrl->fx2dev->minor, ctrl->request, ctrl->value, ctrl->status,
+                                ctrl->submitted_ns ? ktime_get_ns() - ctrl->submitted_ns : 0);
+
+    up(&ctrl->fx2dev->ctrl_slots);
+
+    ctrl->complete(ctrl);
+}
+
+/*Wait for a request queued with the default completion, cancelling it on timeout*/
+static int osrfx2_ctrl_wait(struct osrfx2_ctrl * ctrl) {
+    if (!wait_for_completion_timeout(&ctrl->done, msecs_to_jiffies(USB_CTRL_GET_TIMEOUT))) {
+        usb_kill_urb(ctrl->urb);
+        wait_for_completion(&ctrl->done);
+        if (ctrl->status == -ENOENT)
+            ctrl->status = -ETIMEDOUT;
+    }
+
+    return ctrl->status;
+}
+
+/*Issue one vendor request and wait for it, value is sent or received*/
+static int osrfx2_vendor_request(struct osrfx2 * fx2dev, __u8 request, unsigned char * value) {
+    struct osrfx2_ctrl *ctrl;
+    int retval;
+
+    ctrl = osrfx2_ctrl_alloc(fx2dev);
+    if (!ctrl)
+        return -ENOMEM;
+
+    retval = osrfx2_ctrl_submit(ctrl, request, *value);
+    if (retval == 0) {
+        retval = osrfx2_ctrl_wait(ctrl);
+        if (retval == 0)
+            *value = ctrl->value;
+    }
+
+    osrfx2_ctrl_free(ctrl);
+
+    return retval;
+}
+
+/*Pipeline a batch of vendor requests from userspace and report each result*/
+static int osrfx2_vendor_batch(struct osrfx2 * fx2dev, struct osrfx2_vendor_batch __user * ubatch) {
+    struct osrfx2_vendor_batch batch;
+    struct osrfx2_vendor_cmd *cmds;
+    struct osrfx2_ctrl **ctrls;
+    unsigned int i, queued;
+    int retval = 0;
+
+    if (copy_from_user(&batch, ubatch, sizeof(batch)))
+        return -EFAULT;
+
+    if (batch.flags || batch.count == 0 || batch.count > OSRFX2_VENDOR_BATCH_MAX)
+        return -EINVAL;
+
+    cmds = memdup_user(u64_to_user_ptr(batch.cmds), array_size(batch.count, sizeof(*cmds)));
+    if (IS_ERR(cmds))
+        return PTR_ERR(cmds);
+
+    for (i = 0; i < batch.count; i++) {
+        if (osrfx2_vendor_is_in(cmds[i].request) < 0) {
+            kfree(cmds);
+            return -EINVAL;
+        }
+    }
+
+    ctrls = kcalloc(batch.count, sizeof(*ctrls), GFP_KERNEL);
+    if (!ctrls) {
+        kfree(cmds);
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < batch.count; i++) {
+        ctrls[i] = osrfx2_ctrl_alloc(fx2dev);
+        if (!ctrls[i]) {
+            retval = -ENOMEM;
+            goto out;
+        }
+    }
+
+    /*Hold off sysfs so the shadows follow the batch in order*/
+    mutex_lock(&fx2dev->ctrl_mutex);
+
+    /*Queue everything first, the queue depth throttles submission*/
+    for (queued = 0; queued < batch.count; queued++) {
+        retval = osrfx2_ctrl_submit(ctrls[queued], cmds[queued].request, cmds[queued].value);
+        if (retval)
+            break;
+    }
+
+    /*Collect the results in order*/
+    for (i = 0; i < batch.count; i++) {
+        if (i < queued)
+            cmds[i].status = osrfx2_ctrl_wait(ctrls[i]);
+        else if (i == queued)
+            cmds[i].status = retval;
+        else
+            cmds[i].status = -ECANCELED;
+
+        if (cmds[i].status == 0 && osrfx2_vendor_is_in(cmds[i].request))
+            cmds[i].value = ctrls[i]->value;
+
+        switch (cmds[i].request) {
+        case READ_LEDS:
+        case SET_LEDS:
+            fx2dev->leds = cmds[i].value;
+            fx2dev->leds_valid = (cmds[i].status == 0);
+            break;
+        case READ_7SEG:
+        case SET_7SEG:
+            fx2dev->segments = cmds[i].value;
+            fx2dev->segments_valid = (cmds[i].status == 0);
+            break;
+        }
+    }
+
+    mutex_unlock(&fx2dev->ctrl_mutex);
+
+    /*Per request errors are reported through the status fields*/
+    retval = 0;
+    if (copy_to_user(u64_to_user_ptr(batch.cmds), cmds, array_size(batch.count, sizeof(*cmds))))
+        retval = -EFAULT;
+
+out:
+    for (i = 0; i < batch.count; i++)
+        if (ctrls[i])
+            osrfx2_ctrl_free(ctrls[i]);
+    kfree(ctrls);
+    kfree(cmds);
+
+    return retval;
+}
+
+/*Issue a vendor IN request returning one byte, called with ctrl_mutex held*/
+static int osrfx2_vendor_read(struct osrfx2 * fx2dev, __u8 request, unsigned char * value) {
+    unsigned char data = 0;
+    int retval;
+
+    retval = osrfx2_vendor_request(fx2dev, request, &data);
+    if (retval == 0)
+        *value = data;
+
+    return retval;
+}
+
+/*Issue a vendor OUT request carrying one byte, called with ctrl_mutex held*/
+static int osrfx2_vendor_write(struct osrfx2 * fx2dev, __u8 request, unsigned char value) {
+    return osrfx2_vendor_request(fx2dev, request, &value);
+}
+
+/*Reload the LED bargraph and 7 segment shadows from the device*/
+static int osrfx2_refresh_shadows(struct osrfx2 * fx2dev) {
+    int retval;
+
+    mutex_lock(&fx2dev->ctrl_mutex);
+
+    retval = osrfx2_vendor_read(fx2dev, READ_LEDS, &fx2dev->leds);
+    if (retval == 0)
+        retval = osrfx2_vendor_read(fx2dev, READ_7SEG, &fx2dev->segments);
+
+    /*A failed refresh leaves neither shadow trusted*/
+    fx2dev->leds_valid = fx2dev->segments_valid = (retval == 0);
+
+    mutex_unlock(&fx2dev->ctrl_mutex);
+
+    return retval;
+}
+
+/*Gets the LED bargraph status, served from the shadow*/
+static ssize_t get_bargraph(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct usb_interface  *intf   = to_usb_interface(dev);
+    struct osrfx2         *fx2dev = usb_get_intfdata(intf);
+    unsigned char leds;
+    int retval = 0;
+   
+    if (fx2dev->suspended) {
+        return sprintf(buf, "S ");   /*Device is suspended*/
+    }
+
+    mutex_lock(&fx2dev->ctrl_mutex);
+
+    /*Only ask the device if the shadow was never loaded or a request failed*/
+    if (!fx2dev->leds_valid) {
+        retval = osrfx2_vendor_read(fx2dev, READ_LEDS, &fx2dev->leds);
+        fx2dev->leds_valid = (retval == 0);
+    }
+    leds = fx2dev->leds;
+
+    mutex_unlock(&fx2dev->ctrl_mutex);
+
+    if (retval < 0) {
+        dev_err(&fx2dev->udev->dev, "%s - retval=%d\n", __FUNCTION__, retval);
+        return retval;
+    }
+
+    /*Fill buffer with LED status*/
+    retval = sprintf(buf, "%s%s%s%s%s%s%s%s",
+                     (leds & 0x10) ? "1" : "0",
+                     (leds & 0x08) ? "1" : "0",
+                     (leds & 0x04) ? "1" : "0",
+                     (leds & 0x02) ? "1" : "0",
+                     (leds & 0x01) ? "1" : "0",
+                     (leds & 0x80) ? "1" : "0",
+                     (leds & 0x40) ? "1" : "0",
+                     (leds & 0x20) ? "1" : "0");
+
+    return retval;
+}
+
+/*Sets the LED bargraph on the device*/
+static ssize_t set_bargraph(struct device * dev, struct device_attribute *attr, const char *buf,size_t count) {
+    struct usb_interface  *intf   = to_usb_interface(dev);
+    struct osrfx2         *fx2dev = usb_get_intfdata(intf);
+
+    unsigned char leds = 0;
+    unsigned int value;
+    int retval = 0;
+    char *end;
+
+    /*convert buffer to unsigned long*/
+    value = (simple_strtoul(buf, &end, 10) & 0xFF);
+    if (buf == end)
+        value = 0;
+
+    /*Check range of value 0 =< value < 256*/    
+    if(value > 255)
+        leds = 0;
+    else { /*convert to intuitive bit system. bit 0 = bottom, bit 7 = top*/
+        leds |= ((value >> 3) & 0x01);
+        leds |= ((value >> 3) & 0x02);
+        leds |= ((value >> 3) & 0x04);
+        leds |= ((value >> 3) & 0x08);
+        leds |= ((value >> 3) & 0x10);
+        leds |= ((value << 5) & 0x20);
+        leds |= ((value << 5) & 0x40);
+        leds |= ((value << 5) & 0x80);
+    }
+
+    mutex_lock(&fx2dev->ctrl_mutex);
+
+    /*Set LED values unless the device already shows them*/
+    if (!fx2dev->leds_valid || fx2dev->leds != leds) {
+        retval = osrfx2_vendor_write(fx2dev, SET_LEDS, leds);
+        fx2dev->leds = leds;
+        fx2dev->leds_valid = (retval == 0);
+    }
+
+    mutex_unlock(&fx2dev->ctrl_mutex);
+
+    if (retval < 0)
+        dev_err(&fx2dev->udev->dev, "%s - retval=%d\n", __FUNCTION__, retval);
+
+    return count;
+}
+
+/*Gets the 7 segment status, served from the shadow*/
+static ssize_t get_7segment(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct usb_interface  *intf   = to_usb_interface(dev);
+    struct osrfx2         *fx2dev = usb_get_intfdata(intf);
+    unsigned char segments;
+    int retval = 0;
+   
+    if (fx2dev->suspended) {
+        return sprintf(buf, "S ");   /*Device is suspended*/
+    }
+
+    mutex_lock(&fx2dev->ctrl_mutex);
+
+    /*Only ask the device if the shadow was never loaded or a request failed*/
+    if (!fx2dev->segments_valid) {
+        retval = osrfx2_vendor_read(fx2dev, READ_7SEG, &fx2dev->segments);
+        fx2dev->segments_valid = (retval == 0);
+    }
+    segments = fx2dev->segments;
+
+    mutex_unlock(&fx2dev->ctrl_mutex);
+
+    if (retval < 0) {
+        dev_err(&fx2dev->udev->dev, "%s - retval=%d\n", __FUNCTION__, retval);
+        return retval;
+    }
+
+    /*Fill buffer with 7 segment status*/
+    retval = sprintf(buf, "%s%s%s%s%s%s%s%s",
+                     (segments & 0x08) ? "1" : "0",
+                     (segments & 0x20) ? "1" : "0",
+                     (segments & 0x40) ? "1" : "0",
+                     (segments & 0x10) ? "1" : "0",
+                     (segments & 0x80) ? "1" : "0",
+                     (segments & 0x04) ? "1" : "0",
+                     (segments & 0x02) ? "1" : "0",
+                     (segments & 0x01) ? "1" : "0");
+
+    return retval;
+}
+
+/*Set 7 segment display on device*/
+static ssize_t set_7segment(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    struct usb_interface  *intf   = to_usb_interface(dev);
+    struct osrfx2         *fx2dev = usb_get_intfdata(intf);
+
+    unsigned char segments = 0;
+    unsigned int value;
+    int retval = 0;
+    char *end;
+
+    /*convert buffer to unsigned long*/
     value = (simple_strtoul(buf, &end, 10) & 0xFF);
     if (buf == end)
         value = 0;
 
-    /*Check range of value 0 =< value < 256*/    
-    if(value > 255)
-        fx2dev->leds = 0;
-    else { /*convert to intuitive bit system. bit 0 = bottom, bit 7 = top*/
-        fx2dev->leds |= ((value >> 3) & 0x01);
-        fx2dev->leds |= ((value >> 3) & 0x02);
-        fx2dev->leds |= ((value >> 3) & 0x04);
-        fx2dev->leds |= ((value >> 3) & 0x08);
-        fx2dev->leds |= ((value >> 3) & 0x10);
-        fx2dev->leds |= ((value << 5) & 0x20);
-        fx2dev->leds |= ((value << 5) & 0x40);
-        fx2dev->leds |= ((value << 5) & 0x80);
-    }
-
-    /*Set LED values*/
-    retval = usb_control_msg(fx2dev->udev, usb_sndctrlpipe(fx2dev->udev, 0),
-                             SET_LEDS, USB_DIR_OUT | USB_TYPE_VENDOR, 0, 0,
-                             &fx2dev->leds, sizeof(fx2dev->leds),
-                             USB_CTRL_GET_TIMEOUT);
+    /*Check range of value 0 =< value < 256*/    
+    if(value > 255)
+        segments = 0;
+    else { /*convert to intuitive bit system. bit 0 = seg a, bit 7 = decimal*/
+        segments |= (value & 0x01);
+        segments |= (value & 0x02);
+        segments |= (value & 0x04);
+        segments |= ((value >> 4) & 0x08);
+        segments |= (value & 0x10);
+        segments |= ((value >> 1) & 0x20);
+        segments |= ((value << 1) & 0x40);
+        segments |= ((value << 4) & 0x80);
+    }
+
+    mutex_lock(&fx2dev->ctrl_mutex);
+
+    /*Set values unless the device already shows them*/
+    if (!fx2dev->segments_valid || fx2dev->segments != segments) {
+        retval = osrfx2_vendor_write(fx2dev, SET_7SEG, segments);
+        fx2dev->segments = segments;
+        fx2dev->segments_valid = (retval == 0);
+    }
+
+    mutex_unlock(&fx2dev->ctrl_mutex);
 
     if (retval < 0)
         dev_err(&fx2dev->udev->dev, "%s - retval=%d\n", __FUNCTION__, retval);
@@ -690,81 +3754,592 @@ static ssize_t set_bargraph(struct device * dev, struct device_attribute *attr,
     return count;
 }
 
-/*Gets the 7 segment status on the device*/
-static ssize_t get_7segment(struct device *dev, struct device_attribute *attr, char *buf) {
+/*Re-read the LED bargraph and 7 segment state from the device*/
+static ssize_t set_refresh(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
     struct usb_interface  *intf   = to_usb_interface(dev);
     struct osrfx2         *fx2dev = usb_get_intfdata(intf);
     int retval;
-   
-    if (fx2dev->suspended) {
-        return sprintf(buf, "S ");   /*Device is suspended*/
-    }
 
-    fx2dev->segments = 0;
+    if (fx2dev->suspended)
+        return -EBUSY;
 
-    /*Get 7segment values*/
-    retval = usb_control_msg(fx2dev->udev, usb_rcvctrlpipe(fx2dev->udev, 0),
-                             READ_7SEG, USB_DIR_IN | USB_TYPE_VENDOR, 0, 0,
-                             &fx2dev->segments, sizeof(fx2dev->segments),
-                             USB_CTRL_GET_TIMEOUT);
+    retval = osrfx2_refresh_shadows(fx2dev);
 
-    if (retval < 0) {
-        dev_err(&fx2dev->udev->dev, "%s - retval=%d\n", __FUNCTION__, retval);
+    return retval < 0 ? retval : count;
+}
+
+/*Gets the number of bulk-in URBs kept queued while streaming*/
+static ssize_t get_read_ahead_urbs(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct usb_interface  *intf   = to_usb_interface(dev);
+    struct osrfx2         *fx2dev = usb_get_intfdata(intf);
+
+    return sprintf(buf, "%u\n", fx2dev->read_ahead_urbs);
+}
+
+/*Sets the number of bulk-in URBs kept queued while streaming, 0 disables read-ahead*/
+static ssize_t set_read_ahead_urbs(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    struct usb_interface  *intf   = to_usb_interface(dev);
+    struct osrfx2         *fx2dev = usb_get_intfdata(intf);
+    unsigned int value;
+    int retval;
+
+    retval = kstrtouint(buf, 10, &value);
+    if (retval)
         return retval;
-    }
 
-    /*Fill buffer with 7 segment status*/
-    retval = sprintf(buf, "%s%s%s%s%s%s%s%s",
-                     (fx2dev->segments & 0x08) ? "1" : "0",
-                     (fx2dev->segments & 0x20) ? "1" : "0",
-                     (fx2dev->segments & 0x40) ? "1" : "0",
-                     (fx2dev->segments & 0x10) ? "1" : "0",
-                     (fx2dev->segments & 0x80) ? "1" : "0",
-                     (fx2dev->segments & 0x04) ? "1" : "0",
-                     (fx2dev->segments & 0x02) ? "1" : "0",
-                     (fx2dev->segments & 0x01) ? "1" : "0");
+    if (value > READ_AHEAD_MAX_URBS)
+        return -EINVAL;
 
-    return retval;
+    /*Takes effect on the next open, not while a reader is streaming*/
+    mutex_lock(&fx2dev->io_mutex);
+    if (fx2dev->bulk_in_ring)
+        retval = -EBUSY;
+    else
+        fx2dev->read_ahead_urbs = value;
+    mutex_unlock(&fx2dev->io_mutex);
+
+    return retval ? retval : count;
 }
 
-/*Set 7 segment display on device*/
-static ssize_t set_7segment(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+/*Gets the transfer size of each read-ahead URB*/
+static ssize_t get_read_ahead_size(struct device *dev, struct device_attribute *attr, char *buf) {
     struct usb_interface  *intf   = to_usb_interface(dev);
     struct osrfx2         *fx2dev = usb_get_intfdata(intf);
 
+    return sprintf(buf, "%zu\n", fx2dev->read_ahead_size);
+}
+
+/*Sets the transfer size of each read-ahead URB, rounded down to whole packets*/
+static ssize_t set_read_ahead_size(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    struct usb_interface  *intf   = to_usb_interface(dev);
+    struct osrfx2         *fx2dev = usb_get_intfdata(intf);
     unsigned int value;
     int retval;
-    char *end;
 
-    fx2dev->segments = 0;
+    retval = kstrtouint(buf, 10, &value);
+    if (retval)
+        return retval;
 
-    /*convert buffer to unsigned long*/
-    value = (simple_strtoul(buf, &end, 10) & 0xFF);
-    if (buf == end)
-        value = 0;
+    if (value < fx2dev->bulk_in_size || value > READ_AHEAD_MAX_SIZE)
+        return -EINVAL;
 
-    /*Check range of value 0 =< value < 256*/    
-    if(value > 255)
-        fx2dev->segments = 0;
-    else { /*convert to intuitive bit system. bit 0 = seg a, bit 7 = decimal*/
-        fx2dev->segments |= (value & 0x01);
-        fx2dev->segments |= (value & 0x02);
-        fx2dev->segments |= (value & 0x04);
-        fx2dev->segments |= ((value >> 4) & 0x08);
-        fx2dev->segments |= (value & 0x10);
-        fx2dev->segments |= ((value >> 1) & 0x20);
-        fx2dev->segments |= ((value << 1) & 0x40);
-        fx2dev->segments |= ((value << 4) & 0x80);
-    }
-
-    /*Set values*/
-    retval = usb_control_msg(fx2dev->udev, usb_sndctrlpipe(fx2dev->udev, 0),
-                             SET_7SEG, USB_DIR_OUT | USB_TYPE_VENDOR, 0, 0,
-                             &fx2dev->segments, sizeof(fx2dev->segments),
-                             USB_CTRL_GET_TIMEOUT);
+    mutex_lock(&fx2dev->io_mutex);
+    if (fx2dev->bulk_in_ring)
+        retval = -EBUSY;
+    else
+        fx2dev->read_ahead_size = rounddown(value, fx2dev->bulk_in_size);
+    mutex_unlock(&fx2dev->io_mutex);
+
+    return retval ? retval : count;
+}
 
+/*Choose the speed profile from the negotiated bus speed, cross-checked
+  against the firmware's own view through IS_HIGH_SPEED*/
+static const struct osrfx2_profile * osrfx2_select_profile(struct osrfx2 * fx2dev) {
+    int high = fx2dev->udev->speed >= USB_SPEED_HIGH;
+    unsigned char value;
+    int retval;
+
+    retval = osrfx2_vendor_read(fx2dev, IS_HIGH_SPEED, &value);
     if (retval < 0)
-        dev_err(&fx2dev->udev->dev, "%s - retval=%d\n", __FUNCTION__, retval);
+        dev_warn(&fx2dev->interface->dev, "%s - IS_HIGH_SPEED failed: %d\n", __FUNCTION__, retval);
+    else if (!!value != high)
+        dev_warn(&fx2dev->interface->dev, "%s - firmware reports %s speed, bus reports %s\n",
+                 __FUNCTION__, value ? "high" : "full", usb_speed_string(fx2dev->udev->speed));
+
+    /*The host controller's view decides, it is what the transfers run at*/
+    return high ? &osrfx2_profile_high : &osrfx2_profile_full;
+}
+
+/*Interrupt-in urb interval for the profile, in the units of the bus speed*/
+static int osrfx2_int_interval(struct osrfx2 * fx2dev) {
+    unsigned int ms = fx2dev->profile->int_in_interval_ms;
+
+    if (!ms)
+        return fx2dev->int_in_endpointInterval;
+
+    /*High speed takes an exponent, 2^(interval-1) microframes*/
+    if (fx2dev->udev->speed >= USB_SPEED_HIGH)
+        return clamp_t(int, ilog2(ms * 8) + 1, 1, 16);
+
+    return clamp_t(int, ms, 1, 255);
+}
+
+/*Gets the name of the speed profile picked at probe*/
+static ssize_t get_speed_profile(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct usb_interface  *intf   = to_usb_interface(dev);
+    struct osrfx2         *fx2dev = usb_get_intfdata(intf);
+
+    return sprintf(buf, "%s\n", fx2dev->profile ? fx2dev->profile->name : "unknown");
+}
+
+/*Gets the length of each bulk-in read transfer*/
+static ssize_t get_bulk_in_xfer_size(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct usb_interface  *intf   = to_usb_interface(dev);
+    struct osrfx2         *fx2dev = usb_get_intfdata(intf);
+
+    return sprintf(buf, "%zu\n", fx2dev->bulk_in_xfer_size);
+}
+
+/*Sets the length of each bulk-in read transfer, reallocating bulk_in_buffer*/
+static ssize_t set_bulk_in_xfer_size(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    struct usb_interface  *intf   = to_usb_interface(dev);
+    struct osrfx2         *fx2dev = usb_get_intfdata(intf);
+    unsigned char *buffer;
+    unsigned int value;
+    int retval;
+
+    retval = kstrtouint(buf, 10, &value);
+    if (retval)
+        return retval;
+
+    if (value < BULK_IN_XFER_MIN || value > BULK_IN_XFER_MAX)
+        return -EINVAL;
+
+    value = rounddown(value, fx2dev->bulk_in_size);
+
+    buffer = kmalloc(value, GFP_KERNEL);
+    if (!buffer)
+        return -ENOMEM;
+
+    /*Synchronous readers hold read_mutex while they use the buffer*/
+    mutex_lock(&fx2dev->read_mutex);
+    swap(fx2dev->bulk_in_buffer, buffer);
+    WRITE_ONCE(fx2dev->bulk_in_xfer_size, value);
+    mutex_unlock(&fx2dev->read_mutex);
+
+    kfree(buffer);
+
+    return count;
+}
+
+/*Gets the number of writes served from the write pool*/
+static ssize_t get_write_pool_hits(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct usb_interface  *intf   = to_usb_interface(dev);
+    struct osrfx2         *fx2dev = usb_get_intfdata(intf);
+
+    return sprintf(buf, "%ld\n", atomic_long_read(&fx2dev->write_pool_hits));
+}
+
+/*Gets the number of writes that fell back to the allocator*/
+static ssize_t get_write_pool_misses(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct usb_interface  *intf   = to_usb_interface(dev);
+    struct osrfx2         *fx2dev = usb_get_intfdata(intf);
+
+    return sprintf(buf, "%ld\n", atomic_long_read(&fx2dev->write_pool_misses));
+}
+
+/*Gets the number of bulk-out URBs allowed in flight*/
+static ssize_t get_write_max_urbs(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct usb_interface  *intf   = to_usb_interface(dev);
+    struct osrfx2         *fx2dev = usb_get_intfdata(intf);
+
+    return sprintf(buf, "%u\n", fx2dev->write_max_urbs);
+}
+
+/*Sets the number of bulk-out URBs allowed in flight*/
+static ssize_t set_write_max_urbs(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    struct usb_interface  *intf   = to_usb_interface(dev);
+    struct osrfx2         *fx2dev = usb_get_intfdata(intf);
+    unsigned int value;
+    int retval;
+
+    retval = kstrtouint(buf, 10, &value);
+    if (retval)
+        return retval;
+
+    if (value == 0 || value > WRITE_MAX_URBS)
+        return -EINVAL;
+
+    fx2dev->write_max_urbs = value;
+
+    /*A larger budget may unblock waiting writers*/
+    wake_up_interruptible(&fx2dev->write_wait);
+
+    return count;
+}
+
+/*Gets the number of bulk-out bytes allowed in flight*/
+static ssize_t get_write_max_bytes(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct usb_interface  *intf   = to_usb_interface(dev);
+    struct osrfx2         *fx2dev = usb_get_intfdata(intf);
+
+    return sprintf(buf, "%zu\n", fx2dev->write_max_bytes);
+}
+
+/*Sets the number of bulk-out bytes allowed in flight*/
+static ssize_t set_write_max_bytes(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    struct usb_interface  *intf   = to_usb_interface(dev);
+    struct osrfx2         *fx2dev = usb_get_intfdata(intf);
+    unsigned int value;
+    int retval;
+
+    retval = kstrtouint(buf, 10, &value);
+    if (retval)
+        return retval;
+
+    if (value == 0)
+        return -EINVAL;
+
+    fx2dev->write_max_bytes = value;
+
+    wake_up_interruptible(&fx2dev->write_wait);
+
+    return count;
+}
+
+/*Gets the number of writev() segments sharing one completion interrupt*/
+static ssize_t get_write_batch_max(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct usb_interface  *intf   = to_usb_interface(dev);
+    struct osrfx2         *fx2dev = usb_get_intfdata(intf);
+
+    return sprintf(buf, "%u\n", fx2dev->write_batch_max);
+}
+
+/*Sets the number of writev() segments sharing one completion interrupt*/
+static ssize_t set_write_batch_max(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    struct usb_interface  *intf   = to_usb_interface(dev);
+    struct osrfx2         *fx2dev = usb_get_intfdata(intf);
+    unsigned int value;
+    int retval;
+
+    retval = kstrtouint(buf, 10, &value);
+    if (retval)
+        return retval;
+
+    if (value > WRITE_BATCH_MAX)
+        return -EINVAL;
+
+    WRITE_ONCE(fx2dev->write_batch_max, value);
+
+    return count;
+}
+
+/*Gets the number of write URBs submitted with URB_NO_INTERRUPT. That is a
+  hint, host controllers are free to interrupt anyway, so it bounds the
+  interrupts saved rather than counting them*/
+static ssize_t get_write_urbs_no_interrupt(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct usb_interface  *intf   = to_usb_interface(dev);
+    struct osrfx2         *fx2dev = usb_get_intfdata(intf);
+
+    return sprintf(buf, "%ld\n", atomic_long_read(&fx2dev->write_urbs_no_interrupt));
+}
+
+/*Gets the flush deadline of staged small writes*/
+static ssize_t get_write_coalesce_us(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct usb_interface  *intf   = to_usb_interface(dev);
+    struct osrfx2         *fx2dev = usb_get_intfdata(intf);
+
+    return sprintf(buf, "%u\n", fx2dev->write_coalesce_us);
+}
+
+/*Sets the flush deadline of staged small writes, 0 sends what is staged and stops staging*/
+static ssize_t set_write_coalesce_us(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    struct usb_interface  *intf   = to_usb_interface(dev);
+    struct osrfx2         *fx2dev = usb_get_intfdata(intf);
+    unsigned int value;
+    int retval;
+
+    retval = kstrtouint(buf, 10, &value);
+    if (retval)
+        return retval;
+
+    if (value > WRITE_COALESCE_MAX_US)
+        return -EINVAL;
+
+    /*Staged bytes are anchored before a writer can see staging off and
+      skip write_mutex*/
+    mutex_lock(&fx2dev->write_mutex);
+    if (!value)
+        osrfx2_coalesce_flush(fx2dev);
+    smp_store_release(&fx2dev->write_coalesce_us, value);
+    mutex_unlock(&fx2dev->write_mutex);
+
+    return count;
+}
+
+/*Gets the number of writes appended to a staging buffer*/
+static ssize_t get_write_coalesced(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct usb_interface  *intf   = to_usb_interface(dev);
+    struct osrfx2         *fx2dev = usb_get_intfdata(intf);
+
+    return sprintf(buf, "%ld\n", atomic_long_read(&fx2dev->write_coalesced));
+}
+
+/*usb_submit_urb() that keeps the statistics and traces the submission, a
+  failed submission counts as an error completion. stamp is the urb's
+  osrfx2_timestamp(), stored where its completion finds it*/
+static int osrfx2_submit_urb(struct osrfx2 * fx2dev, struct urb * urb, gfp_t gfp, u64 stamp) {
+    int ep = osrfx2_stat_urb_ep(urb);
+    unsigned int pipe = urb->pipe;
+    u32 length = urb->transfer_buffer_length;
+    int retval;
+
+    /*Before submitting, the completion may run and free the urb before
+      usb_submit_urb() returns*/
+    if (stamp & OSRFX2_STAMP_COUNTED)
+        osrfx2_stat_submit(fx2dev, ep, length);
+
+    retval = usb_submit_urb(urb, gfp);
+    trace_osrfx2_urb_submit(fx2dev->minor, urb, pipe, length, retval);
+    if (retval && (stamp & OSRFX2_STAMP_COUNTED))
+        osrfx2_stat_done(fx2dev, ep, retval, 0);
+
+    return retval;
+}
+
+/*Account a completed urb, called first thing by every completion handler.
+  hist is the latency histogram to count it in, OSRFX2_HIST_COUNT for none,
+  and start_ns its submission stamp from osrfx2_timestamp(), 0 if unknown*/
+static void osrfx2_urb_done(struct osrfx2 * fx2dev, struct urb * urb, int hist, u64 start_ns) {
+    u64 duration_ns = 0;
+
+    if (!(start_ns & OSRFX2_STAMP_COUNTED) && !trace_osrfx2_urb_complete_enabled())
+        return;
+
+    if (start_ns)
+        duration_ns = ktime_get_ns() - start_ns;
+
+    trace_osrfx2_urb_complete(fx2dev->minor, urb, duration_ns);
+
+    /*Counted as its submission was, whatever the key says now*/
+    if (!(start_ns & OSRFX2_STAMP_COUNTED))
+        return;
+
+    osrfx2_stat_done(fx2dev, osrfx2_stat_urb_ep(urb), urb->status, urb->actual_length);
+
+    /*A cancelled urb would only time the cancellation*/
+    if (hist >= OSRFX2_HIST_COUNT || !start_ns ||
+        urb->status == -ENOENT || urb->status == -ECONNRESET || urb->status == -ESHUTDOWN)
+        return;
+
+    osrfx2_hist_record(fx2dev, hist, duration_ns);
+}
+
+/*Account a transfer handed to the host controller*/
+static void osrfx2_stat_submit(struct osrfx2 * fx2dev, int ep, size_t bytes) {
+    int depth, peak;
+
+    this_cpu_inc(fx2dev->stats->xfer[ep][OSRFX2_XFER_URBS_SUBMITTED]);
+    this_cpu_add(fx2dev->stats->xfer[ep][OSRFX2_XFER_BYTES_SUBMITTED], bytes);
+
+    /*The depth is a single device wide value, it can't be split per CPU*/
+    depth = atomic_inc_return(&fx2dev->inflight[ep]);
+    peak = atomic_read(&fx2dev->inflight_peak[ep]);
+    while (depth > peak && !atomic_try_cmpxchg(&fx2dev->inflight_peak[ep], &peak, depth))
+        ;
+}
+
+/*Account a finished transfer, bytes is what actually moved*/
+static void osrfx2_stat_done(struct osrfx2 * fx2dev, int ep, int status, size_t bytes) {
+    this_cpu_inc(fx2dev->stats->xfer[ep][OSRFX2_XFER_URBS_COMPLETED]);
+    this_cpu_add(fx2dev->stats->xfer[ep][OSRFX2_XFER_BYTES_COMPLETED], bytes);
+
+    if (status)
+        this_cpu_inc(fx2dev->stats->errors[osrfx2_stat_error(status)]);
+
+    atomic_dec(&fx2dev->inflight[ep]);
+}
+
+/*Statistics endpoint of an urb*/
+static int osrfx2_stat_urb_ep(struct urb * urb) {
+    switch (usb_pipetype(urb->pipe)) {
+    case PIPE_CONTROL:
+        return OSRFX2_EP_CONTROL;
+    case PIPE_INTERRUPT:
+        return OSRFX2_EP_INT_IN;
+    default:
+        return usb_pipein(urb->pipe) ? OSRFX2_EP_BULK_IN : OSRFX2_EP_BULK_OUT;
+    }
+}
+
+/*Error class of a non-zero urb status*/
+static int osrfx2_stat_error(int status) {
+    switch (status) {
+    case -EPIPE:
+        return OSRFX2_ERR_STALL;
+    case -EPROTO:
+        return OSRFX2_ERR_PROTOCOL;
+    case -EILSEQ:
+        return OSRFX2_ERR_CRC;
+    case -ETIME:
+    case -ETIMEDOUT:
+        return OSRFX2_ERR_TIMEOUT;
+    case -EOVERFLOW:
+        return OSRFX2_ERR_OVERFLOW;
+    case -ENOENT:
+    case -ECONNRESET:
+        return OSRFX2_ERR_UNLINKED;
+    case -ESHUTDOWN:
+    case -ENODEV:
+        return OSRFX2_ERR_SHUTDOWN;
+    default:
+        return OSRFX2_ERR_OTHER;
+    }
+}
+
+/*Gets a statistics counter, summed over all CPUs*/
+static ssize_t get_stat(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct usb_interface    *intf   = to_usb_interface(dev);
+    struct osrfx2           *fx2dev = usb_get_intfdata(intf);
+    struct osrfx2_stat_attr *sattr  = container_of(attr, struct osrfx2_stat_attr, attr);
+    u64 sum = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        sum += *(u64 *)((char *)per_cpu_ptr(fx2dev->stats, cpu) + sattr->offset);
+
+    return sprintf(buf, "%llu\n", sum);
+}
+
+/*Gets the URBs of an endpoint currently submitted*/
+static ssize_t get_stat_inflight(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct usb_interface    *intf   = to_usb_interface(dev);
+    struct osrfx2           *fx2dev = usb_get_intfdata(intf);
+    struct osrfx2_stat_attr *sattr  = container_of(attr, struct osrfx2_stat_attr, attr);
+
+    return sprintf(buf, "%d\n", atomic_read(&fx2dev->inflight[sattr->ep]));
+}
+
+/*Gets the highest number of URBs an endpoint had submitted at once*/
+static ssize_t get_stat_inflight_peak(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct usb_interface    *intf   = to_usb_interface(dev);
+    struct osrfx2           *fx2dev = usb_get_intfdata(intf);
+    struct osrfx2_stat_attr *sattr  = container_of(attr, struct osrfx2_stat_attr, attr);
+
+    return sprintf(buf, "%d\n", atomic_read(&fx2dev->inflight_peak[sattr->ep]));
+}
+
+/*Gets the bytes written to the device and not yet read back*/
+static ssize_t get_pending_data(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct usb_interface  *intf   = to_usb_interface(dev);
+    struct osrfx2         *fx2dev = usb_get_intfdata(intf);
+
+    return sprintf(buf, "%ld\n", atomic_long_read(&fx2dev->pending_data));
+}
+
+/*Count one latency sample in a histogram*/
+static void osrfx2_hist_record(struct osrfx2 * fx2dev, int hist, u64 ns) {
+    unsigned int bucket = ns ? min_t(unsigned int, ilog2(ns), OSRFX2_HIST_BUCKETS - 1) : 0;
+
+    this_cpu_inc(fx2dev->stats->latency[hist][bucket]);
+}
+
+/*Count the time since start_ns*/
+static void osrfx2_hist_since(struct osrfx2 * fx2dev, int hist, u64 start_ns) {
+    osrfx2_hist_record(fx2dev, hist, ktime_get_ns() - start_ns);
+}
+
+/*Histogram of a vendor request, OSRFX2_HIST_COUNT for none*/
+static int osrfx2_hist_vendor(__u8 request) {
+    switch (request) {
+    case READ_7SEG:     return OSRFX2_HIST_READ_7SEG;
+    case SET_7SEG:      return OSRFX2_HIST_SET_7SEG;
+    case READ_LEDS:     return OSRFX2_HIST_READ_LEDS;
+    case SET_LEDS:      return OSRFX2_HIST_SET_LEDS;
+    case READ_SWITCHES: return OSRFX2_HIST_READ_SWITCHES;
+    case IS_HIGH_SPEED: return OSRFX2_HIST_IS_HIGH_SPEED;
+    default:            return OSRFX2_HIST_COUNT;
+    }
+}
+
+/*Create <debugfs>/<module>/<interface>/latency/ with one file per histogram*/
+static void osrfx2_debugfs_init(struct osrfx2 * fx2dev) {
+    struct dentry *latency;
+    int i;
+
+    fx2dev->debugfs_dir = debugfs_create_dir(dev_name(&fx2dev->interface->dev), osrfx2_debugfs_root);
+    latency = debugfs_create_dir("latency", fx2dev->debugfs_dir);
+
+    for (i = 0; i < OSRFX2_HIST_COUNT; i++) {
+        fx2dev->hist_files[i].fx2dev = fx2dev;
+        fx2dev->hist_files[i].hist = i;
+        debugfs_create_file(osrfx2_hist_names[i], 0600, latency, &fx2dev->hist_files[i], &osrfx2_hist_fops);
+    }
+}
+
+static int osrfx2_hist_open(struct inode * inode, struct file * file) {
+    return single_open(file, osrfx2_hist_show, inode->i_private);
+}
+
+/*Show a histogram as one line per bucket from the first to the last used one,
+  followed by the sample count and percentiles rounded up to a bucket bound*/
+static int osrfx2_hist_show(struct seq_file * m, void * v) {
+    static const unsigned int permille[] = { 500, 900, 990, 999 };
+    struct osrfx2_hist_file *hf = m->private;
+    struct osrfx2 *fx2dev = hf->fx2dev;
+    u64 counts[OSRFX2_HIST_BUCKETS] = { 0 };
+    u64 total = 0, sum, target;
+    int first = -1, last = -1;
+    int cpu, i, p;
+
+    for_each_possible_cpu(cpu)
+        for (i = 0; i < OSRFX2_HIST_BUCKETS; i++)
+            counts[i] += per_cpu_ptr(fx2dev->stats, cpu)->latency[hf->hist][i];
+
+    for (i = 0; i < OSRFX2_HIST_BUCKETS; i++) {
+        if (!counts[i])
+            continue;
+        if (first < 0)
+            first = i;
+        last = i;
+        total += counts[i];
+    }
+
+    seq_printf(m, "%12s %12s  %s\n", "ns from", "ns to", "count");
+    for (i = first; i >= 0 && i <= last; i++)
+        seq_printf(m, "%12llu %12llu  %llu\n", i ? 1ULL << i : 0ULL, (1ULL << (i + 1)) - 1, counts[i]);
+
+    seq_printf(m, "samples %llu\n", total);
+    if (!total)
+        return 0;
+
+    for (p = 0; p < ARRAY_SIZE(permille); p++) {
+        target = div_u64(total * permille[p] + 999, 1000);
+        for (i = 0, sum = 0; i < OSRFX2_HIST_BUCKETS; i++) {
+            sum += counts[i];
+            if (sum >= target)
+                break;
+        }
+        seq_printf(m, "p%u.%u <= %llu ns\n", permille[p] / 10, permille[p] % 10,
+                   (1ULL << (min(i, OSRFX2_HIST_BUCKETS - 1) + 1)) - 1);
+    }
+
+    return 0;
+}
+
+/*Any write clears the histogram. Samples recorded while clearing may survive*/
+static ssize_t osrfx2_hist_write(struct file * file, const char __user * buf, size_t count, loff_t * ppos) {
+    struct osrfx2_hist_file *hf = ((struct seq_file *)file->private_data)->private;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(hf->fx2dev->stats, cpu)->latency[hf->hist], 0,
+               sizeof(per_cpu_ptr(hf->fx2dev->stats, cpu)->latency[hf->hist]));
+
+    return count;
+}
+
+/*Reads Y or N, like the instrument parameter*/
+static ssize_t osrfx2_instrument_read(struct file * file, char __user * buf, size_t count, loff_t * ppos) {
+    char state[2] = { static_key_enabled(&osrfx2_instrument) ? 'Y' : 'N', '\n' };
+
+    return simple_read_from_buffer(buf, count, ppos, state, sizeof(state));
+}
+
+/*Takes anything kstrtobool() understands*/
+static ssize_t osrfx2_instrument_write(struct file * file, const char __user * buf, size_t count, loff_t * ppos) {
+    bool on;
+    int retval;
+
+    retval = kstrtobool_from_user(buf, count, &on);
+    if (retval)
+        return retval;
+
+    if (on)
+        static_branch_enable(&osrfx2_instrument);
+    else
+        static_branch_disable(&osrfx2_instrument);
 
     return count;
 }
@@ -0,0 +1,105 @@
+/************************************************
+ * Userspace interface of the OSR FX2 drivers   *
+ * Shared by the kernel modules and the tools   *
+ ************************************************/
+
+#ifndef OSRFX2_H
+#define OSRFX2_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/***********************read() formats*******************************/
+#define OSRFX2_READ_TEXT      0     /*Switch state as "01010101"*/
+#define OSRFX2_READ_RECORDS   1     /*struct osrfx2_switch_event records*/
+#define OSRFX2_READ_STREAM    0     /*Original driver: bulk-in data as a byte stream*/
+#define OSRFX2_READ_MESSAGES  2     /*Original driver: struct osrfx2_msg_header records*/
+
+/*One DIP switch report, read() returns whole records only*/
+struct osrfx2_switch_event {
+    __u64 timestamp_ns;             /*ktime_get_ns() when the report arrived*/
+    __u32 seq;                      /*Report number, a gap means records were lost*/
+    __u8  switches;                 /*New switch state*/
+    __u8  previous;                 /*Switch state before this report*/
+    __u8  reserved[2];
+};
+
+/*One bulk-in transfer in OSRFX2_READ_MESSAGES mode, followed by length
+  bytes of payload. read() returns whole records only, as many as fit.*/
+struct osrfx2_msg_header {
+    __u32 length;                   /*Payload bytes after this header*/
+    __s32 status;                   /*URB status, 0 or negative errno*/
+    __u64 timestamp_ns;             /*ktime_get_ns() when the transfer completed*/
+    __u32 seq;                      /*Transfer number, a gap means transfers were not delivered*/
+    __u32 reserved;
+};
+
+/*Read-only page returned by mmap() of the reduced driver at offset 0.
+  Take a snapshot by re-reading until seqcount is even and unchanged.
+  events is an aligned 32-bit counter bumped on every report, so it can be
+  used as a futex word by userspace threads; the driver itself wakes
+  sleepers only through poll() on the file descriptor.*/
+struct osrfx2_shared_state {
+    __u32 seqcount;                 /*Odd while interrupt_handler() updates the page*/
+    __u32 events;                   /*Switch reports received*/
+    __u64 timestamp_ns;             /*ktime_get_ns() of the last report*/
+    __u8  switches;                 /*Current switch state*/
+    __u8  previous;                 /*Switch state before the last report*/
+    __u8  reserved[6];
+};
+
+/*******************OSR FX2 vendor requests**************************/
+#define OSRFX2_READ_7SEG      0xD4
+#define OSRFX2_READ_SWITCHES  0xD6
+#define OSRFX2_READ_LEDS      0xD7
+#define OSRFX2_SET_LEDS       0xD8
+#define OSRFX2_IS_HIGH_SPEED  0xD9
+#define OSRFX2_SET_7SEG       0xDB
+
+/*One vendor request of an OSRFX2_IOC_VENDOR_BATCH*/
+struct osrfx2_vendor_cmd {
+    __u8  request;                  /*One of the OSRFX2_ vendor requests*/
+    __u8  value;                    /*Byte sent by SET requests, byte received otherwise*/
+    __u16 reserved;
+    __s32 status;                   /*0 or negative errno, filled in by the driver*/
+};
+
+/*Requests are issued in array order and complete in that order*/
+struct osrfx2_vendor_batch {
+    __u64 cmds;                     /*Userspace pointer to struct osrfx2_vendor_cmd[count]*/
+    __u32 count;                    /*1 to OSRFX2_VENDOR_BATCH_MAX*/
+    __u32 flags;                    /*Must be 0*/
+};
+
+#define OSRFX2_VENDOR_BATCH_MAX     256
+
+/*read() completion thresholds of a file, in the spirit of termios VMIN/VTIME.
+  They apply to synchronous reads, with or without read-ahead.*/
+struct osrfx2_read_timing {
+    __u32 min_bytes;                /*Bytes read() waits for, capped at the read size;
+                                      0 = return after one transfer, the default*/
+    __u32 inter_ms;                 /*Once data has arrived, return it after this long
+                                      without another transfer, 0 = no limit*/
+    __u32 total_ms;                 /*Deadline of a whole read(), 0 = the default of 10 s per
+                                      transfer without read-ahead, none with it*/
+    __u32 flags;                    /*Must be 0*/
+};
+
+/*************************ioctl commands*****************************/
+#define OSRFX2_IOC_MAGIC      0xF2
+
+/*Select the read() format of this file, takes an int*/
+#define OSRFX2_IOC_SET_READ_MODE    _IOW(OSRFX2_IOC_MAGIC, 0x01, int)
+
+/*Set and get the read() thresholds of this file, original driver only*/
+#define OSRFX2_IOC_SET_READ_TIMING  _IOW(OSRFX2_IOC_MAGIC, 0x02, struct osrfx2_read_timing)
+#define OSRFX2_IOC_GET_READ_TIMING  _IOR(OSRFX2_IOC_MAGIC, 0x03, struct osrfx2_read_timing)
+
+/*Get the switch state of the last report, takes an int. Original driver
+  only, where it also clears the EPOLLPRI that signals a switch change.*/
+#define OSRFX2_IOC_GET_SWITCHES     _IOR(OSRFX2_IOC_MAGIC, 0x04, int)
+
+/*Issue many vendor requests in one call, original driver only*/
+#define OSRFX2_IOC_VENDOR_BATCH     _IOWR(OSRFX2_IOC_MAGIC, 0x10, struct osrfx2_vendor_batch)
+
+#endif /*OSRFX2_H*/
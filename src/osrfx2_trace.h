@@ -0,0 +1,200 @@
+/************************************************
+ * Tracepoints of the OSR FX2 original driver   *
+ * Events appear under events/osrfx2/ in tracefs*
+ ************************************************/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM osrfx2
+
+#if !defined(OSRFX2_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define OSRFX2_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/usb.h>
+
+/*Endpoint address of a pipe, direction bit included*/
+#define OSRFX2_TRACE_EP(pipe) \
+    (usb_pipeendpoint(pipe) | (usb_pipein(pipe) ? USB_DIR_IN : 0))
+
+/*usb_submit_urb() returned, length is the requested transfer length. The
+  urb may have completed and been freed by then, so pipe and length are
+  read before submitting and urb only identifies it*/
+TRACE_EVENT(osrfx2_urb_submit,
+    TP_PROTO(int minor, const void * urb, unsigned int pipe, u32 length, int status),
+    TP_ARGS(minor, urb, pipe, length, status),
+
+    TP_STRUCT__entry(
+        __field(int,          minor)
+        __field(const void *, urb)
+        __field(u8,           ep)
+        __field(u32,          length)
+        __field(int,          status)
+    ),
+
+    TP_fast_assign(
+        __entry->minor  = minor;
+        __entry->urb    = urb;
+        __entry->ep     = OSRFX2_TRACE_EP(pipe);
+        __entry->length = length;
+        __entry->status = status;
+    ),
+
+    TP_printk("minor=%d urb=%p ep=%02x length=%u status=%d",
+              __entry->minor, __entry->urb, __entry->ep, __entry->length, __entry->status)
+);
+
+/*Completion handler entered, length is what was transferred and duration
+  the time since submission, 0 if unknown*/
+TRACE_EVENT(osrfx2_urb_complete,
+    TP_PROTO(int minor, struct urb * urb, u64 duration_ns),
+    TP_ARGS(minor, urb, duration_ns),
+
+    TP_STRUCT__entry(
+        __field(int,          minor)
+        __field(const void *, urb)
+        __field(u8,           ep)
+        __field(u32,          length)
+        __field(int,          status)
+        __field(u64,          duration_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->minor       = minor;
+        __entry->urb         = urb;
+        __entry->ep          = OSRFX2_TRACE_EP(urb->pipe);
+        __entry->length      = urb->actual_length;
+        __entry->status      = urb->status;
+        __entry->duration_ns = duration_ns;
+    ),
+
+    TP_printk("minor=%d urb=%p ep=%02x length=%u status=%d duration_ns=%llu",
+              __entry->minor, __entry->urb, __entry->ep, __entry->length, __entry->status,
+              __entry->duration_ns)
+);
+
+/*read() returned, status is its result*/
+TRACE_EVENT(osrfx2_read,
+    TP_PROTO(int minor, size_t length, ssize_t status, u64 duration_ns),
+    TP_ARGS(minor, length, status, duration_ns),
+
+    TP_STRUCT__entry(
+        __field(int,     minor)
+        __field(size_t,  length)
+        __field(ssize_t, status)
+        __field(u64,     duration_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->minor       = minor;
+        __entry->length      = length;
+        __entry->status      = status;
+        __entry->duration_ns = duration_ns;
+    ),
+
+    TP_printk("minor=%d length=%zu status=%zd duration_ns=%llu",
+              __entry->minor, __entry->length, __entry->status, __entry->duration_ns)
+);
+
+/*Switch report that changed the state, interval is the time since the
+  previous report, 0 for the first one*/
+TRACE_EVENT(osrfx2_switch_change,
+    TP_PROTO(int minor, u8 switches, u8 previous, u64 interval_ns),
+    TP_ARGS(minor, switches, previous, interval_ns),
+
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(u8,  switches)
+        __field(u8,  previous)
+        __field(u64, interval_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->minor       = minor;
+        __entry->switches    = switches;
+        __entry->previous    = previous;
+        __entry->interval_ns = interval_ns;
+    ),
+
+    TP_printk("minor=%d switches=%02x previous=%02x interval_ns=%llu",
+              __entry->minor, __entry->switches, __entry->previous, __entry->interval_ns)
+);
+
+/*Vendor request completed, from sysfs, ioctl or the driver itself*/
+TRACE_EVENT(osrfx2_vendor_request,
+    TP_PROTO(int minor, u8 request, u8 value, int status, u64 duration_ns),
+    TP_ARGS(minor, request, value, status, duration_ns),
+
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(u8,  request)
+        __field(u8,  value)
+        __field(int, status)
+        __field(u64, duration_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->minor       = minor;
+        __entry->request     = request;
+        __entry->value       = value;
+        __entry->status      = status;
+        __entry->duration_ns = duration_ns;
+    ),
+
+    TP_printk("minor=%d request=%02x value=%02x status=%d duration_ns=%llu",
+              __entry->minor, __entry->request, __entry->value, __entry->status,
+              __entry->duration_ns)
+);
+
+/*Device and file lifecycle, duration is the time spent in the handler*/
+DECLARE_EVENT_CLASS(osrfx2_lifecycle,
+    TP_PROTO(int minor, int status, u64 duration_ns),
+    TP_ARGS(minor, status, duration_ns),
+
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(int, status)
+        __field(u64, duration_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->minor       = minor;
+        __entry->status      = status;
+        __entry->duration_ns = duration_ns;
+    ),
+
+    TP_printk("minor=%d status=%d duration_ns=%llu",
+              __entry->minor, __entry->status, __entry->duration_ns)
+);
+
+DEFINE_EVENT(osrfx2_lifecycle, osrfx2_probe_done,
+    TP_PROTO(int minor, int status, u64 duration_ns),
+    TP_ARGS(minor, status, duration_ns));
+
+DEFINE_EVENT(osrfx2_lifecycle, osrfx2_disconnect_done,
+    TP_PROTO(int minor, int status, u64 duration_ns),
+    TP_ARGS(minor, status, duration_ns));
+
+DEFINE_EVENT(osrfx2_lifecycle, osrfx2_open_done,
+    TP_PROTO(int minor, int status, u64 duration_ns),
+    TP_ARGS(minor, status, duration_ns));
+
+DEFINE_EVENT(osrfx2_lifecycle, osrfx2_release_done,
+    TP_PROTO(int minor, int status, u64 duration_ns),
+    TP_ARGS(minor, status, duration_ns));
+
+DEFINE_EVENT(osrfx2_lifecycle, osrfx2_suspend_done,
+    TP_PROTO(int minor, int status, u64 duration_ns),
+    TP_ARGS(minor, status, duration_ns));
+
+DEFINE_EVENT(osrfx2_lifecycle, osrfx2_resume_done,
+    TP_PROTO(int minor, int status, u64 duration_ns),
+    TP_ARGS(minor, status, duration_ns));
+
+#endif /*OSRFX2_TRACE_H*/
+
+/*Found through the -I the Makefile adds for src/*/
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE osrfx2_trace
+#include <trace/define_trace.h>
@@ -15,6 +15,12 @@
 #include <asm/uaccess.h>
 #include <linux/usb.h>
 #include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+
+#include "osrfx2.h"
 
 #define VENDOR_ID     0x0547       
 #define PRODUCT_ID    0x1002
@@ -25,14 +31,26 @@
 #define READ_SWITCHES 0xD6
 #define IS_HIGH_SPEED 0xD9
 
+/*********************Switch event ring limits***********************/
+#define SWITCH_RING_MIN  4
+#define SWITCH_RING_MAX  65536
+
 /**********************Function prototypes***************************/
+struct osrfx2_file;
+
 static int osrfx2_open(struct inode * inode, struct file * file);
 static int osrfx2_release(struct inode * inode, struct file * file);
 static ssize_t osrfx2_read(struct file * file, char * buffer, size_t count, loff_t * ppos);
+static __poll_t osrfx2_poll(struct file * file, poll_table * wait);
+static long osrfx2_ioctl(struct file * file, unsigned int cmd, unsigned long arg);
+static int osrfx2_mmap(struct file * file, struct vm_area_struct * vma);
+static int osrfx2_wait_switches(struct osrfx2_file * fp, struct file * file);
+static ssize_t osrfx2_read_records(struct osrfx2_file * fp, char * buffer, size_t count);
 static int osrfx2_probe(struct usb_interface * interface, const struct usb_device_id * id);
 static void osrfx2_disconnect(struct usb_interface * interface);
 static void osrfx2_delete(struct kref * kref);
 static void interrupt_handler(struct urb * urb);
+static void osrfx2_notify_switches(struct work_struct * work);
 static ssize_t get_switches(struct device *dev, struct device_attribute *attr, char *buf);
 
 /***********************Module structures****************************/
@@ -65,18 +83,38 @@ struct osrfx2 {
     struct kref kref;               /*Reference counter*/
 
     unsigned char switches;         /*Switch status*/
+    unsigned int switch_seq;        /*Switch reports received, see osrfx2_poll()*/
+    struct delayed_work switches_notify_work;   /*sysfs_notify() of the switches attribute*/
+    unsigned long switches_notified;    /*jiffies of the last notification*/
+
+    struct osrfx2_switch_event * switch_ring;   /*Last reports, written only by interrupt_handler()*/
+    unsigned int switch_ring_size;  /*Power of two number of records*/
+
+    struct page * state_page;       /*Backing page of the mmap()ed state*/
+    struct osrfx2_shared_state * state; /*Kernel address of state_page*/
 
     size_t pending_data;            /*Data tracking for read write*/
 
     struct mutex io_mutex;          /*used during cleanup after disconnect*/
 };
 
+/*Per open file state*/
+struct osrfx2_file {
+    struct osrfx2    * fx2dev;      /*Device this file was opened on*/
+    unsigned int       switch_seq;  /*Last switch report read through this file*/
+    int                read_mode;   /*OSRFX2_READ_TEXT or OSRFX2_READ_RECORDS*/
+};
+
 /* Declare device options and their respective routines in this driver */
 static const struct file_operations osrfx2_fops = {
     .owner   = THIS_MODULE,
     .open    = osrfx2_open,
     .release = osrfx2_release,
     .read    = osrfx2_read,
+    .poll    = osrfx2_poll,
+    .mmap    = osrfx2_mmap,
+    .unlocked_ioctl = osrfx2_ioctl,
+    .compat_ioctl   = compat_ptr_ioctl,
 };
 
 /* Declare probe and disconnect routines as well as id table */
@@ -95,6 +133,16 @@ static struct usb_class_driver osrfx2_class = {
     .minor_base = MINOR_BASE,
 };
 
+/*Switch event ring size, rounded up to a power of two*/
+static unsigned int switch_ring_size = 256;
+module_param(switch_ring_size, uint, 0444);
+MODULE_PARM_DESC(switch_ring_size, "Number of switch events buffered per device for OSRFX2_READ_RECORDS readers");
+
+/*Rate limit of poll() wakeups on the switches attribute*/
+static unsigned int switches_notify_ms = 20;
+module_param(switches_notify_ms, uint, 0644);
+MODULE_PARM_DESC(switches_notify_ms, "Minimum interval in ms between sysfs notifications of the switches attribute");
+
 /***********************Module functions*****************************/
 /*Create device attribute switches*/
 static DEVICE_ATTR(switches, S_IRUGO, get_switches, NULL);
@@ -139,6 +187,8 @@ static int osrfx2_probe(struct usb_interface * intf, const struct usb_device_id
     kref_init( &fx2dev->kref );
     mutex_init(&fx2dev->io_mutex);
     init_waitqueue_head(&fx2dev->FieldEventQueue);
+    INIT_DELAYED_WORK(&fx2dev->switches_notify_work, osrfx2_notify_switches);
+    fx2dev->switches_notified = jiffies - msecs_to_jiffies(switches_notify_ms);
     fx2dev->udev = usb_get_dev(udev);
     fx2dev->interface = intf;
     usb_set_intfdata(intf, fx2dev);
@@ -169,6 +219,27 @@ static int osrfx2_probe(struct usb_interface * intf, const struct usb_device_id
         return retval;
     }
 
+    /*Create switch event ring*/
+    fx2dev->switch_ring_size = roundup_pow_of_two(clamp_t(unsigned int, switch_ring_size,
+                                                          SWITCH_RING_MIN, SWITCH_RING_MAX));
+    fx2dev->switch_ring = kcalloc(fx2dev->switch_ring_size, sizeof(*fx2dev->switch_ring), GFP_KERNEL);
+    if (!fx2dev->switch_ring) {
+        retval = -ENOMEM;
+        dev_err(&intf->dev, "OSR FX2 device probe failed: %d.\n", retval);
+        if (fx2dev) kref_put( &fx2dev->kref, osrfx2_delete );
+        return retval;
+    }
+
+    /*Create the page userspace maps to poll the switches without syscalls*/
+    fx2dev->state_page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+    if (!fx2dev->state_page) {
+        retval = -ENOMEM;
+        dev_err(&intf->dev, "OSR FX2 device probe failed: %d.\n", retval);
+        if (fx2dev) kref_put( &fx2dev->kref, osrfx2_delete );
+        return retval;
+    }
+    fx2dev->state = page_address(fx2dev->state_page);
+
     /*Initialize interrupts*/
     pipe = usb_rcvintpipe(fx2dev->udev, fx2dev->int_in_endpointAddr);
     
@@ -233,6 +304,10 @@ static void osrfx2_disconnect(struct usb_interface * intf) {
 
     /*Release interrupt urb resources*/
     usb_kill_urb(fx2dev->int_in_urb);
+    cancel_delayed_work_sync(&fx2dev->switches_notify_work);
+
+    /*Let pollers see the hangup*/
+    wake_up(&fx2dev->FieldEventQueue);
 
     /*Remove sysfs files*/
     device_remove_file(&intf->dev, &dev_attr_switches);
@@ -253,6 +328,10 @@ static void osrfx2_delete(struct kref * kref) {
         usb_free_urb(fx2dev->int_in_urb);
     if (fx2dev->int_in_buffer)
         kfree(fx2dev->int_in_buffer);
+    if (fx2dev->switch_ring)
+        kfree(fx2dev->switch_ring);
+    if (fx2dev->state_page)
+        __free_page(fx2dev->state_page);
 
     kfree(fx2dev);
 }
@@ -261,6 +340,7 @@ static void osrfx2_delete(struct kref * kref) {
 static int osrfx2_open(struct inode * inode, struct file * file) {
     struct usb_interface *interface;
     struct osrfx2        *fx2dev;
+    struct osrfx2_file   *fp;
     int retval;
     
     interface = usb_find_interface(&osrfx2_driver, iminor(inode));
@@ -273,23 +353,34 @@ static int osrfx2_open(struct inode * inode, struct file * file) {
     retval = nonseekable_open(inode, file);
     if (retval) return retval;
 
+    /*Per-file state, the current switch state counts as unread*/
+    fp = kzalloc(sizeof(*fp), GFP_KERNEL);
+    if (!fp) return -ENOMEM;
+
+    fp->fx2dev = fx2dev;
+    fp->switch_seq = smp_load_acquire(&fx2dev->switch_seq) - 1;
+
     /*Increment our usage count for the device*/
     kref_get(&fx2dev->kref);
 
-    /*Save pointer to device instance in the file's private structure*/
-    file->private_data = fx2dev;
+    /*Save pointer to the per-file state in the file's private structure*/
+    file->private_data = fp;
 
     return 0;
 }
 
 /*Release device*/
 static int osrfx2_release(struct inode * inode, struct file * file) {
+    struct osrfx2_file * fp;
     struct osrfx2 * fx2dev;
     int flags;
 
-    fx2dev = (struct osrfx2 *)file->private_data;
-    if (!fx2dev)
+    fp = (struct osrfx2_file *)file->private_data;
+    if (!fp)
         return -ENODEV;
+
+    fx2dev = fp->fx2dev;
+    kfree(fp);
  
     /*Decrement the ref-count on the device instance*/
     kref_put(&fx2dev->kref, osrfx2_delete);
@@ -297,36 +388,214 @@ static int osrfx2_release(struct inode * inode, struct file * file) {
     return 0;
 }
 
-/*Read from /dev/osrfx2_0*/
+/*Read from /dev/osrfx2_0, sleeps until the switches change after this file's last read*/
 static ssize_t osrfx2_read(struct file * file, char * buffer, size_t count, loff_t * ppos) {
+    struct osrfx2_file *fp;
     struct osrfx2 *fx2dev;
+    unsigned char switches;
+    unsigned int seq;
+    char state[9];
     int retval = 0;
 
-    fx2dev = (struct osrfx2 *)file->private_data;
+    fp = (struct osrfx2_file *)file->private_data;
+    fx2dev = fp->fx2dev;
 
-    fx2dev->pending_data -= retval;
+    /*Wait for interrupt_handler() to record a state this file has not read*/
+    retval = osrfx2_wait_switches(fp, file);
+    if (retval)
+        return retval;
 
-    retval = sprintf(buffer, "%s%s%s%s%s%s%s%s", /*left sw --> right sw*/
-                    (fx2dev->switches & 0x80) ? "1" : "0",
-                    (fx2dev->switches & 0x40) ? "1" : "0",
-                    (fx2dev->switches & 0x20) ? "1" : "0",
-                    (fx2dev->switches & 0x10) ? "1" : "0",
-                    (fx2dev->switches & 0x08) ? "1" : "0",
-                    (fx2dev->switches & 0x04) ? "1" : "0",
-                    (fx2dev->switches & 0x02) ? "1" : "0",
-                    (fx2dev->switches & 0x01) ? "1" : "0");
+    if (fp->read_mode == OSRFX2_READ_RECORDS)
+        return osrfx2_read_records(fp, buffer, count);
+
+    /*Mark the latest state as read by this file*/
+    seq = smp_load_acquire(&fx2dev->switch_seq);
+    fp->switch_seq = seq;
+    switches = READ_ONCE(fx2dev->switches);
+
+    retval = sprintf(state, "%s%s%s%s%s%s%s%s", /*left sw --> right sw*/
+                    (switches & 0x80) ? "1" : "0",
+                    (switches & 0x40) ? "1" : "0",
+                    (switches & 0x20) ? "1" : "0",
+                    (switches & 0x10) ? "1" : "0",
+                    (switches & 0x08) ? "1" : "0",
+                    (switches & 0x04) ? "1" : "0",
+                    (switches & 0x02) ? "1" : "0",
+                    (switches & 0x01) ? "1" : "0");
+
+    /*Copy the state to userspace*/
+    if (count > retval)
+        count = retval;
+    if (copy_to_user(buffer, state, count))
+        return -EFAULT;
+
+    return count;
+}
 
-    return retval;
+/*Sleep until there is a switch report this file has not read, unless O_NONBLOCK*/
+static int osrfx2_wait_switches(struct osrfx2_file * fp, struct file * file) {
+    struct osrfx2 *fx2dev = fp->fx2dev;
+
+    if (smp_load_acquire(&fx2dev->switch_seq) != fp->switch_seq)
+        return 0;
+
+    if (!READ_ONCE(fx2dev->interface))
+        return -ENODEV;
+
+    if (file->f_flags & O_NONBLOCK)
+        return -EAGAIN;
+
+    if (wait_event_interruptible(fx2dev->FieldEventQueue,
+                                 smp_load_acquire(&fx2dev->switch_seq) != fp->switch_seq ||
+                                 !READ_ONCE(fx2dev->interface)))
+        return -ERESTARTSYS;
+
+    if (smp_load_acquire(&fx2dev->switch_seq) == fp->switch_seq)
+        return -ENODEV;
+
+    return 0;
+}
+
+/*Copy unread switch events out of the ring as whole records*/
+static ssize_t osrfx2_read_records(struct osrfx2_file * fp, char * buffer, size_t count) {
+    struct osrfx2 *fx2dev = fp->fx2dev;
+    struct osrfx2_switch_event event;
+    unsigned int size = fx2dev->switch_ring_size;
+    unsigned int head, next;
+    size_t copied = 0;
+
+    if (count < sizeof(event))
+        return -EINVAL;
+
+    while (copied + sizeof(event) <= count) {
+        head = smp_load_acquire(&fx2dev->switch_seq);
+        if (head == fp->switch_seq)
+            break;
+
+        /*Slot next is rewritten once head reaches next + size - 1, skip what
+          the producer has lapped; the sequence gap tells userspace*/
+        next = fp->switch_seq + 1;
+        if (head - next >= size - 1)
+            next = head - (size - 2);
+
+        event = fx2dev->switch_ring[next & (size - 1)];
+
+        /*Discard the copy if the producer got to the slot meanwhile*/
+        smp_rmb();
+        if (READ_ONCE(fx2dev->switch_seq) - next >= size - 1)
+            continue;
+
+        if (copy_to_user(buffer + copied, &event, sizeof(event)))
+            return copied ? copied : -EFAULT;
+
+        fp->switch_seq = next;
+        copied += sizeof(event);
+    }
+
+    return copied;
+}
+
+/*Map the shared state page read-only*/
+static int osrfx2_mmap(struct file * file, struct vm_area_struct * vma) {
+    struct osrfx2_file *fp = (struct osrfx2_file *)file->private_data;
+
+    if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != PAGE_SIZE)
+        return -EINVAL;
+
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+
+    /*The mapping keeps the file, and with it the device and page, alive*/
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+    return vm_insert_page(vma, vma->vm_start, fp->fx2dev->state_page);
+}
+
+/*Device specific ioctls*/
+static long osrfx2_ioctl(struct file * file, unsigned int cmd, unsigned long arg) {
+    struct osrfx2_file *fp = (struct osrfx2_file *)file->private_data;
+    int mode;
+
+    switch (cmd) {
+    case OSRFX2_IOC_SET_READ_MODE:
+        if (get_user(mode, (int __user *)arg))
+            return -EFAULT;
+
+        if (mode != OSRFX2_READ_TEXT && mode != OSRFX2_READ_RECORDS)
+            return -EINVAL;
+
+        /*Records start with the next report, text mode with the current state*/
+        fp->read_mode = mode;
+        fp->switch_seq = smp_load_acquire(&fp->fx2dev->switch_seq);
+        if (mode == OSRFX2_READ_TEXT)
+            fp->switch_seq--;
+        return 0;
+
+    default:
+        return -ENOTTY;
+    }
+}
+
+/*Poll for a switch state this file has not read yet*/
+static __poll_t osrfx2_poll(struct file * file, poll_table * wait) {
+    struct osrfx2_file *fp = (struct osrfx2_file *)file->private_data;
+    struct osrfx2 *fx2dev = fp->fx2dev;
+    __poll_t mask = 0;
+
+    poll_wait(file, &fx2dev->FieldEventQueue, wait);
+
+    if (!READ_ONCE(fx2dev->interface))
+        return EPOLLERR | EPOLLHUP;
+
+    if (smp_load_acquire(&fx2dev->switch_seq) != fp->switch_seq)
+        mask |= EPOLLIN | EPOLLRDNORM | EPOLLPRI;
+
+    return mask;
 }
 
 /*DIP switch interrupt handler*/
 static void interrupt_handler(struct urb * urb) {
     struct osrfx2 *fx2dev = urb->context;
     unsigned char *buf = urb->transfer_buffer;
+    struct osrfx2_switch_event *event;
+    unsigned long delay, next, now;
+    unsigned int seq;
     int retval;
 
     if (urb->status == 0) {
+        /*Record the report in the ring before publishing its sequence number*/
+        seq = fx2dev->switch_seq + 1;
+        event = &fx2dev->switch_ring[seq & (fx2dev->switch_ring_size - 1)];
+        event->timestamp_ns = ktime_get_ns();
+        event->seq          = seq;
+        event->previous     = fx2dev->switches;
+        event->switches     = *buf;
+
+        /*Notify sysfs pollers of real changes only, deferred out of atomic context*/
+        if (event->switches != event->previous) {
+            /*Wrap-safe, jiffies start close to wrapping on 32-bit*/
+            next = fx2dev->switches_notified + msecs_to_jiffies(switches_notify_ms);
+            now = jiffies;
+            delay = time_before(now, next) ? next - now : 0;
+            schedule_delayed_work(&fx2dev->switches_notify_work, delay);
+        }
+
         fx2dev->switches = *buf; /*Get new switch state*/
+        smp_store_release(&fx2dev->switch_seq, seq);
+
+        /*Publish to the mmap()ed page under its seqcount*/
+        WRITE_ONCE(fx2dev->state->seqcount, fx2dev->state->seqcount + 1);
+        smp_wmb();
+        WRITE_ONCE(fx2dev->state->timestamp_ns, event->timestamp_ns);
+        WRITE_ONCE(fx2dev->state->previous, event->previous);
+        WRITE_ONCE(fx2dev->state->switches, event->switches);
+        WRITE_ONCE(fx2dev->state->events, seq);
+        smp_wmb();
+        WRITE_ONCE(fx2dev->state->seqcount, fx2dev->state->seqcount + 1);
 
         wake_up(&(fx2dev->FieldEventQueue)); /*Wake-up any requests enqueued*/
 
@@ -341,6 +610,18 @@ static void interrupt_handler(struct urb * urb) {
     dev_err(&urb->dev->dev, "%s - non-zero urb status received: %d\n", __FUNCTION__, urb->status);
 }
 
+/*Wake poll()/select() on the switches attribute, runs from the system workqueue*/
+static void osrfx2_notify_switches(struct work_struct * work) {
+    struct osrfx2 *fx2dev = container_of(to_delayed_work(work), struct osrfx2, switches_notify_work);
+
+    fx2dev->switches_notified = jiffies;
+
+    mutex_lock(&fx2dev->io_mutex);
+    if (fx2dev->interface)
+        sysfs_notify(&fx2dev->interface->dev.kobj, NULL, dev_attr_switches.attr.name);
+    mutex_unlock(&fx2dev->io_mutex);
+}
+
 /*Retreive the values of the switches*/
 static ssize_t get_switches(struct device *dev, struct device_attribute *attr, char *buf) {
     struct usb_interface   *intf   = to_usb_interface(dev);
@@ -0,0 +1,1213 @@
+/************************************************
+ * Throughput and latency benchmark of the      *
+ * OSR FX2 character devices                    *
+ ************************************************/
+
+/*
+ * Bulk modes write a known pattern to EP6 and read it back from EP8 through
+ * the board's loopback (or tools/fx2emu), so every byte is timed from the
+ * write() that sent it to the read() that returned it:
+ *
+ *   sync      blocking write() and read() in two threads
+ *   vectored  blocking writev() and readv() in two threads, --iovecs segments each
+ *   epoll     one thread, O_NONBLOCK, at most depth transfers in flight
+ *   uring     one thread, io_uring with batches of depth writes and depth reads
+ *
+ * The uring mode links its writes, and separately its reads, into chains of
+ * up to depth transfers, as io_uring may otherwise complete them out of
+ * stream order. A chain is queued once the previous one has completed and
+ * its links run one after another, so for uring depth is the batch size
+ * per submission: one write and one read are in flight at a time. The
+ * output reports that as "inflight".
+ *
+ * The mmap mode times switch reports of the reduced driver instead: poll()
+ * wakes on a report and the mapped struct osrfx2_shared_state is read.
+ *
+ * Every run prints one JSON object per line (or a table with --text), with
+ * throughput, CPU cycles per byte from perf and loopback latency percentiles,
+ * plus the kernel release and the driver's module parameters so results can
+ * be compared across changes.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/utsname.h>
+
+#include <linux/io_uring.h>
+#include <linux/perf_event.h>
+
+#include "../src/osrfx2.h"
+
+#define PATTERN_PERIOD  251         /*Prime, so the pattern never lines up with packets*/
+#define LAT_RING_SIZE   65536       /*Writes whose data has not been read back yet*/
+#define HIST_SUB_BITS   4           /*16 buckets per power of two, about 6% resolution*/
+#define HIST_BUCKETS    (64 << HIST_SUB_BITS)
+#define MAX_IOVECS      64
+#define MAX_PARAMS      32
+
+enum { MODE_SYNC, MODE_VECTORED, MODE_EPOLL, MODE_URING, MODE_MMAP, MODE_COUNT };
+
+static const char * const mode_names[MODE_COUNT] = { "sync", "vectored", "epoll", "uring", "mmap" };
+
+/*Log-linear latency histogram in nanoseconds*/
+struct hist {
+    uint64_t buckets[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t max;
+};
+
+/*One write, timed until its last byte is read back*/
+struct lat_rec {
+    uint64_t end;                   /*Stream offset after the write*/
+    uint64_t start_ns;              /*When the write was issued*/
+};
+
+/*Single producer single consumer queue of lat_rec*/
+struct lat_ring {
+    struct lat_rec recs[LAT_RING_SIZE];
+    uint64_t head;                  /*Consumer*/
+    uint64_t tail;                  /*Producer*/
+};
+
+/*State and results of one run*/
+struct run {
+    int mode;
+    size_t size;
+    unsigned int depth;
+
+    int fd;
+    const unsigned char * pattern;  /*PATTERN_PERIOD + size bytes of the repeating pattern*/
+    volatile int stop;              /*Stop issuing writes*/
+    volatile int abort;             /*Stop everything, the drain timed out*/
+
+    uint64_t bytes_written;
+    uint64_t bytes_read;
+    uint64_t writes, reads;
+    uint64_t mismatches;            /*Bytes read back that differ from the pattern*/
+    uint64_t lost;                  /*Bytes or switch reports never seen*/
+    uint64_t start_ns, end_ns;
+
+    struct lat_ring * lat;
+    struct hist hist;
+
+    int64_t cycles;                 /*-1 if perf is not available*/
+    const char * cycles_scope;      /*"all" or "user"*/
+    uint64_t cpu_ns;
+    char error[128];
+};
+
+/*Benchmark options*/
+static struct {
+    const char * device;
+    int modes[MODE_COUNT];
+    size_t sizes[32];
+    unsigned int nsizes;
+    unsigned int depths[32];
+    unsigned int ndepths;
+    unsigned int iovecs;
+    double duration;
+    double drain;
+    int text;
+} opt = {
+    .device   = "/dev/usb/osrfx2_0",
+    .iovecs   = 4,
+    .duration = 2.0,
+    .drain    = 2.0,
+};
+
+/*Driver module parameters, read once*/
+static struct {
+    char name[48];
+    char value[32];
+} params[MAX_PARAMS];
+static unsigned int nparams;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_ns(uint64_t ns) {
+    struct timespec ts = { .tv_sec = ns / 1000000000ull, .tv_nsec = ns % 1000000000ull };
+
+    nanosleep(&ts, NULL);
+}
+
+static void run_error(struct run * run, const char * what, int err) {
+    if (!run->error[0])
+        snprintf(run->error, sizeof(run->error), "%s: %s", what, strerror(err));
+    run->abort = 1;
+    run->stop = 1;
+}
+
+/**************************Histogram*********************************/
+static unsigned int hist_index(uint64_t v) {
+    unsigned int msb;
+
+    if (v < (1u << HIST_SUB_BITS))
+        return v;
+
+    msb = 63 - __builtin_clzll(v);
+    return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+           ((v >> (msb - HIST_SUB_BITS)) & ((1u << HIST_SUB_BITS) - 1));
+}
+
+/*Middle of a bucket's range*/
+static uint64_t hist_value(unsigned int idx) {
+    unsigned int shift;
+    uint64_t low;
+
+    if (idx < (1u << HIST_SUB_BITS))
+        return idx;
+
+    shift = (idx >> HIST_SUB_BITS) - 1;
+    low = (uint64_t)((1u << HIST_SUB_BITS) + (idx & ((1u << HIST_SUB_BITS) - 1))) << shift;
+    return low + ((1ull << shift) >> 1);
+}
+
+static void hist_add(struct hist * hist, uint64_t v) {
+    hist->buckets[hist_index(v)]++;
+    hist->count++;
+    if (v > hist->max)
+        hist->max = v;
+}
+
+/*Value below which the fraction q of the samples lies*/
+static uint64_t hist_percentile(const struct hist * hist, double q) {
+    uint64_t rank, seen = 0;
+    unsigned int i;
+
+    if (!hist->count)
+        return 0;
+
+    rank = (uint64_t)(q * hist->count);
+    if (rank >= hist->count)
+        rank = hist->count - 1;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen > rank)
+            return hist_value(i) < hist->max ? hist_value(i) : hist->max;
+    }
+
+    return hist->max;
+}
+
+/************************Latency records*****************************/
+/*Producer side, waits while the consumer is a whole ring behind*/
+static void lat_push(struct run * run, uint64_t end, uint64_t start_ns) {
+    struct lat_ring *lat = run->lat;
+    uint64_t tail = lat->tail;
+
+    while (tail - __atomic_load_n(&lat->head, __ATOMIC_ACQUIRE) >= LAT_RING_SIZE && !run->abort)
+        sched_yield();
+
+    lat->recs[tail % LAT_RING_SIZE].end = end;
+    lat->recs[tail % LAT_RING_SIZE].start_ns = start_ns;
+    __atomic_store_n(&lat->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*Consumer side, time every write whose data has now been read back*/
+static void lat_pop(struct run * run, uint64_t read_end, uint64_t t) {
+    struct lat_ring *lat = run->lat;
+    uint64_t head = lat->head;
+    uint64_t tail = __atomic_load_n(&lat->tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail && lat->recs[head % LAT_RING_SIZE].end <= read_end) {
+        hist_add(&run->hist, t - lat->recs[head % LAT_RING_SIZE].start_ns);
+        head++;
+    }
+
+    __atomic_store_n(&lat->head, head, __ATOMIC_RELEASE);
+}
+
+/*Account len bytes read into buf at the current read offset*/
+static void read_done(struct run * run, const unsigned char * buf, size_t len) {
+    uint64_t off = run->bytes_read;
+    size_t i;
+
+    if (memcmp(buf, run->pattern + off % PATTERN_PERIOD, len))
+        for (i = 0; i < len; i++)
+            run->mismatches += buf[i] != run->pattern[(off + i) % PATTERN_PERIOD];
+
+    run->reads++;
+    __atomic_store_n(&run->bytes_read, off + len, __ATOMIC_RELEASE);
+    lat_pop(run, off + len, now_ns());
+}
+
+/*Split len bytes at base into cnt segments*/
+static int fill_iovecs(struct iovec * iov, const void * base, size_t len, unsigned int cnt) {
+    size_t seg = len / cnt;
+    unsigned int i;
+
+    if (!seg)
+        cnt = 1, seg = len;
+
+    for (i = 0; i < cnt; i++) {
+        iov[i].iov_base = (char *)base + i * seg;
+        iov[i].iov_len = i == cnt - 1 ? len - i * seg : seg;
+    }
+
+    return cnt;
+}
+
+/************************Threaded modes******************************/
+static void on_sigusr1(int sig) {
+    (void)sig;
+}
+
+static void * writer_thread(void * arg) {
+    struct run *run = arg;
+    struct iovec iov[MAX_IOVECS];
+    const unsigned char *src;
+    uint64_t start;
+    ssize_t len;
+    int cnt;
+
+    while (!run->stop) {
+        src = run->pattern + run->bytes_written % PATTERN_PERIOD;
+        start = now_ns();
+
+        if (run->mode == MODE_VECTORED) {
+            cnt = fill_iovecs(iov, src, run->size, opt.iovecs);
+            len = writev(run->fd, iov, cnt);
+        }
+        else
+            len = write(run->fd, src, run->size);
+
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            run_error(run, "write", errno);
+            break;
+        }
+
+        /*Published after the write, so the reader never waits for more than was sent*/
+        lat_push(run, run->bytes_written + len, start);
+        run->writes++;
+        __atomic_store_n(&run->bytes_written, run->bytes_written + len, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+static void * reader_thread(void * arg) {
+    struct run *run = arg;
+    struct iovec iov[MAX_IOVECS];
+    unsigned char *buf = malloc(run->size);
+    ssize_t len;
+    int cnt;
+
+    if (!buf) {
+        run_error(run, "malloc", ENOMEM);
+        return NULL;
+    }
+
+    while (!run->abort) {
+        if (run->mode == MODE_VECTORED) {
+            cnt = fill_iovecs(iov, buf, run->size, opt.iovecs);
+            len = readv(run->fd, iov, cnt);
+        }
+        else
+            len = read(run->fd, buf, run->size);
+
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            run_error(run, "read", errno);
+            break;
+        }
+
+        read_done(run, buf, len);
+        run->end_ns = now_ns();
+    }
+
+    free(buf);
+    return NULL;
+}
+
+static void run_threaded(struct run * run) {
+    pthread_t writer, reader;
+    struct sigaction sa;
+    uint64_t deadline;
+
+    /*SIGUSR1 without SA_RESTART takes the reader out of a blocked read()*/
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigusr1;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    run->start_ns = run->end_ns = now_ns();
+    if (pthread_create(&reader, NULL, reader_thread, run)) {
+        run_error(run, "pthread_create", errno);
+        return;
+    }
+    if (pthread_create(&writer, NULL, writer_thread, run)) {
+        run_error(run, "pthread_create", errno);
+        pthread_kill(reader, SIGUSR1);
+        pthread_join(reader, NULL);
+        return;
+    }
+
+    sleep_ns(opt.duration * 1e9);
+    run->stop = 1;
+
+    /*A writer blocked on a full device is released by the reader draining it*/
+    deadline = now_ns() + opt.drain * 1e9;
+    while (pthread_tryjoin_np(writer, NULL)) {
+        if (now_ns() > deadline) {
+            run_error(run, "write drain", ETIMEDOUT);
+            pthread_kill(writer, SIGUSR1);
+        }
+        sleep_ns(1000000);
+    }
+
+    deadline = now_ns() + opt.drain * 1e9;
+    while (__atomic_load_n(&run->bytes_read, __ATOMIC_ACQUIRE) < run->bytes_written && !run->abort &&
+           now_ns() < deadline)
+        sleep_ns(1000000);
+
+    run->abort = 1;
+    while (pthread_tryjoin_np(reader, NULL)) {
+        pthread_kill(reader, SIGUSR1);
+        sleep_ns(1000000);
+    }
+}
+
+/**************************epoll mode********************************/
+static void run_epoll(struct run * run) {
+    unsigned char *buf = malloc(run->size);
+    uint64_t window = (uint64_t)run->size * run->depth;
+    struct epoll_event ev, events[4];
+    uint64_t deadline = 0, start;
+    int epfd, n, i, want_out = 1, want;
+    ssize_t len;
+
+    epfd = epoll_create1(0);
+    if (epfd < 0) {
+        run_error(run, "epoll_create1", errno);
+        goto out;
+    }
+    if (!buf) {
+        run_error(run, "malloc", ENOMEM);
+        goto out;
+    }
+
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.fd = run->fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, run->fd, &ev)) {
+        run_error(run, "epoll_ctl", errno);
+        goto out;
+    }
+
+    run->start_ns = run->end_ns = now_ns();
+    while (!run->abort) {
+        if (!run->stop && now_ns() - run->start_ns >= opt.duration * 1e9) {
+            run->stop = 1;
+            deadline = now_ns() + opt.drain * 1e9;
+        }
+        if (run->stop && run->bytes_read >= run->bytes_written)
+            break;
+        if (run->stop && now_ns() > deadline) {
+            run_error(run, "read drain", ETIMEDOUT);
+            break;
+        }
+
+        /*Only ask for EPOLLOUT while another transfer fits in the window*/
+        want = !run->stop && run->bytes_written - run->bytes_read + run->size <= window;
+        if (want != want_out) {
+            ev.events = EPOLLIN | (want ? EPOLLOUT : 0);
+            epoll_ctl(epfd, EPOLL_CTL_MOD, run->fd, &ev);
+            want_out = want;
+        }
+
+        n = epoll_wait(epfd, events, 4, 100);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            run_error(run, "epoll_wait", errno);
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                run_error(run, "epoll", EIO);
+                break;
+            }
+
+            while (events[i].events & EPOLLIN) {
+                len = read(run->fd, buf, run->size);
+                if (len < 0) {
+                    if (errno != EAGAIN && errno != EINTR)
+                        run_error(run, "read", errno);
+                    break;
+                }
+                read_done(run, buf, len);
+                run->end_ns = now_ns();
+            }
+
+            if ((events[i].events & EPOLLOUT) && want_out &&
+                run->bytes_written - run->bytes_read + run->size <= window) {
+                start = now_ns();
+                len = write(run->fd, run->pattern + run->bytes_written % PATTERN_PERIOD, run->size);
+                if (len < 0) {
+                    if (errno != EAGAIN && errno != EINTR)
+                        run_error(run, "write", errno);
+                    continue;
+                }
+                lat_push(run, run->bytes_written + len, start);
+                run->bytes_written += len;
+                run->writes++;
+            }
+        }
+    }
+
+out:
+    if (epfd >= 0)
+        close(epfd);
+    free(buf);
+}
+
+/*************************io_uring mode******************************/
+/*Raw io_uring rings, without liburing*/
+struct uring {
+    int fd;
+    unsigned int entries;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    unsigned int to_submit;
+};
+
+static int uring_init(struct uring * ring, unsigned int entries) {
+    struct io_uring_params p;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0)
+        return -1;
+
+    ring->entries = p.sq_entries;
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ring->sq_len = ring->cq_len = ring->sq_len > ring->cq_len ? ring->sq_len : ring->cq_len;
+
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+        return -1;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq_ptr = ring->sq_ptr;
+    else {
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED)
+            return -1;
+    }
+
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        return -1;
+
+    ring->sq_head  = (unsigned int *)((char *)ring->sq_ptr + p.sq_off.head);
+    ring->sq_tail  = (unsigned int *)((char *)ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask  = (unsigned int *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)((char *)ring->sq_ptr + p.sq_off.array);
+    ring->cq_head  = (unsigned int *)((char *)ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail  = (unsigned int *)((char *)ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask  = (unsigned int *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes     = (struct io_uring_cqe *)((char *)ring->cq_ptr + p.cq_off.cqes);
+
+    return 0;
+}
+
+static void uring_exit(struct uring * ring) {
+    if (ring->sqes && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ptr && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_len);
+    if (ring->sq_ptr && ring->sq_ptr != MAP_FAILED)
+        munmap(ring->sq_ptr, ring->sq_len);
+    if (ring->fd >= 0)
+        close(ring->fd);
+}
+
+/*Queue a read or write at the file position, the callers never exceed the ring size*/
+static struct io_uring_sqe * uring_prep(struct uring * ring, int op, int fd, void * addr, size_t len, uint64_t data) {
+    unsigned int tail = *ring->sq_tail;
+    unsigned int idx = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = op;
+    sqe->fd        = fd;
+    sqe->addr      = (uintptr_t)addr;
+    sqe->len       = len;
+    sqe->off       = (uint64_t)-1;
+    sqe->user_data = data;
+
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+
+    return sqe;
+}
+
+/*Read and write slots are told apart by the top bit of user_data*/
+#define URING_WRITE     (1ull << 63)
+
+static void run_uring(struct run * run) {
+    unsigned char **bufs = calloc(run->depth, sizeof(*bufs));
+    unsigned int *free_reads = calloc(run->depth, sizeof(*free_reads));
+    uint64_t *write_start = calloc(run->depth, sizeof(*write_start));
+    unsigned int *free_writes = calloc(run->depth, sizeof(*free_writes));
+    unsigned int nfree_reads = 0, nfree_writes = 0, i, head, tail;
+    uint64_t read_requested = 0, deadline = 0, written_done = 0, submitted = 0, credit;
+    struct io_uring_sqe *prev;
+    struct io_uring_cqe *cqe;
+    struct uring ring;
+    struct pollfd pfd;
+    uint64_t slot;
+    size_t len;
+    int res;
+
+    if (!bufs || !free_reads || !write_start || !free_writes) {
+        run_error(run, "calloc", ENOMEM);
+        goto out_free;
+    }
+
+    if (uring_init(&ring, 2 * run->depth)) {
+        run_error(run, "io_uring_setup", errno);
+        goto out;
+    }
+
+    for (i = 0; i < run->depth; i++) {
+        bufs[i] = malloc(run->size);
+        if (!bufs[i]) {
+            run_error(run, "malloc", ENOMEM);
+            goto out;
+        }
+        free_reads[nfree_reads++] = i;
+        free_writes[nfree_writes++] = i;
+    }
+
+    run->start_ns = run->end_ns = now_ns();
+    while (!run->abort) {
+        if (!run->stop && now_ns() - run->start_ns >= opt.duration * 1e9) {
+            run->stop = 1;
+            deadline = now_ns() + opt.drain * 1e9;
+        }
+        if (run->stop && nfree_writes == run->depth && run->bytes_read >= written_done)
+            break;
+        if (run->stop && now_ns() > deadline) {
+            run_error(run, "read drain", ETIMEDOUT);
+            break;
+        }
+
+        /*Writes are queued in stream order, each timed from its submission. The
+          links run them one after another, a new chain can't start before the
+          last one is done without racing it*/
+        prev = NULL;
+        if (!run->stop && nfree_writes == run->depth) {
+            while (nfree_writes) {
+                if (prev)
+                    prev->flags |= IOSQE_IO_LINK;
+                slot = free_writes[--nfree_writes];
+                write_start[slot] = now_ns();
+                lat_push(run, submitted + run->size, write_start[slot]);
+                prev = uring_prep(&ring, IORING_OP_WRITE, run->fd,
+                                  (void *)(run->pattern + submitted % PATTERN_PERIOD), run->size, URING_WRITE | slot);
+                submitted += run->size;
+            }
+        }
+
+        /*Reads never ask for more than has been sent, so every queued read completes.
+          A short read breaks the chain, the reads behind it come back cancelled*/
+        prev = NULL;
+        if (nfree_reads == run->depth) {
+            while (nfree_reads && (credit = written_done - run->bytes_read - read_requested)) {
+                if (prev)
+                    prev->flags |= IOSQE_IO_LINK;
+                len = credit < run->size ? credit : run->size;
+                slot = free_reads[--nfree_reads];
+                prev = uring_prep(&ring, IORING_OP_READ, run->fd, bufs[slot], len, slot | (uint64_t)len << 32);
+                read_requested += len;
+            }
+        }
+
+        if (ring.to_submit) {
+            res = syscall(__NR_io_uring_enter, ring.fd, ring.to_submit, 0, 0, NULL, 0);
+            if (res < 0) {
+                if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                    continue;
+                run_error(run, "io_uring_enter", errno);
+                break;
+            }
+            ring.to_submit -= res;
+        }
+
+        head = *ring.cq_head;
+        tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            /*The ring fd polls readable once a completion is posted*/
+            pfd.fd = ring.fd;
+            pfd.events = POLLIN;
+            poll(&pfd, 1, 100);
+            continue;
+        }
+
+        for (; head != tail; head++) {
+            cqe = &ring.cqes[head & *ring.cq_mask];
+            slot = cqe->user_data;
+
+            if (slot & URING_WRITE) {
+                free_writes[nfree_writes++] = slot & ~URING_WRITE;
+                if (cqe->res < 0)
+                    run_error(run, "write", -cqe->res);
+                else {
+                    /*A short write leaves a hole the reader would wait for forever*/
+                    if ((size_t)cqe->res != run->size)
+                        run_error(run, "short write", EIO);
+                    written_done += cqe->res;
+                    run->bytes_written = written_done;
+                    run->writes++;
+                }
+                continue;
+            }
+
+            free_reads[nfree_reads++] = slot & 0xffffffff;
+            read_requested -= slot >> 32;
+            if (cqe->res < 0) {
+                if (cqe->res != -EAGAIN && cqe->res != -EINTR && cqe->res != -ECANCELED)
+                    run_error(run, "read", -cqe->res);
+                continue;
+            }
+            read_done(run, bufs[slot & 0xffffffff], cqe->res);
+            run->end_ns = now_ns();
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+out:
+    /*Closing the ring cancels what is still queued*/
+    uring_exit(&ring);
+    for (i = 0; bufs && i < run->depth; i++)
+        free(bufs[i]);
+out_free:
+    free(bufs);
+    free(free_reads);
+    free(write_start);
+    free(free_writes);
+}
+
+/**************************mmap mode*********************************/
+/*Time switch reports from interrupt_handler() to the mapped page*/
+static void run_mmap(struct run * run) {
+    const volatile struct osrfx2_shared_state *state;
+    struct osrfx2_switch_event events[64];
+    uint32_t seq, last_events;
+    uint64_t timestamp;
+    struct pollfd pfd;
+    int mode = OSRFX2_READ_RECORDS;
+    uint32_t count;
+    void *page;
+
+    page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, run->fd, 0);
+    if (page == MAP_FAILED) {
+        run_error(run, "mmap", errno);
+        return;
+    }
+    state = page;
+
+    /*Records are read only to rearm poll(), they are smaller than text*/
+    if (ioctl(run->fd, OSRFX2_IOC_SET_READ_MODE, &mode))
+        run_error(run, "OSRFX2_IOC_SET_READ_MODE", errno);
+
+    last_events = state->events;
+    run->start_ns = run->end_ns = now_ns();
+
+    while (!run->abort && now_ns() - run->start_ns < opt.duration * 1e9) {
+        pfd.fd = run->fd;
+        pfd.events = POLLIN | POLLPRI;
+        if (poll(&pfd, 1, 100) <= 0)
+            continue;
+
+        /*seqlock snapshot*/
+        do {
+            seq = __atomic_load_n(&state->seqcount, __ATOMIC_ACQUIRE);
+            count = state->events;
+            timestamp = state->timestamp_ns;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while ((seq & 1) || seq != __atomic_load_n(&state->seqcount, __ATOMIC_ACQUIRE));
+
+        if (count != last_events) {
+            hist_add(&run->hist, now_ns() - timestamp);
+            run->reads++;
+            run->lost += count - last_events - 1;   /*Reports overwritten before we looked*/
+            last_events = count;
+            run->end_ns = now_ns();
+        }
+
+        while (read(run->fd, events, sizeof(events)) > 0)
+            ;
+    }
+
+    munmap(page, sysconf(_SC_PAGESIZE));
+}
+
+/**************************Measurement*******************************/
+static int perf_open(struct run * run) {
+    struct perf_event_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.disabled = 1;
+    attr.inherit = 1;               /*Threads created during the run*/
+    attr.exclude_hv = 1;
+
+    /*Kernel cycles are most of the story, user cycles alone are a fallback*/
+    run->cycles_scope = "all";
+    fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd < 0) {
+        attr.exclude_kernel = 1;
+        run->cycles_scope = "user";
+        fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    if (fd < 0)
+        run->cycles_scope = NULL;
+
+    return fd;
+}
+
+static uint64_t cpu_time_ns(void) {
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ull +
+           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ull;
+}
+
+static void build_pattern(unsigned char * pattern, size_t len) {
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        pattern[i] = i % PATTERN_PERIOD;
+}
+
+static void run_one(struct run * run) {
+    static struct lat_ring lat;
+    unsigned char *pattern = NULL;
+    int flags = O_RDWR, perf, stream = OSRFX2_READ_STREAM;
+    uint64_t cpu;
+
+    run->cycles = -1;
+    memset(&lat, 0, sizeof(lat));
+    run->lat = &lat;
+
+    if (run->mode == MODE_MMAP)
+        flags = O_RDONLY | O_NONBLOCK;
+    else if (run->mode == MODE_EPOLL)
+        flags |= O_NONBLOCK;
+
+    run->fd = open(opt.device, flags);
+    if (run->fd < 0) {
+        run_error(run, opt.device, errno);
+        return;
+    }
+
+    if (run->mode != MODE_MMAP) {
+        pattern = malloc(PATTERN_PERIOD + run->size);
+        if (!pattern) {
+            run_error(run, "malloc", ENOMEM);
+            goto out;
+        }
+        build_pattern(pattern, PATTERN_PERIOD + run->size);
+        run->pattern = pattern;
+
+        /*A previous user may have left the file in message mode, which is per open file
+          anyway, so this only fails on drivers without bulk support*/
+        if (ioctl(run->fd, OSRFX2_IOC_SET_READ_MODE, &stream) && errno != ENOTTY) {
+            run_error(run, "OSRFX2_IOC_SET_READ_MODE", errno);
+            goto out;
+        }
+    }
+
+    perf = perf_open(run);
+    cpu = cpu_time_ns();
+    if (perf >= 0)
+        ioctl(perf, PERF_EVENT_IOC_ENABLE, 0);
+
+    switch (run->mode) {
+    case MODE_SYNC:
+    case MODE_VECTORED:
+        run_threaded(run);
+        break;
+    case MODE_EPOLL:
+        run_epoll(run);
+        break;
+    case MODE_URING:
+        run_uring(run);
+        break;
+    case MODE_MMAP:
+        run_mmap(run);
+        break;
+    }
+
+    if (perf >= 0) {
+        int64_t cycles;
+
+        ioctl(perf, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(perf, &cycles, sizeof(cycles)) == sizeof(cycles))
+            run->cycles = cycles;
+        close(perf);
+    }
+    run->cpu_ns = cpu_time_ns() - cpu;
+
+    if (run->mode != MODE_MMAP && run->bytes_written > run->bytes_read)
+        run->lost = run->bytes_written - run->bytes_read;
+
+out:
+    close(run->fd);
+    free(pattern);
+}
+
+/*****************************Output*********************************/
+static void read_params(void) {
+    char path[512], link[1024], *module;
+    const char *name = strrchr(opt.device, '/');
+    struct dirent *de;
+    ssize_t len;
+    DIR *dir;
+    FILE *f;
+
+    /*The misc class device links to the interface, which links to the bound driver's module*/
+    name = name ? name + 1 : opt.device;
+    snprintf(path, sizeof(path), "/sys/class/usbmisc/%s/device/driver/module", name);
+    len = readlink(path, link, 256);
+    if (len < 0)
+        return;
+    link[len] = '\0';
+    module = strrchr(link, '/') ? strrchr(link, '/') + 1 : link;
+
+    snprintf(path, sizeof(path), "/sys/module/%.255s/parameters", module);
+    dir = opendir(path);
+    if (!dir)
+        return;
+
+    while ((de = readdir(dir)) && nparams < MAX_PARAMS) {
+        if (de->d_name[0] == '.')
+            continue;
+
+        snprintf(link, sizeof(link), "%s/%s", path, de->d_name);
+        f = fopen(link, "r");
+        if (!f)
+            continue;
+        if (fgets(params[nparams].value, sizeof(params[nparams].value), f)) {
+            params[nparams].value[strcspn(params[nparams].value, "\n")] = '\0';
+            snprintf(params[nparams].name, sizeof(params[nparams].name), "%.47s", de->d_name);
+            nparams++;
+        }
+        fclose(f);
+    }
+
+    closedir(dir);
+}
+
+static void print_json_string(const char * s) {
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            printf("\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            printf("\\u%04x", *s);
+        else
+            putchar(*s);
+    }
+    putchar('"');
+}
+
+/*Transfers per direction in flight at once, a uring chain runs its links in turn*/
+static unsigned int run_inflight(const struct run * run) {
+    return run->mode == MODE_URING ? 1 : run->depth;
+}
+
+static void print_json(const struct run * run, const char * kernel) {
+    double secs = (run->end_ns - run->start_ns) / 1e9;
+    uint64_t ops = run->mode == MODE_MMAP ? run->reads : run->writes;
+    unsigned int i;
+
+    printf("{\"tool\":\"fx2bench\",\"kernel\":");
+    print_json_string(kernel);
+    printf(",\"device\":");
+    print_json_string(opt.device);
+    printf(",\"mode\":\"%s\"", mode_names[run->mode]);
+
+    if (run->mode == MODE_MMAP)
+        printf(",\"size\":null,\"depth\":null,\"inflight\":null");
+    else
+        printf(",\"size\":%zu,\"depth\":%u,\"inflight\":%u", run->size, run->depth, run_inflight(run));
+    if (run->mode == MODE_VECTORED)
+        printf(",\"iovecs\":%u", opt.iovecs);
+
+    printf(",\"seconds\":%.6f,\"bytes\":%llu,\"writes\":%llu,\"reads\":%llu",
+           secs, (unsigned long long)run->bytes_read,
+           (unsigned long long)run->writes, (unsigned long long)run->reads);
+
+    if (run->mode == MODE_MMAP || secs <= 0)
+        printf(",\"mb_per_s\":null");
+    else
+        printf(",\"mb_per_s\":%.3f", run->bytes_read / secs / 1e6);
+    printf(",\"ops_per_s\":%.1f", secs > 0 ? ops / secs : 0.0);
+
+    if (run->cycles >= 0 && run->bytes_read)
+        printf(",\"cycles_per_byte\":%.3f", (double)run->cycles / run->bytes_read);
+    else
+        printf(",\"cycles_per_byte\":null");
+    if (run->cycles >= 0 && ops)
+        printf(",\"cycles_per_op\":%.1f", (double)run->cycles / ops);
+    else
+        printf(",\"cycles_per_op\":null");
+    printf(",\"cycles_scope\":");
+    if (run->cycles_scope)
+        print_json_string(run->cycles_scope);
+    else
+        printf("null");
+    printf(",\"cpu_ns_per_byte\":");
+    if (run->bytes_read)
+        printf("%.3f", (double)run->cpu_ns / run->bytes_read);
+    else
+        printf("null");
+
+    printf(",\"latency_ns\":{\"samples\":%llu,\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+           (unsigned long long)run->hist.count,
+           (unsigned long long)hist_percentile(&run->hist, 0.50),
+           (unsigned long long)hist_percentile(&run->hist, 0.99),
+           (unsigned long long)hist_percentile(&run->hist, 0.999),
+           (unsigned long long)run->hist.max);
+
+    printf(",\"mismatches\":%llu,\"lost\":%llu,\"error\":",
+           (unsigned long long)run->mismatches, (unsigned long long)run->lost);
+    if (run->error[0])
+        print_json_string(run->error);
+    else
+        printf("null");
+
+    printf(",\"params\":{");
+    for (i = 0; i < nparams; i++) {
+        printf(i ? "," : "");
+        print_json_string(params[i].name);
+        putchar(':');
+        print_json_string(params[i].value);
+    }
+    printf("}}\n");
+    fflush(stdout);
+}
+
+static void print_text(const struct run * run) {
+    double secs = (run->end_ns - run->start_ns) / 1e9;
+    uint64_t ops = run->mode == MODE_MMAP ? run->reads : run->writes;
+    char cycles[16] = "-";
+
+    if (run->cycles >= 0 && run->bytes_read)
+        snprintf(cycles, sizeof(cycles), "%.2f", (double)run->cycles / run->bytes_read);
+
+    printf("%-8s %8zu %5u %10.2f %10.0f %8s %10llu %10llu %10llu %s\n",
+           mode_names[run->mode], run->mode == MODE_MMAP ? 0 : run->size, run->mode == MODE_MMAP ? 0 : run->depth,
+           secs > 0 ? run->bytes_read / secs / 1e6 : 0.0, secs > 0 ? ops / secs : 0.0, cycles,
+           (unsigned long long)hist_percentile(&run->hist, 0.50) / 1000,
+           (unsigned long long)hist_percentile(&run->hist, 0.99) / 1000,
+           (unsigned long long)hist_percentile(&run->hist, 0.999) / 1000,
+           run->error[0] ? run->error : "");
+    fflush(stdout);
+}
+
+/*****************************Options********************************/
+/*Comma separated list of sizes, with k and m suffixes*/
+static unsigned int parse_list(const char * arg, size_t * out, unsigned int max) {
+    unsigned int n = 0;
+    char *end;
+
+    while (*arg && n < max) {
+        out[n] = strtoul(arg, &end, 0);
+        if (*end == 'k' || *end == 'K')
+            out[n] <<= 10, end++;
+        else if (*end == 'm' || *end == 'M')
+            out[n] <<= 20, end++;
+        if (end == arg || !out[n] || (*end && *end != ','))
+            return 0;
+        n++;
+        arg = *end ? end + 1 : end;
+    }
+
+    return n;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: fx2bench [options]\n"
+            "  --device PATH        character device (default /dev/usb/osrfx2_0)\n"
+            "  --modes LIST         sync,vectored,epoll,uring,mmap (default all but mmap)\n"
+            "  --sizes LIST         transfer sizes, k and m suffixes (default 512,4k,64k)\n"
+            "  --depths LIST        queue depths of epoll, batch sizes of uring (default 1,4,16)\n"
+            "  --iovecs N           segments per vectored transfer (default 4)\n"
+            "  --duration SECONDS   length of each run (default 2)\n"
+            "  --drain SECONDS      wait for looped back data after a run (default 2)\n"
+            "  --text               a table instead of JSON lines\n");
+    exit(2);
+}
+
+static void parse_options(int argc, char ** argv) {
+    static const struct option options[] = {
+        { "device",   required_argument, NULL, 'd' },
+        { "modes",    required_argument, NULL, 'm' },
+        { "sizes",    required_argument, NULL, 's' },
+        { "depths",   required_argument, NULL, 'q' },
+        { "iovecs",   required_argument, NULL, 'i' },
+        { "duration", required_argument, NULL, 't' },
+        { "drain",    required_argument, NULL, 'D' },
+        { "text",     no_argument,       NULL, 'T' },
+        { "help",     no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    size_t list[32];
+    char *modes, *tok, *save;
+    unsigned int i, n;
+    int c, m;
+
+    while ((c = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+        switch (c) {
+        case 'd': opt.device = optarg; break;
+        case 'm':
+            modes = strdup(optarg);
+            for (tok = strtok_r(modes, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+                for (m = 0; m < MODE_COUNT && strcmp(tok, mode_names[m]); m++)
+                    ;
+                if (m == MODE_COUNT)
+                    usage();
+                opt.modes[m] = 1;
+            }
+            free(modes);
+            break;
+        case 's':
+            opt.nsizes = parse_list(optarg, opt.sizes, 32);
+            if (!opt.nsizes)
+                usage();
+            break;
+        case 'q':
+            n = parse_list(optarg, list, 32);
+            if (!n)
+                usage();
+            for (i = 0; i < n; i++)
+                opt.depths[i] = list[i];
+            opt.ndepths = n;
+            break;
+        case 'i':
+            opt.iovecs = strtoul(optarg, NULL, 0);
+            if (!opt.iovecs || opt.iovecs > MAX_IOVECS)
+                usage();
+            break;
+        case 't': opt.duration = strtod(optarg, NULL); break;
+        case 'D': opt.drain = strtod(optarg, NULL); break;
+        case 'T': opt.text = 1; break;
+        default:  usage();
+        }
+    }
+
+    for (m = 0; m < MODE_COUNT && !opt.modes[m]; m++)
+        ;
+    if (m == MODE_COUNT)
+        for (m = 0; m < MODE_MMAP; m++)
+            opt.modes[m] = 1;
+
+    if (!opt.nsizes) {
+        opt.sizes[opt.nsizes++] = 512;
+        opt.sizes[opt.nsizes++] = 4096;
+        opt.sizes[opt.nsizes++] = 65536;
+    }
+    if (!opt.ndepths) {
+        opt.depths[opt.ndepths++] = 1;
+        opt.depths[opt.ndepths++] = 4;
+        opt.depths[opt.ndepths++] = 16;
+    }
+}
+
+int main(int argc, char ** argv) {
+    static struct run run;
+    struct utsname uts;
+    unsigned int s, d;
+    int m;
+
+    parse_options(argc, argv);
+    uname(&uts);
+    read_params();
+    signal(SIGPIPE, SIG_IGN);
+
+    if (opt.text) {
+        if (opt.modes[MODE_URING])
+            printf("# uring depth is a batch size, its linked transfers run one at a time\n");
+        printf("%-8s %8s %5s %10s %10s %8s %10s %10s %10s %s\n",
+               "mode", "size", "depth", "MB/s", "ops/s", "cyc/B", "p50 us", "p99 us", "p999 us", "error");
+    }
+
+    for (m = 0; m < MODE_COUNT; m++) {
+        if (!opt.modes[m])
+            continue;
+
+        for (s = 0; s < opt.nsizes; s++) {
+            for (d = 0; d < opt.ndepths; d++) {
+                /*Blocking modes have one transfer per direction in flight,
+                  mmap has neither size nor depth: one run each*/
+                if ((m == MODE_SYNC || m == MODE_VECTORED) && d)
+                    break;
+                if (m == MODE_MMAP && (s || d))
+                    break;
+
+                memset(&run, 0, sizeof(run));
+                run.mode  = m;
+                run.size  = opt.sizes[s];
+                run.depth = m == MODE_SYNC || m == MODE_VECTORED ? 1 : opt.depths[d];
+
+                run_one(&run);
+
+                if (opt.text)
+                    print_text(&run);
+                else
+                    print_json(&run, uts.release);
+            }
+        }
+    }
+
+    return 0;
+}
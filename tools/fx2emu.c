@@ -0,0 +1,865 @@
+/************************************************
+ * OSR FX2 firmware emulator on USB raw-gadget  *
+ * Runs the board's USB side in userspace, so   *
+ * the drivers can be tested without hardware   *
+ ************************************************/
+
+/*
+ * Setup on any Linux box:
+ *
+ *   modprobe dummy_hcd          (a UDC and a host controller wired together)
+ *   modprobe raw_gadget
+ *   ./fx2emu &                  (the emulated board shows up as 0547:1002)
+ *   insmod src/reduced.ko
+ *
+ * The emulation follows the OSR FX2 learning kit firmware:
+ *   EP1 IN  interrupt, one byte switch report whenever the switches change
+ *   EP6 OUT bulk, looped back to
+ *   EP8 IN  bulk
+ *   vendor requests D4/DB (7 segment), D6 (switches), D7/D8 (bargraph), D9 (high speed)
+ *
+ * Switch changes and loopback bandwidth are set with options and can be
+ * changed while running by writing commands, one per line, to stdin or
+ * to the --control FIFO:
+ *
+ *   switches <byte>           report this switch state now
+ *   switch-rate <hz>          change the switches this often, 0 = never
+ *   switch-pattern <name>     count, walk or random
+ *   bandwidth <bytes/s>       loopback limit, 0 = as fast as the bus goes
+ *   stats                     print the counters on stdout
+ *   quit
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+
+#include "../src/osrfx2.h"
+
+#define VENDOR_ID       0x0547
+#define PRODUCT_ID      0x1002
+
+/*Endpoint addresses of the FX2 firmware*/
+#define EP_INT_IN       (USB_DIR_IN  | 1)
+#define EP_BULK_OUT     (USB_DIR_OUT | 6)
+#define EP_BULK_IN      (USB_DIR_IN  | 8)
+
+#define EP0_MAX_DATA    256
+#define BULK_IO_MAX     (64 * 1024)     /*Largest single raw-gadget transfer*/
+
+#define STRING_MANUFACTURER  1
+#define STRING_PRODUCT       2
+#define STRING_SERIAL        3
+
+/*Switch patterns of the automatic changes*/
+enum { PATTERN_COUNT, PATTERN_WALK, PATTERN_RANDOM };
+
+static const char * const pattern_names[] = { "count", "walk", "random" };
+
+/*Control request as fetched from raw-gadget*/
+struct ctrl_event {
+    struct usb_raw_event   inner;
+    struct usb_ctrlrequest ctrl;
+    char                   data[EP0_MAX_DATA];
+};
+
+/*ep0 data stage*/
+struct ctrl_io {
+    struct usb_raw_ep_io   inner;
+    char                   data[EP0_MAX_DATA];
+};
+
+/*Bulk and interrupt transfers*/
+struct bulk_io {
+    struct usb_raw_ep_io   inner;
+    char                   data[BULK_IO_MAX];
+};
+
+/*Emulated board*/
+static struct {
+    int fd;                         /*raw-gadget file*/
+    int high_speed;                 /*boolean, enumerated at high speed*/
+    int configured;                 /*boolean, endpoints are enabled*/
+    int ep_int_in, ep_bulk_out, ep_bulk_in;   /*raw-gadget endpoint handles*/
+    unsigned int bulk_maxp;
+
+    pthread_mutex_t lock;           /*Protects everything below*/
+    pthread_cond_t  changed;        /*Any state below changed*/
+    volatile sig_atomic_t stop;
+
+    unsigned char switches;
+    unsigned char segments;
+    unsigned char bargraph;
+    int report_pending;             /*boolean, switches not yet reported*/
+    unsigned int switch_rate;       /*Automatic changes per second, 0 = none*/
+    int switch_pattern;
+
+    unsigned char * fifo;           /*Loopback buffer from EP6 to EP8*/
+    size_t fifo_size, fifo_head, fifo_len;
+    uint64_t bandwidth;             /*Loopback limit in bytes per second, 0 = none*/
+
+    uint64_t bytes_out, bytes_in;   /*Counters for the stats command*/
+    uint64_t reports;
+    uint64_t vendor_requests;
+} fx2 = {
+    .lock    = PTHREAD_MUTEX_INITIALIZER,
+    .changed = PTHREAD_COND_INITIALIZER,
+};
+
+static const char * control_path;   /*--control FIFO, NULL = stdin*/
+
+static void die(const char * fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void deadline_after_ns(struct timespec * ts, uint64_t ns) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ns += ts->tv_nsec;
+    ts->tv_sec += ns / 1000000000ull;
+    ts->tv_nsec = ns % 1000000000ull;
+}
+
+/**************************Descriptors*******************************/
+static struct usb_device_descriptor device_desc = {
+    .bLength            = USB_DT_DEVICE_SIZE,
+    .bDescriptorType    = USB_DT_DEVICE,
+    .bcdUSB             = 0x0200,
+    .bDeviceClass       = 0,
+    .bMaxPacketSize0    = 64,
+    .idVendor           = VENDOR_ID,
+    .idProduct          = PRODUCT_ID,
+    .bcdDevice          = 0x0000,
+    .iManufacturer      = STRING_MANUFACTURER,
+    .iProduct           = STRING_PRODUCT,
+    .iSerialNumber      = STRING_SERIAL,
+    .bNumConfigurations = 1,
+};
+
+static struct usb_qualifier_descriptor qualifier_desc = {
+    .bLength            = sizeof(struct usb_qualifier_descriptor),
+    .bDescriptorType    = USB_DT_DEVICE_QUALIFIER,
+    .bcdUSB             = 0x0200,
+    .bMaxPacketSize0    = 64,
+    .bNumConfigurations = 1,
+};
+
+static struct usb_config_descriptor config_desc = {
+    .bLength             = USB_DT_CONFIG_SIZE,
+    .bDescriptorType     = USB_DT_CONFIG,
+    .bNumInterfaces      = 1,
+    .bConfigurationValue = 1,
+    .bmAttributes        = USB_CONFIG_ATT_ONE,
+    .bMaxPower           = 50,      /*100 mA*/
+};
+
+static struct usb_interface_descriptor interface_desc = {
+    .bLength            = USB_DT_INTERFACE_SIZE,
+    .bDescriptorType    = USB_DT_INTERFACE,
+    .bInterfaceNumber   = 0,
+    .bNumEndpoints      = 3,
+    .bInterfaceClass    = USB_CLASS_VENDOR_SPEC,
+};
+
+static struct usb_endpoint_descriptor int_in_desc = {
+    .bLength            = USB_DT_ENDPOINT_SIZE,
+    .bDescriptorType    = USB_DT_ENDPOINT,
+    .bEndpointAddress   = EP_INT_IN,
+    .bmAttributes       = USB_ENDPOINT_XFER_INT,
+    .wMaxPacketSize     = 1,
+};
+
+static struct usb_endpoint_descriptor bulk_out_desc = {
+    .bLength            = USB_DT_ENDPOINT_SIZE,
+    .bDescriptorType    = USB_DT_ENDPOINT,
+    .bEndpointAddress   = EP_BULK_OUT,
+    .bmAttributes       = USB_ENDPOINT_XFER_BULK,
+};
+
+static struct usb_endpoint_descriptor bulk_in_desc = {
+    .bLength            = USB_DT_ENDPOINT_SIZE,
+    .bDescriptorType    = USB_DT_ENDPOINT,
+    .bEndpointAddress   = EP_BULK_IN,
+    .bmAttributes       = USB_ENDPOINT_XFER_BULK,
+};
+
+/*Fill in the speed dependent fields before enumeration*/
+static void set_speed(int high_speed) {
+    fx2.high_speed = high_speed;
+    fx2.bulk_maxp  = high_speed ? 512 : 64;
+
+    bulk_out_desc.wMaxPacketSize = fx2.bulk_maxp;
+    bulk_in_desc.wMaxPacketSize  = fx2.bulk_maxp;
+
+    /*1 ms either way, high speed counts in 2^(n-1) microframes*/
+    int_in_desc.bInterval = high_speed ? 4 : 1;
+}
+
+/*Configuration descriptor with its interface and endpoints, type selects
+  USB_DT_CONFIG or USB_DT_OTHER_SPEED_CONFIG*/
+static int build_config(char * buf, size_t size, int type) {
+    const struct usb_endpoint_descriptor *eps[] = { &int_in_desc, &bulk_out_desc, &bulk_in_desc };
+    struct usb_config_descriptor *config = (struct usb_config_descriptor *)buf;
+    size_t len = 0;
+    size_t i;
+
+    if (size < USB_DT_CONFIG_SIZE + USB_DT_INTERFACE_SIZE + 3 * USB_DT_ENDPOINT_SIZE)
+        return -1;
+
+    memcpy(buf, &config_desc, USB_DT_CONFIG_SIZE);
+    len += USB_DT_CONFIG_SIZE;
+    memcpy(buf + len, &interface_desc, USB_DT_INTERFACE_SIZE);
+    len += USB_DT_INTERFACE_SIZE;
+
+    for (i = 0; i < 3; i++) {
+        memcpy(buf + len, eps[i], USB_DT_ENDPOINT_SIZE);
+        len += USB_DT_ENDPOINT_SIZE;
+    }
+
+    config->bDescriptorType = type;
+    config->wTotalLength = len;
+
+    return len;
+}
+
+/*String descriptor index as UTF-16LE*/
+static int build_string(char * buf, size_t size, int index) {
+    static const char * const strings[] = {
+        [STRING_MANUFACTURER] = "OSR",
+        [STRING_PRODUCT]      = "OSR USB-FX2 Learning Kit (emulated)",
+        [STRING_SERIAL]       = "fx2emu",
+    };
+    const char *s;
+    size_t i, len;
+
+    /*String 0 lists the supported languages, US English only*/
+    if (index == 0) {
+        buf[0] = 4;
+        buf[1] = USB_DT_STRING;
+        buf[2] = 0x09;
+        buf[3] = 0x04;
+        return 4;
+    }
+
+    if (index >= (int)(sizeof(strings) / sizeof(strings[0])) || !strings[index])
+        return -1;
+
+    s = strings[index];
+    len = 2 + 2 * strlen(s);
+    if (len > size || len > 255)
+        return -1;
+
+    buf[0] = len;
+    buf[1] = USB_DT_STRING;
+    for (i = 0; s[i]; i++) {
+        buf[2 + 2 * i] = s[i];
+        buf[3 + 2 * i] = 0;
+    }
+
+    return len;
+}
+
+/**************************raw-gadget********************************/
+static int ep0_write(const void * data, size_t len) {
+    struct ctrl_io io;
+
+    io.inner.ep = 0;
+    io.inner.flags = 0;
+    io.inner.length = len;
+    memcpy(io.data, data, len);
+
+    return ioctl(fx2.fd, USB_RAW_IOCTL_EP0_WRITE, &io);
+}
+
+/*Receive the data stage of an OUT request, or acknowledge one without data*/
+static int ep0_read(void * data, size_t len) {
+    struct ctrl_io io;
+    int retval;
+
+    io.inner.ep = 0;
+    io.inner.flags = 0;
+    io.inner.length = len;
+
+    retval = ioctl(fx2.fd, USB_RAW_IOCTL_EP0_READ, &io);
+    if (retval > 0 && data)
+        memcpy(data, io.data, retval);
+
+    return retval;
+}
+
+static void ep0_stall(void) {
+    if (ioctl(fx2.fd, USB_RAW_IOCTL_EP0_STALL, 0) < 0)
+        perror("fx2emu: ep0 stall");
+}
+
+static int ep_enable(struct usb_endpoint_descriptor * desc) {
+    int handle = ioctl(fx2.fd, USB_RAW_IOCTL_EP_ENABLE, desc);
+
+    if (handle < 0)
+        die("fx2emu: enabling endpoint %02x failed: %s (does the UDC have a free %s endpoint?)",
+            desc->bEndpointAddress, strerror(errno),
+            (desc->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) == USB_ENDPOINT_XFER_INT ? "interrupt" : "bulk");
+
+    return handle;
+}
+
+/*Bulk or interrupt transfer, returns the bytes moved or -1 with errno set*/
+static int ep_io(unsigned long request, int ep, struct bulk_io * io, size_t len) {
+    io->inner.ep = ep;
+    io->inner.flags = 0;
+    io->inner.length = len;
+
+    return ioctl(fx2.fd, request, io);
+}
+
+/************************Loopback EP6 -> EP8*************************/
+/*Receive EP6 data into the FIFO, pacing it to the configured bandwidth*/
+static void * bulk_out_thread(void * arg) {
+    static struct bulk_io io;
+    uint64_t next_ns = 0, bandwidth = 0, now;
+    size_t room, first, tail;
+    int len;
+
+    (void)arg;
+
+    while (!fx2.stop) {
+        /*Leave the host NAKed while no packet buffer is free, as the FX2 does*/
+        pthread_mutex_lock(&fx2.lock);
+        while (!fx2.stop && fx2.fifo_size - fx2.fifo_len < fx2.bulk_maxp)
+            pthread_cond_wait(&fx2.changed, &fx2.lock);
+        room = fx2.fifo_size - fx2.fifo_len;
+        if (fx2.bandwidth != bandwidth) {
+            bandwidth = fx2.bandwidth;
+            next_ns = 0;
+        }
+        pthread_mutex_unlock(&fx2.lock);
+
+        if (fx2.stop)
+            break;
+
+        /*Whole packets only, a short read would end the host's transfer early*/
+        room = room < BULK_IO_MAX ? room : BULK_IO_MAX;
+        room -= room % fx2.bulk_maxp;
+
+        len = ep_io(USB_RAW_IOCTL_EP_READ, fx2.ep_bulk_out, &io, room);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            if (!fx2.stop)
+                perror("fx2emu: EP6 read");
+            break;
+        }
+
+        /*Only this thread adds to the FIFO, the read fits in the room seen above*/
+        pthread_mutex_lock(&fx2.lock);
+        tail = (fx2.fifo_head + fx2.fifo_len) % fx2.fifo_size;
+        first = fx2.fifo_size - tail < (size_t)len ? fx2.fifo_size - tail : (size_t)len;
+        memcpy(fx2.fifo + tail, io.data, first);
+        memcpy(fx2.fifo, io.data + first, len - first);
+        fx2.fifo_len += len;
+        fx2.bytes_out += len;
+        pthread_cond_broadcast(&fx2.changed);
+        pthread_mutex_unlock(&fx2.lock);
+
+        /*Token bucket of one transfer*/
+        if (bandwidth) {
+            now = now_ns();
+            if (!next_ns || next_ns < now)
+                next_ns = now;
+            next_ns += (uint64_t)len * 1000000000ull / bandwidth;
+            if (next_ns > now) {
+                struct timespec ts = {
+                    .tv_sec  = (next_ns - now) / 1000000000ull,
+                    .tv_nsec = (next_ns - now) % 1000000000ull,
+                };
+                nanosleep(&ts, NULL);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*Send FIFO data back on EP8*/
+static void * bulk_in_thread(void * arg) {
+    static struct bulk_io io;
+    size_t len, first;
+    int sent;
+
+    (void)arg;
+
+    while (!fx2.stop) {
+        pthread_mutex_lock(&fx2.lock);
+        while (!fx2.stop && !fx2.fifo_len)
+            pthread_cond_wait(&fx2.changed, &fx2.lock);
+
+        len = fx2.fifo_len < BULK_IO_MAX ? fx2.fifo_len : BULK_IO_MAX;
+        first = fx2.fifo_size - fx2.fifo_head < len ? fx2.fifo_size - fx2.fifo_head : len;
+        memcpy(io.data, fx2.fifo + fx2.fifo_head, first);
+        memcpy(io.data + first, fx2.fifo, len - first);
+        pthread_mutex_unlock(&fx2.lock);
+
+        if (fx2.stop)
+            break;
+
+        sent = ep_io(USB_RAW_IOCTL_EP_WRITE, fx2.ep_bulk_in, &io, len);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (!fx2.stop)
+                perror("fx2emu: EP8 write");
+            break;
+        }
+
+        pthread_mutex_lock(&fx2.lock);
+        fx2.fifo_head = (fx2.fifo_head + sent) % fx2.fifo_size;
+        fx2.fifo_len -= sent;
+        fx2.bytes_in += sent;
+        pthread_cond_broadcast(&fx2.changed);
+        pthread_mutex_unlock(&fx2.lock);
+    }
+
+    return NULL;
+}
+
+/**************************Switches**********************************/
+/*Next automatic switch state, called with fx2.lock held*/
+static unsigned char next_switches(unsigned char cur) {
+    switch (fx2.switch_pattern) {
+    case PATTERN_WALK:
+        return cur ? (unsigned char)((cur << 1) | (cur >> 7)) : 1;
+    case PATTERN_RANDOM:
+        return cur ^ (1 + rand() % 255);    /*Always a change*/
+    default:
+        return cur + 1;
+    }
+}
+
+/*Report the switches on EP1 whenever they change*/
+static void * int_in_thread(void * arg) {
+    struct bulk_io *io = malloc(sizeof(*io));
+    struct timespec deadline;
+    unsigned int rate = 0;
+    int sent;
+
+    (void)arg;
+
+    if (!io)
+        die("fx2emu: out of memory");
+
+    pthread_mutex_lock(&fx2.lock);
+    while (!fx2.stop) {
+        if (!fx2.report_pending) {
+            rate = fx2.switch_rate;
+            if (!rate) {
+                pthread_cond_wait(&fx2.changed, &fx2.lock);
+                continue;
+            }
+
+            /*Woken early by commands, which may change the rate*/
+            deadline_after_ns(&deadline, 1000000000ull / rate);
+            if (pthread_cond_timedwait(&fx2.changed, &fx2.lock, &deadline) != ETIMEDOUT)
+                continue;
+
+            fx2.switches = next_switches(fx2.switches);
+        }
+
+        fx2.report_pending = 0;
+        io->data[0] = fx2.switches;
+        pthread_mutex_unlock(&fx2.lock);
+
+        /*Blocks until the host polls the endpoint*/
+        sent = ep_io(USB_RAW_IOCTL_EP_WRITE, fx2.ep_int_in, io, 1);
+
+        pthread_mutex_lock(&fx2.lock);
+        if (sent < 0 && errno != EINTR) {
+            if (!fx2.stop)
+                perror("fx2emu: EP1 write");
+            break;
+        }
+        if (sent == 1)
+            fx2.reports++;
+    }
+    pthread_mutex_unlock(&fx2.lock);
+
+    free(io);
+    return NULL;
+}
+
+/************************Control requests****************************/
+/*Answer a vendor request of the FX2 firmware, -1 to stall*/
+static int vendor_request(struct usb_ctrlrequest * ctrl) {
+    unsigned char value;
+
+    if (ctrl->bRequestType & USB_DIR_IN) {
+        pthread_mutex_lock(&fx2.lock);
+        switch (ctrl->bRequest) {
+        case OSRFX2_READ_7SEG:     value = fx2.segments;   break;
+        case OSRFX2_READ_SWITCHES: value = fx2.switches;   break;
+        case OSRFX2_READ_LEDS:     value = fx2.bargraph;   break;
+        case OSRFX2_IS_HIGH_SPEED: value = fx2.high_speed; break;
+        default:
+            pthread_mutex_unlock(&fx2.lock);
+            return -1;
+        }
+        fx2.vendor_requests++;
+        pthread_mutex_unlock(&fx2.lock);
+
+        return ep0_write(&value, ctrl->wLength < 1 ? ctrl->wLength : 1) < 0 ? -1 : 0;
+    }
+
+    if (ctrl->bRequest != OSRFX2_SET_7SEG && ctrl->bRequest != OSRFX2_SET_LEDS)
+        return -1;
+
+    /*The new value comes in the data stage*/
+    value = 0;
+    if (ep0_read(&value, ctrl->wLength < 1 ? ctrl->wLength : 1) < 0)
+        return -1;
+
+    pthread_mutex_lock(&fx2.lock);
+    if (ctrl->bRequest == OSRFX2_SET_7SEG)
+        fx2.segments = value;
+    else
+        fx2.bargraph = value;
+    fx2.vendor_requests++;
+    pthread_mutex_unlock(&fx2.lock);
+
+    return 0;
+}
+
+static void start_io_threads(void) {
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, int_in_thread, NULL) ||
+        pthread_create(&thread, NULL, bulk_out_thread, NULL) ||
+        pthread_create(&thread, NULL, bulk_in_thread, NULL))
+        die("fx2emu: creating the endpoint threads failed");
+}
+
+/*Answer a standard request, -1 to stall*/
+static int standard_request(struct usb_ctrlrequest * ctrl) {
+    char buf[EP0_MAX_DATA];
+    int len = -1;
+
+    switch (ctrl->bRequest) {
+    case USB_REQ_GET_DESCRIPTOR:
+        switch (ctrl->wValue >> 8) {
+        case USB_DT_DEVICE:
+            memcpy(buf, &device_desc, USB_DT_DEVICE_SIZE);
+            len = USB_DT_DEVICE_SIZE;
+            break;
+        case USB_DT_DEVICE_QUALIFIER:
+            memcpy(buf, &qualifier_desc, sizeof(qualifier_desc));
+            len = sizeof(qualifier_desc);
+            break;
+        case USB_DT_CONFIG:
+            len = build_config(buf, sizeof(buf), USB_DT_CONFIG);
+            break;
+        case USB_DT_OTHER_SPEED_CONFIG:
+            len = build_config(buf, sizeof(buf), USB_DT_OTHER_SPEED_CONFIG);
+            break;
+        case USB_DT_STRING:
+            len = build_string(buf, sizeof(buf), ctrl->wValue & 0xff);
+            break;
+        }
+        if (len < 0)
+            return -1;
+        if (len > ctrl->wLength)
+            len = ctrl->wLength;
+        return ep0_write(buf, len) < 0 ? -1 : 0;
+
+    case USB_REQ_GET_CONFIGURATION:
+        buf[0] = fx2.configured;
+        return ep0_write(buf, 1) < 0 ? -1 : 0;
+
+    case USB_REQ_GET_STATUS:
+        memset(buf, 0, 2);
+        return ep0_write(buf, ctrl->wLength < 2 ? ctrl->wLength : 2) < 0 ? -1 : 0;
+
+    case USB_REQ_GET_INTERFACE:
+        buf[0] = 0;
+        return ep0_write(buf, 1) < 0 ? -1 : 0;
+
+    case USB_REQ_SET_CONFIGURATION:
+        /*Endpoints stay enabled across reconfiguration, as does the FX2 firmware*/
+        if (ctrl->wValue && !fx2.configured) {
+            fx2.ep_int_in   = ep_enable(&int_in_desc);
+            fx2.ep_bulk_out = ep_enable(&bulk_out_desc);
+            fx2.ep_bulk_in  = ep_enable(&bulk_in_desc);
+
+            if (ioctl(fx2.fd, USB_RAW_IOCTL_VBUS_DRAW, config_desc.bMaxPower) < 0)
+                perror("fx2emu: vbus draw");
+            if (ioctl(fx2.fd, USB_RAW_IOCTL_CONFIGURE, 0) < 0)
+                die("fx2emu: configure failed: %s", strerror(errno));
+
+            fx2.configured = 1;
+            start_io_threads();
+        }
+        return ep0_read(NULL, 0) < 0 ? -1 : 0;
+
+    case USB_REQ_SET_INTERFACE:
+    case USB_REQ_CLEAR_FEATURE:     /*usb_clear_halt() from the drivers' open()*/
+    case USB_REQ_SET_FEATURE:
+        return ep0_read(NULL, 0) < 0 ? -1 : 0;
+    }
+
+    return -1;
+}
+
+static void * ep0_thread(void * arg) {
+    struct ctrl_event event;
+    struct usb_raw_init init;
+    const char **udc = arg;
+    int retval;
+
+    memset(&init, 0, sizeof(init));
+    snprintf((char *)init.driver_name, sizeof(init.driver_name), "%s", udc[0]);
+    snprintf((char *)init.device_name, sizeof(init.device_name), "%s", udc[1]);
+    init.speed = fx2.high_speed ? USB_SPEED_HIGH : USB_SPEED_FULL;
+
+    if (ioctl(fx2.fd, USB_RAW_IOCTL_INIT, &init) < 0)
+        die("fx2emu: binding to UDC %s/%s failed: %s", udc[0], udc[1], strerror(errno));
+    if (ioctl(fx2.fd, USB_RAW_IOCTL_RUN, 0) < 0)
+        die("fx2emu: starting the gadget failed: %s", strerror(errno));
+
+    while (!fx2.stop) {
+        event.inner.type = 0;
+        event.inner.length = sizeof(event.ctrl) + sizeof(event.data);
+
+        if (ioctl(fx2.fd, USB_RAW_IOCTL_EVENT_FETCH, &event) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (!fx2.stop)
+                perror("fx2emu: event fetch");
+            break;
+        }
+
+        if (event.inner.type != USB_RAW_EVENT_CONTROL)
+            continue;   /*Connect, and reset/suspend on newer kernels*/
+
+        if ((event.ctrl.bRequestType & USB_TYPE_MASK) == USB_TYPE_VENDOR)
+            retval = vendor_request(&event.ctrl);
+        else if ((event.ctrl.bRequestType & USB_TYPE_MASK) == USB_TYPE_STANDARD)
+            retval = standard_request(&event.ctrl);
+        else
+            retval = -1;
+
+        if (retval < 0)
+            ep0_stall();
+    }
+
+    fx2.stop = 1;
+    return NULL;
+}
+
+/**************************Commands**********************************/
+static int parse_pattern(const char * name) {
+    size_t i;
+
+    for (i = 0; i < sizeof(pattern_names) / sizeof(pattern_names[0]); i++)
+        if (!strcmp(name, pattern_names[i]))
+            return i;
+
+    return -1;
+}
+
+static void print_stats(FILE * out) {
+    pthread_mutex_lock(&fx2.lock);
+    fprintf(out, "switches=%02x segments=%02x bargraph=%02x reports=%llu vendor_requests=%llu "
+                 "bytes_out=%llu bytes_in=%llu fifo=%zu\n",
+            fx2.switches, fx2.segments, fx2.bargraph,
+            (unsigned long long)fx2.reports, (unsigned long long)fx2.vendor_requests,
+            (unsigned long long)fx2.bytes_out, (unsigned long long)fx2.bytes_in, fx2.fifo_len);
+    pthread_mutex_unlock(&fx2.lock);
+    fflush(out);
+}
+
+/*Run one command line, returns 0 to keep going*/
+static int run_command(char * line) {
+    char cmd[32], arg[32];
+    int n, pattern;
+
+    n = sscanf(line, "%31s %31s", cmd, arg);
+    if (n < 1)
+        return 0;
+
+    pthread_mutex_lock(&fx2.lock);
+
+    if (!strcmp(cmd, "switches") && n == 2) {
+        fx2.switches = strtoul(arg, NULL, 0);
+        fx2.report_pending = 1;
+    }
+    else if (!strcmp(cmd, "switch-rate") && n == 2)
+        fx2.switch_rate = strtoul(arg, NULL, 0);
+    else if (!strcmp(cmd, "switch-pattern") && n == 2 && (pattern = parse_pattern(arg)) >= 0)
+        fx2.switch_pattern = pattern;
+    else if (!strcmp(cmd, "bandwidth") && n == 2)
+        fx2.bandwidth = strtoull(arg, NULL, 0);
+    else if (!strcmp(cmd, "quit"))
+        fx2.stop = 1;
+    else if (strcmp(cmd, "stats"))
+        fprintf(stderr, "fx2emu: unknown command: %s", line);
+
+    pthread_cond_broadcast(&fx2.changed);
+    pthread_mutex_unlock(&fx2.lock);
+
+    if (!strcmp(cmd, "stats"))
+        print_stats(stdout);
+
+    return fx2.stop;
+}
+
+/*Read commands until quit, reopening the FIFO whenever a writer closes it*/
+static void command_loop(void) {
+    char line[128];
+    FILE *in;
+
+    while (!fx2.stop) {
+        in = control_path ? fopen(control_path, "r") : stdin;
+        if (!in) {
+            if (errno == EINTR)
+                continue;
+            die("fx2emu: %s: %s", control_path, strerror(errno));
+        }
+
+        while (!fx2.stop && fgets(line, sizeof(line), in))
+            if (run_command(line))
+                break;
+
+        if (!control_path) {
+            /*stdin closed, keep emulating until a signal*/
+            while (!fx2.stop)
+                pause();
+            break;
+        }
+        fclose(in);
+    }
+}
+
+static void on_signal(int sig) {
+    (void)sig;
+    fx2.stop = 1;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: fx2emu [options]\n"
+            "  --udc-driver NAME       UDC driver (default dummy_udc)\n"
+            "  --udc-device NAME       UDC device (default dummy_udc.0)\n"
+            "  --full-speed            enumerate at full speed instead of high speed\n"
+            "  --switches BYTE         initial switch state (default 0)\n"
+            "  --switch-rate HZ        automatic switch changes per second (default 0)\n"
+            "  --switch-pattern NAME   count, walk or random (default count)\n"
+            "  --bandwidth BYTES       loopback limit per second (default 0, unlimited)\n"
+            "  --fifo-size BYTES       loopback buffer, a multiple of 512 (default 4096,\n"
+            "                          the FX2's four 512 byte buffers)\n"
+            "  --control PATH          read commands from this FIFO instead of stdin\n");
+    exit(2);
+}
+
+int main(int argc, char ** argv) {
+    static const struct option options[] = {
+        { "udc-driver",     required_argument, NULL, 'd' },
+        { "udc-device",     required_argument, NULL, 'D' },
+        { "full-speed",     no_argument,       NULL, 'f' },
+        { "switches",       required_argument, NULL, 's' },
+        { "switch-rate",    required_argument, NULL, 'r' },
+        { "switch-pattern", required_argument, NULL, 'p' },
+        { "bandwidth",      required_argument, NULL, 'b' },
+        { "fifo-size",      required_argument, NULL, 'F' },
+        { "control",        required_argument, NULL, 'c' },
+        { "help",           no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    const char *udc[2] = { "dummy_udc", "dummy_udc.0" };
+    struct sigaction sa;
+    pthread_t thread;
+    int high_speed = 1;
+    int opt;
+
+    fx2.fifo_size = 4096;
+
+    while ((opt = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+        switch (opt) {
+        case 'd': udc[0] = optarg; break;
+        case 'D': udc[1] = optarg; break;
+        case 'f': high_speed = 0; break;
+        case 's': fx2.switches = strtoul(optarg, NULL, 0); break;
+        case 'r': fx2.switch_rate = strtoul(optarg, NULL, 0); break;
+        case 'p':
+            fx2.switch_pattern = parse_pattern(optarg);
+            if (fx2.switch_pattern < 0)
+                usage();
+            break;
+        case 'b': fx2.bandwidth = strtoull(optarg, NULL, 0); break;
+        case 'F': fx2.fifo_size = strtoul(optarg, NULL, 0); break;
+        case 'c': control_path = optarg; break;
+        default:  usage();
+        }
+    }
+
+    /*Whole 512 byte buffers, so a free one always takes a packet at either speed*/
+    if (fx2.fifo_size < 512 || fx2.fifo_size % 512)
+        die("fx2emu: --fifo-size must be a multiple of 512");
+
+    fx2.fifo = malloc(fx2.fifo_size);
+    if (!fx2.fifo)
+        die("fx2emu: out of memory");
+
+    set_speed(high_speed);
+
+    /*The firmware reports the switches once the host starts polling*/
+    fx2.report_pending = 1;
+
+    fx2.fd = open("/dev/raw-gadget", O_RDWR);
+    if (fx2.fd < 0)
+        die("fx2emu: /dev/raw-gadget: %s (modprobe dummy_hcd raw_gadget?)", strerror(errno));
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (pthread_create(&thread, NULL, ep0_thread, udc))
+        die("fx2emu: creating the ep0 thread failed");
+
+    command_loop();
+
+    /*Closing raw-gadget unbinds the device and fails the blocked transfers*/
+    fx2.stop = 1;
+    pthread_mutex_lock(&fx2.lock);
+    pthread_cond_broadcast(&fx2.changed);
+    pthread_mutex_unlock(&fx2.lock);
+
+    print_stats(stderr);
+    close(fx2.fd);
+
+    return 0;
+}